@@ -46,6 +46,7 @@
 #include <stdint.h>
 
 struct nbdkit_extents;
+struct nbdkit_payload;
 
 struct allocator_functions {
   /* Allocator type (eg. "sparse").
@@ -93,6 +94,17 @@ struct allocator_functions {
                 uint64_t count, uint64_t offset)
   __attribute__ ((__nonnull__ (1, 2)));
 
+  /* Like write, but receive the data from the client straight into
+   * the allocator's memory using nbdkit_payload_recv.  This is NULL
+   * if the allocator cannot do that (eg. because it compresses the
+   * data).  The client may be slow to send the data, so
+   * implementations should not hold locks needed by other requests
+   * while receiving it.
+   */
+  int (*write_payload) (struct allocator *a, struct nbdkit_payload *payload,
+                        uint64_t count, uint64_t offset)
+  __attribute__ ((__nonnull__ (1, 2)));
+
   /* Fill range [offset, offset+count-1] with a single byte ‘c’.
    * If c == '\0', this is the same as .zero below.
    */
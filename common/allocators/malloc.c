@@ -67,6 +67,9 @@ struct m_alloc {
    */
   pthread_rwlock_t lock;
   bytearray ba;
+
+  /* The size of the disk (from .set_size_hint), or 0 if not known. */
+  uint64_t size_hint;
 };
 
 static void
@@ -156,7 +159,11 @@ static int
 m_alloc_set_size_hint (struct allocator *a, uint64_t size_hint)
 {
   struct m_alloc *ma = (struct m_alloc *) a;
-  return extend (ma, size_hint);
+
+  if (extend (ma, size_hint) == -1)
+    return -1;
+  ma->size_hint = size_hint;
+  return 0;
 }
 
 static int
@@ -199,6 +206,42 @@ m_alloc_write (struct allocator *a, const void *buf,
   return 0;
 }
 
+static int
+m_alloc_write_payload (struct allocator *a, struct nbdkit_payload *payload,
+                       uint64_t count, uint64_t offset)
+{
+  struct m_alloc *ma = (struct m_alloc *) a;
+  CLEANUP_FREE char *buf = NULL;
+  char *p = NULL;
+
+  if (extend (ma, offset+count) == -1)
+    return -1;
+
+  /* Once the array has been extended to the size of the disk it is
+   * never moved again, since writes beyond the end of the disk are
+   * not possible.  The data can then be received straight into it
+   * without holding the lock while waiting for the client.
+   */
+  {
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&ma->lock);
+    if (ma->size_hint > 0 && ma->ba.cap >= ma->size_hint &&
+        offset + count <= ma->size_hint)
+      p = (char *) ma->ba.ptr + offset;
+  }
+  if (p)
+    return nbdkit_payload_recv (payload, p, count);
+
+  /* Otherwise the array may move, so use a temporary buffer. */
+  buf = malloc (count);
+  if (buf == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  if (nbdkit_payload_recv (payload, buf, count) == -1)
+    return -1;
+  return m_alloc_write (a, buf, count, offset);
+}
+
 static int
 m_alloc_fill (struct allocator *a, char c, uint64_t count, uint64_t offset)
 {
@@ -310,6 +353,7 @@ static struct allocator_functions functions = {
   .set_size_hint = m_alloc_set_size_hint,
   .read = m_alloc_read,
   .write = m_alloc_write,
+  .write_payload = m_alloc_write_payload,
   .fill = m_alloc_fill,
   .zero = m_alloc_zero,
   .blit = m_alloc_blit,
@@ -392,6 +392,107 @@ sparse_array_write (struct allocator *a,
   return r;
 }
 
+/* Make page the page containing offset, freeing any old page.  Must
+ * be called with the exclusive lock held.
+ */
+static int
+install_page (struct sparse_array *sa, uint64_t offset, void *page)
+{
+  struct l2_entry *l2_entry = NULL;
+  uint64_t n;
+
+  lookup (sa, offset, false, &n, &l2_entry);
+  if (l2_entry == NULL) {
+    /* There is no L2 directory yet, so create it (and a page). */
+    if (lookup (sa, offset, true, &n, &l2_entry) == NULL)
+      return -1;
+  }
+  free (l2_entry->page);
+  l2_entry->page = page;
+  return 0;
+}
+
+static int
+sparse_array_write_payload (struct allocator *a,
+                            struct nbdkit_payload *payload,
+                            uint64_t count, uint64_t offset)
+{
+  struct sparse_array *sa = (struct sparse_array *) a;
+  CLEANUP_FREE char *head = NULL, *tail = NULL;
+  CLEANUP_FREE void **pages = NULL;
+  uint64_t head_len, tail_len, nr_pages, i, o;
+  int r = -1;
+
+  /* The client may be slow to send the data, so no lock is held while
+   * receiving it.  Whole pages are received into new pages which are
+   * then swapped in under the exclusive lock.  Partial pages at the
+   * start and end are received into small buffers and copied.
+   */
+  head_len = (SPARSE_PAGE - (offset & (SPARSE_PAGE-1))) & (SPARSE_PAGE-1);
+  if (head_len > count)
+    head_len = count;
+  nr_pages = (count - head_len) / SPARSE_PAGE;
+  tail_len = count - head_len - nr_pages * SPARSE_PAGE;
+
+  if (head_len > 0) {
+    head = malloc (head_len);
+    if (head == NULL) {
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+    if (nbdkit_payload_recv (payload, head, head_len) == -1)
+      return -1;
+  }
+
+  if (nr_pages > 0) {
+    pages = calloc (nr_pages, sizeof *pages);
+    if (pages == NULL) {
+      nbdkit_error ("calloc: %m");
+      return -1;
+    }
+    for (i = 0; i < nr_pages; ++i) {
+      pages[i] = malloc (SPARSE_PAGE);
+      if (pages[i] == NULL) {
+        nbdkit_error ("malloc: %m");
+        goto out;
+      }
+      if (nbdkit_payload_recv (payload, pages[i], SPARSE_PAGE) == -1)
+        goto out;
+    }
+  }
+
+  if (tail_len > 0) {
+    tail = malloc (tail_len);
+    if (tail == NULL) {
+      nbdkit_error ("malloc: %m");
+      goto out;
+    }
+    if (nbdkit_payload_recv (payload, tail, tail_len) == -1)
+      goto out;
+  }
+
+  {
+    ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&sa->lock);
+
+    if (head_len > 0 && do_write (true, sa, head, head_len, offset) == -1)
+      goto out;
+    o = offset + head_len;
+    for (i = 0; i < nr_pages; ++i, o += SPARSE_PAGE) {
+      if (install_page (sa, o, pages[i]) == -1)
+        goto out;
+      pages[i] = NULL;
+    }
+    if (tail_len > 0 && do_write (true, sa, tail, tail_len, o) == -1)
+      goto out;
+  }
+  r = 0;
+
+ out:
+  for (i = 0; pages && i < nr_pages; ++i)
+    free (pages[i]);
+  return r;
+}
+
 static int sparse_array_zero (struct allocator *a,
                               uint64_t count, uint64_t offset);
 
@@ -603,6 +704,7 @@ static struct allocator_functions functions = {
   .set_size_hint = sparse_array_set_size_hint,
   .read = sparse_array_read,
   .write = sparse_array_write,
+  .write_payload = sparse_array_write_payload,
   .fill = sparse_array_fill,
   .zero = sparse_array_zero,
   .blit = sparse_array_blit,
@@ -0,0 +1,87 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Log-linear latency histograms in the style of HdrHistogram, shared
+ * by the --metrics code in the server and by contrib/loadgen.
+ *
+ * Values (normally microseconds) below 2^HISTOGRAM_SUB_BITS are
+ * recorded exactly.  Larger values up to 2^HISTOGRAM_MAX_SHIFT (about
+ * 12 days in microseconds) are recorded in 2^HISTOGRAM_SUB_BITS equal
+ * buckets per power of 2, giving a relative error of at most 12.5%.
+ * Anything larger goes in the last bucket.
+ */
+
+#ifndef NBDKIT_HISTOGRAM_H
+#define NBDKIT_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ispowerof2.h"
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_SHIFT 40
+#define HISTOGRAM_NR_BUCKETS \
+  ((HISTOGRAM_MAX_SHIFT - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+/* Return the index of the bucket which records v. */
+static inline size_t
+histogram_bucket_of (uint64_t v)
+{
+  int shift;
+
+  if (v < HISTOGRAM_SUB_BUCKETS)
+    return v;
+  shift = log_2_bits (v);
+  if (shift > HISTOGRAM_MAX_SHIFT)
+    return HISTOGRAM_NR_BUCKETS - 1;
+  return (shift - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+    ((v >> (shift - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* Return the largest value recorded in bucket i. */
+static inline uint64_t
+histogram_bucket_upper_bound (size_t i)
+{
+  int shift;
+  uint64_t sub;
+
+  if (i < HISTOGRAM_SUB_BUCKETS)
+    return i;
+  shift = i / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+  sub = i % HISTOGRAM_SUB_BUCKETS;
+  return ((HISTOGRAM_SUB_BUCKETS + sub + 1) <<
+          (shift - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+#endif /* NBDKIT_HISTOGRAM_H */
@@ -0,0 +1,84 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#undef NDEBUG /* Keep test strong even for nbdkit built without assertions */
+#include <assert.h>
+
+#include "histogram.h"
+
+int
+main (void)
+{
+  uint64_t v;
+  size_t i;
+
+  /* Small values are exact. */
+  for (v = 0; v < HISTOGRAM_SUB_BUCKETS; ++v) {
+    assert (histogram_bucket_of (v) == v);
+    assert (histogram_bucket_upper_bound (v) == v);
+  }
+
+  /* Buckets are contiguous: each starts just after the previous one
+   * ends, and every value in a bucket maps back to it.
+   */
+  for (i = HISTOGRAM_SUB_BUCKETS; i < HISTOGRAM_NR_BUCKETS; ++i) {
+    uint64_t lo = histogram_bucket_upper_bound (i-1) + 1;
+    uint64_t hi = histogram_bucket_upper_bound (i);
+
+    assert (lo <= hi);
+    assert (histogram_bucket_of (lo) == i);
+    assert (histogram_bucket_of (hi) == i);
+    /* The width of a bucket is at most 1/8 of its lower bound. */
+    assert (hi - lo + 1 <= lo / HISTOGRAM_SUB_BUCKETS);
+  }
+
+  /* Some known values. */
+  assert (histogram_bucket_of (8) == 8);
+  assert (histogram_bucket_of (15) == 15);
+  assert (histogram_bucket_of (16) == 16);
+  assert (histogram_bucket_of (17) == 16);
+  assert (histogram_bucket_upper_bound (16) == 17);
+  assert (histogram_bucket_of (1000) == 63);
+  assert (histogram_bucket_upper_bound (63) == 1023);
+
+  /* Values which are too large go in the last bucket. */
+  assert (histogram_bucket_of (UINT64_C (1) << (HISTOGRAM_MAX_SHIFT + 1)) ==
+          HISTOGRAM_NR_BUCKETS - 1);
+  assert (histogram_bucket_of (UINT64_MAX) == HISTOGRAM_NR_BUCKETS - 1);
+
+  exit (EXIT_SUCCESS);
+}
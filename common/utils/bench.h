@@ -33,40 +33,43 @@
 #ifndef LIBNBD_BENCH_H
 #define LIBNBD_BENCH_H
 
-#include <sys/time.h>
+#include <time.h>
 
-#define MICROSECONDS 1000000
+#define NANOSECONDS 1000000000
 
+/* Simple timer for benchmarks.  This uses the monotonic clock so it
+ * is not affected by changes to the system time.
+ */
 struct bench {
-  struct timeval start, stop;
+  struct timespec start, stop;
 };
 
 static inline void
 bench_start (struct bench *b)
 {
-  gettimeofday (&b->start, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &b->start);
 }
 
 static inline void
 bench_stop (struct bench *b)
 {
-  gettimeofday (&b->stop, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &b->stop);
 }
 
 static inline double
 bench_sec (struct bench *b)
 {
-  struct timeval dt;
+  struct timespec dt;
 
   dt.tv_sec = b->stop.tv_sec - b->start.tv_sec;
-  dt.tv_usec = b->stop.tv_usec - b->start.tv_usec;
+  dt.tv_nsec = b->stop.tv_nsec - b->start.tv_nsec;
 
-  if (dt.tv_usec < 0) {
+  if (dt.tv_nsec < 0) {
     dt.tv_sec -= 1;
-    dt.tv_usec += MICROSECONDS;
+    dt.tv_nsec += NANOSECONDS;
   }
 
-  return ((double)dt.tv_sec * MICROSECONDS + dt.tv_usec) / MICROSECONDS;
+  return ((double)dt.tv_sec * NANOSECONDS + dt.tv_nsec) / NANOSECONDS;
 }
 
 #endif /* LIBNBD_BENCH_H */
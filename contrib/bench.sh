@@ -0,0 +1,92 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Run a matrix of workloads against some common plugin and filter
+# combinations using ./loadgen, printing one line of JSON per run.
+# This is run by 'make bench'.  It must be run from the contrib build
+# directory.
+#
+# Environment variables:
+#   BENCH_TIME     Duration of each run in seconds (default 10).
+#   BENCH_RESULTS  Also append results to this file.
+#   NBDKIT         Path to nbdkit (default: the locally built wrapper).
+
+set -e
+set -u
+
+time=${BENCH_TIME:-10}
+results=${BENCH_RESULTS:-/dev/null}
+nbdkit=${NBDKIT:-../nbdkit}
+
+if [ ! -x ./loadgen ]; then
+    echo "$0: ./loadgen was not built (libnbd is required)"
+    exit 1
+fi
+
+tmpdir="$(mktemp -d)"
+trap 'rm -rf "$tmpdir"' EXIT INT QUIT TERM
+truncate -s 1G "$tmpdir/disk"
+
+# Plugin and filter combinations.  Each entry is a label followed by
+# the nbdkit arguments.
+targets=(
+    "null|null 1G"
+    "memory|memory 1G"
+    "file|file $tmpdir/disk"
+    "cow|--filter=cow memory 1G"
+    "cache|--filter=cache memory 1G"
+    "readahead|--filter=readahead memory 1G"
+    "cow+cache|--filter=cow --filter=cache memory 1G"
+)
+
+# Workloads.  Each entry is a label followed by the loadgen arguments.
+workloads=(
+    "4k-randread|-b 4K -q 16 -r 100"
+    "4k-randwrite|-b 4K -q 16 -r 0"
+    "4k-randrw-70-30|-b 4K -q 16 -r 70"
+    "64k-seqread|-b 64K -q 8 -r 100 -s"
+    "1m-seqread|-b 1M -q 4 -r 100 -s"
+)
+
+for target in "${targets[@]}"; do
+    tlabel="${target%%|*}"
+    targs="${target#*|}"
+    for workload in "${workloads[@]}"; do
+        wlabel="${workload%%|*}"
+        wargs="${workload#*|}"
+        # targs and wargs are deliberately split on whitespace.
+        $nbdkit -U - $targs \
+                --run "./loadgen -l $tlabel/$wlabel -t $time $wargs \"\$uri\"" |
+            tee -a "$results"
+    done
+done
@@ -0,0 +1,422 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Simple NBD load generator, used by 'make bench'.
+ *
+ * ./contrib/loadgen [OPTIONS] URI
+ *
+ * It opens one or more connections to the NBD server and keeps a
+ * fixed number of asynchronous requests in flight on each connection
+ * for a fixed time.  At the end it prints one line of JSON on stdout
+ * with the options, the throughput and request latency percentiles,
+ * so results can be collected and compared by scripts.
+ *
+ * Options:
+ *   -b SIZE   Block (request) size, default 4K.
+ *   -c N      Number of connections, default 1.
+ *   -l LABEL  Label copied to the output, default "".
+ *   -q N      Requests in flight per connection, default 16.
+ *   -r PC     Percentage of requests which are reads (the rest are
+ *             writes), default 100.
+ *   -s        Sequential I/O.  Each connection reads or writes its own
+ *             part of the disk in order.  The default is random.
+ *   -t SECS   Duration in seconds, default 10.
+ *
+ * To run against the locally built nbdkit:
+ *
+ * ./nbdkit -U - null 1G --run './contrib/loadgen -q 64 "$uri"'
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libnbd.h>
+
+#include "bench.h"
+#include "histogram.h"
+#include "human-size.h"
+#include "random.h"
+
+#define MAX_CONNECTIONS 64
+#define MAX_QUEUE_DEPTH 1024
+
+static uint64_t block_size = 4096;
+static unsigned connections = 1;
+static const char *label = "";
+static unsigned queue_depth = 16;
+static unsigned read_percent = 100;
+static bool sequential;
+static unsigned duration = 10;
+static const char *uri;
+
+static int64_t disk_size;
+static char *wrbuf;             /* data written, shared by all threads */
+
+struct thread_data {
+  pthread_t thread;
+  unsigned i;
+  struct nbd_handle *nbd;
+  char *rdbuf;                  /* data read is discarded here */
+  struct random_state state;
+  uint64_t next_offset;         /* for sequential I/O */
+  uint64_t start, end;          /* part of the disk for sequential I/O */
+  uint64_t read_ops, write_ops, errors;
+  uint64_t buckets[HISTOGRAM_NR_BUCKETS];
+};
+static struct thread_data threads[MAX_CONNECTIONS];
+
+struct command_data {
+  struct thread_data *t;
+  bool is_read;
+  uint64_t start;
+};
+
+static volatile bool stop;
+
+static uint64_t
+now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C (1000000) + ts.tv_nsec / 1000;
+}
+
+static void
+usage (FILE *fp, const char *prog)
+{
+  fprintf (fp,
+           "%s [-b SIZE] [-c N] [-l LABEL] [-q N] [-r PC] [-s] [-t SECS] "
+           "URI\n",
+           prog);
+}
+
+static unsigned
+parse_unsigned (const char *prog, char opt, const char *arg,
+                unsigned min, unsigned max)
+{
+  unsigned v;
+
+  if (sscanf (arg, "%u", &v) != 1 || v < min || v > max) {
+    fprintf (stderr, "%s: -%c: value must be between %u and %u\n",
+             prog, opt, min, max);
+    exit (EXIT_FAILURE);
+  }
+  return v;
+}
+
+static int
+cb (void *user_data, int *error)
+{
+  struct command_data *data = user_data;
+  struct thread_data *t = data->t;
+
+  if (*error != 0)
+    t->errors++;
+  else if (data->is_read)
+    t->read_ops++;
+  else
+    t->write_ops++;
+  t->buckets[histogram_bucket_of (now_us () - data->start)]++;
+
+  free (data);
+  return 1;                     /* retire the command */
+}
+
+static uint64_t
+next_offset (struct thread_data *t)
+{
+  uint64_t offset;
+
+  if (sequential) {
+    if (t->next_offset + block_size > t->end)
+      t->next_offset = t->start;
+    offset = t->next_offset;
+    t->next_offset += block_size;
+  }
+  else
+    offset = (xrandom (&t->state) % (disk_size / block_size)) * block_size;
+  return offset;
+}
+
+static void *
+start_thread (void *tp)
+{
+  struct thread_data *t = tp;
+  struct command_data *data;
+  int64_t r;
+
+  while (!stop) {
+    while (nbd_aio_in_flight (t->nbd) >= queue_depth) {
+      if (nbd_poll (t->nbd, -1) == -1)
+        goto error;
+    }
+
+    data = malloc (sizeof *data); /* freed in callback */
+    if (data == NULL) {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+    data->t = t;
+    data->is_read = xrandom (&t->state) % 100 < read_percent;
+    data->start = now_us ();
+    if (data->is_read)
+      r = nbd_aio_pread (t->nbd, t->rdbuf, block_size, next_offset (t),
+                         (nbd_completion_callback) {
+                           .callback = cb,
+                           .user_data = data,
+                         }, 0);
+    else
+      r = nbd_aio_pwrite (t->nbd, wrbuf, block_size, next_offset (t),
+                          (nbd_completion_callback) {
+                            .callback = cb,
+                            .user_data = data,
+                          }, 0);
+    if (r == -1)
+      goto error;
+  }
+
+  /* Wait for the requests still in flight. */
+  while (nbd_aio_in_flight (t->nbd) > 0) {
+    if (nbd_poll (t->nbd, -1) == -1)
+      goto error;
+  }
+  return NULL;
+
+ error:
+  fprintf (stderr, "connection %u: %s\n", t->i, nbd_get_error ());
+  exit (EXIT_FAILURE);
+}
+
+/* Return the latency (in microseconds) below which pc% of requests
+ * completed.
+ */
+static uint64_t
+percentile (const uint64_t *buckets, uint64_t total, double pc)
+{
+  uint64_t rank = pc / 100 * total, seen = 0;
+  size_t i;
+
+  if (total == 0)
+    return 0;
+  if (rank == 0)
+    rank = 1;
+  for (i = 0; i < HISTOGRAM_NR_BUCKETS - 1; ++i) {
+    seen += buckets[i];
+    if (seen >= rank)
+      break;
+  }
+  return histogram_bucket_upper_bound (i);
+}
+
+int
+main (int argc, char *argv[])
+{
+  const char *prog = argv[0];
+  const char *error, *pstr;
+  int64_t size;
+  struct bench b;
+  uint64_t read_ops = 0, write_ops = 0, errors = 0, total;
+  static uint64_t buckets[HISTOGRAM_NR_BUCKETS];
+  unsigned i;
+  size_t j;
+  double secs;
+  int c, err;
+
+  while ((c = getopt (argc, argv, "b:c:hl:q:r:st:")) != -1) {
+    switch (c) {
+    case 'b':
+      size = human_size_parse (optarg, &error, &pstr);
+      if (size == -1) {
+        fprintf (stderr, "%s: -b: %s: %s\n", prog, error, pstr);
+        exit (EXIT_FAILURE);
+      }
+      if (size == 0 || size > 64 * 1024 * 1024) {
+        fprintf (stderr, "%s: -b: block size out of range\n", prog);
+        exit (EXIT_FAILURE);
+      }
+      block_size = size;
+      break;
+    case 'c':
+      connections = parse_unsigned (prog, c, optarg, 1, MAX_CONNECTIONS);
+      break;
+    case 'h':
+      usage (stdout, prog);
+      exit (EXIT_SUCCESS);
+    case 'l':
+      label = optarg;
+      break;
+    case 'q':
+      queue_depth = parse_unsigned (prog, c, optarg, 1, MAX_QUEUE_DEPTH);
+      break;
+    case 'r':
+      read_percent = parse_unsigned (prog, c, optarg, 0, 100);
+      break;
+    case 's':
+      sequential = true;
+      break;
+    case 't':
+      duration = parse_unsigned (prog, c, optarg, 1, UINT_MAX);
+      break;
+    default:
+      usage (stderr, prog);
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (optind != argc - 1) {
+    usage (stderr, prog);
+    exit (EXIT_FAILURE);
+  }
+  uri = argv[optind];
+
+  wrbuf = malloc (block_size);
+  if (wrbuf == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < connections; ++i) {
+    struct thread_data *t = &threads[i];
+
+    t->i = i;
+    xsrandom (i + 1, &t->state);
+    t->nbd = nbd_create ();
+    if (t->nbd == NULL ||
+        nbd_connect_uri (t->nbd, uri) == -1) {
+      fprintf (stderr, "%s: %s\n", prog, nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    t->rdbuf = malloc (block_size);
+    if (t->rdbuf == NULL) {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+    if (i == 0) {
+      disk_size = nbd_get_size (t->nbd);
+      if (disk_size == -1) {
+        fprintf (stderr, "%s: %s\n", prog, nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+      if ((uint64_t) disk_size < block_size * connections) {
+        fprintf (stderr, "%s: disk is too small\n", prog);
+        exit (EXIT_FAILURE);
+      }
+      for (j = 0; j < block_size; ++j)
+        wrbuf[j] = xrandom (&t->state);
+    }
+    if (read_percent < 100 && nbd_is_read_only (t->nbd) == 1) {
+      fprintf (stderr, "%s: cannot write to a read-only export\n", prog);
+      exit (EXIT_FAILURE);
+    }
+
+    /* Divide the disk between the connections for sequential I/O. */
+    t->start = disk_size / connections * i / block_size * block_size;
+    t->end = disk_size / connections * (i + 1);
+    t->next_offset = t->start;
+  }
+
+  bench_start (&b);
+  for (i = 0; i < connections; ++i) {
+    err = pthread_create (&threads[i].thread, NULL, start_thread,
+                          &threads[i]);
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  sleep (duration);
+  stop = true;
+
+  for (i = 0; i < connections; ++i) {
+    err = pthread_join (threads[i].thread, NULL);
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_join");
+      exit (EXIT_FAILURE);
+    }
+  }
+  bench_stop (&b);
+  secs = bench_sec (&b);
+
+  for (i = 0; i < connections; ++i) {
+    read_ops += threads[i].read_ops;
+    write_ops += threads[i].write_ops;
+    errors += threads[i].errors;
+    for (j = 0; j < HISTOGRAM_NR_BUCKETS; ++j)
+      buckets[j] += threads[i].buckets[j];
+    nbd_shutdown (threads[i].nbd, 0);
+    nbd_close (threads[i].nbd);
+    free (threads[i].rdbuf);
+  }
+  free (wrbuf);
+  total = read_ops + write_ops + errors;
+
+  /* The label is not escaped, so it should not contain quotes. */
+  printf ("{\"label\": \"%s\", "
+          "\"block_size\": %" PRIu64 ", "
+          "\"connections\": %u, "
+          "\"queue_depth\": %u, "
+          "\"read_percent\": %u, "
+          "\"pattern\": \"%s\", "
+          "\"seconds\": %.3f, "
+          "\"read_ops\": %" PRIu64 ", "
+          "\"write_ops\": %" PRIu64 ", "
+          "\"errors\": %" PRIu64 ", "
+          "\"iops\": %.1f, "
+          "\"mb_per_sec\": %.1f, "
+          "\"latency_p50_us\": %" PRIu64 ", "
+          "\"latency_p99_us\": %" PRIu64 ", "
+          "\"latency_p999_us\": %" PRIu64 "}\n",
+          label, block_size, connections, queue_depth, read_percent,
+          sequential ? "sequential" : "random",
+          secs, read_ops, write_ops, errors,
+          (read_ops + write_ops) / secs,
+          (read_ops + write_ops) * block_size / secs / (1024 * 1024),
+          percentile (buckets, total, 50),
+          percentile (buckets, total, 99),
+          percentile (buckets, total, 99.9));
+
+  exit (errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -257,6 +257,37 @@ blocksize_pread (nbdkit_next *next,
   char *buf = b;
   uint32_t keep;
   uint32_t drop;
+  uint64_t span;
+
+  /* If the aligned request fits in a single read, read it in one
+   * call, sending the unwanted head and tail to a scratch buffer
+   * belonging to this request.  Since the shared bounce buffer is not
+   * used, no lock is needed.
+   */
+  drop = offs & (h->minblock - 1);
+  span = ROUND_UP ((uint64_t) drop + count, h->minblock);
+  if (span != count && span <= h->maxdata) {
+    CLEANUP_FREE char *scratch = NULL;
+    struct nbdkit_iovec iov[3];
+    unsigned n = 0;
+
+    scratch = malloc (span - count);
+    if (scratch == NULL) {
+      *err = errno;
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+
+    if (drop)
+      iov[n++] = (struct nbdkit_iovec) { .base = scratch, .len = drop };
+    iov[n++] = (struct nbdkit_iovec) { .base = buf, .len = count };
+    if (span > drop + count)
+      iov[n++] = (struct nbdkit_iovec) {
+        .base = scratch + drop, .len = span - drop - count
+      };
+
+    return next->preadv (next, iov, n, offs - drop, flags, err);
+  }
 
   /* Unaligned head */
   if (offs & (h->minblock - 1)) {
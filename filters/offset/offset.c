@@ -119,6 +119,24 @@ offset_pwrite (nbdkit_next *next,
   return next->pwrite (next, buf, count, offs + offset, flags, err);
 }
 
+/* Read data into a scatter-gather list. */
+static int
+offset_preadv (nbdkit_next *next,
+               void *handle, const struct nbdkit_iovec *iov, unsigned iovcnt,
+               uint64_t offs, uint32_t flags, int *err)
+{
+  return next->preadv (next, iov, iovcnt, offs + offset, flags, err);
+}
+
+/* Write data from a scatter-gather list. */
+static int
+offset_pwritev (nbdkit_next *next,
+                void *handle, const struct nbdkit_iovec *iov, unsigned iovcnt,
+                uint64_t offs, uint32_t flags, int *err)
+{
+  return next->pwritev (next, iov, iovcnt, offs + offset, flags, err);
+}
+
 /* Trim data. */
 static int
 offset_trim (nbdkit_next *next,
@@ -184,6 +202,8 @@ static struct nbdkit_filter filter = {
   .get_size          = offset_get_size,
   .pread             = offset_pread,
   .pwrite            = offset_pwrite,
+  .preadv            = offset_preadv,
+  .pwritev           = offset_pwritev,
   .trim              = offset_trim,
   .zero              = offset_zero,
   .extents           = offset_extents,
@@ -83,6 +83,12 @@ extern "C" {
 #define NBDKIT_EXTENT_HOLE    (1<<0) /* Same as NBD_STATE_HOLE */
 #define NBDKIT_EXTENT_ZERO    (1<<1) /* Same as NBD_STATE_ZERO */
 
+/* One buffer in a scatter-gather list, see .preadv and .pwritev. */
+struct nbdkit_iovec {
+  void *base;
+  uint32_t len;
+};
+
 #ifndef WIN32
 #define NBDKIT_EXTERN_DECL(ret, fn, args) extern ret fn args
 #define NBDKIT_DLL_PUBLIC __attribute__ ((__visibility__ ("default")))
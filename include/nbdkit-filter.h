@@ -104,6 +104,12 @@ struct nbdkit_next_ops {
   int (*pwrite) (nbdkit_next *nxdata,
                  const void *buf, uint32_t count, uint64_t offset,
                  uint32_t flags, int *err);
+  int (*preadv) (nbdkit_next *nxdata,
+                 const struct nbdkit_iovec *iov, unsigned iovcnt,
+                 uint64_t offset, uint32_t flags, int *err);
+  int (*pwritev) (nbdkit_next *nxdata,
+                  const struct nbdkit_iovec *iov, unsigned iovcnt,
+                  uint64_t offset, uint32_t flags, int *err);
   int (*flush) (nbdkit_next *nxdata, uint32_t flags, int *err);
   int (*trim) (nbdkit_next *nxdata, uint32_t count, uint64_t offset,
                uint32_t flags, int *err);
@@ -238,6 +244,12 @@ struct nbdkit_filter {
                  void *handle,
                  const void *buf, uint32_t count, uint64_t offset,
                  uint32_t flags, int *err);
+  int (*preadv) (nbdkit_next *next,
+                 void *handle, const struct nbdkit_iovec *iov, unsigned iovcnt,
+                 uint64_t offset, uint32_t flags, int *err);
+  int (*pwritev) (nbdkit_next *next,
+                  void *handle, const struct nbdkit_iovec *iov, unsigned iovcnt,
+                  uint64_t offset, uint32_t flags, int *err);
   int (*flush) (nbdkit_next *next,
                 void *handle, uint32_t flags, int *err);
   int (*trim) (nbdkit_next *next,
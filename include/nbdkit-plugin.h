@@ -49,6 +49,12 @@ extern "C" {
 #error Unsupported API version
 #endif
 
+/* Opaque handle for a request in flight, see .aio_pread/.aio_pwrite. */
+struct nbdkit_request;
+
+/* Opaque handle for incoming write data, see .pwrite_payload. */
+struct nbdkit_payload;
+
 struct nbdkit_plugin {
   /* Do not set these fields directly; use NBDKIT_REGISTER_PLUGIN.
    * They exist so that we can support plugins compiled against
@@ -150,11 +156,52 @@ struct nbdkit_plugin {
 
   int (*block_size) (void *handle,
                      uint32_t *minimum, uint32_t *preferred, uint32_t *maximum);
+
+#if NBDKIT_API_VERSION == 1
+  int (*_unused6) (void *, void *, uint32_t, uint64_t, uint32_t,
+                   struct nbdkit_request *);
+  int (*_unused7) (void *, const void *, uint32_t, uint64_t, uint32_t,
+                   struct nbdkit_request *);
+#else
+  int (*aio_pread) (void *handle, void *buf, uint32_t count, uint64_t offset,
+                    uint32_t flags, struct nbdkit_request *req);
+  int (*aio_pwrite) (void *handle, const void *buf, uint32_t count,
+                     uint64_t offset, uint32_t flags,
+                     struct nbdkit_request *req);
+#endif
+
+#if NBDKIT_API_VERSION == 1
+  int (*_unused8) (void *, uint32_t, uint64_t, uint32_t, int *, uint64_t *);
+  int (*_unused9) (void *, uint32_t, uint64_t, uint32_t,
+                   struct nbdkit_payload *);
+#else
+  int (*pread_fd) (void *handle, uint32_t count, uint64_t offset,
+                   uint32_t flags, int *fd, uint64_t *fd_offset);
+  int (*pwrite_payload) (void *handle, uint32_t count, uint64_t offset,
+                         uint32_t flags, struct nbdkit_payload *payload);
+#endif
+
+#if NBDKIT_API_VERSION == 1
+  int (*_unused10) (void *, const struct nbdkit_iovec *, unsigned,
+                    uint64_t, uint32_t);
+  int (*_unused11) (void *, const struct nbdkit_iovec *, unsigned,
+                    uint64_t, uint32_t);
+#else
+  int (*preadv) (void *handle, const struct nbdkit_iovec *iov,
+                 unsigned iovcnt, uint64_t offset, uint32_t flags);
+  int (*pwritev) (void *handle, const struct nbdkit_iovec *iov,
+                  unsigned iovcnt, uint64_t offset, uint32_t flags);
+#endif
 };
 
 NBDKIT_EXTERN_DECL (void, nbdkit_set_error, (int err));
 NBDKIT_EXTERN_DECL (const char *, nbdkit_export_name, (void));
 NBDKIT_EXTERN_DECL (int, nbdkit_is_tls, (void));
+NBDKIT_EXTERN_DECL (void, nbdkit_request_complete,
+                    (struct nbdkit_request *req, int err));
+NBDKIT_EXTERN_DECL (int, nbdkit_payload_recv,
+                    (struct nbdkit_payload *payload, void *buf,
+                     uint32_t count));
 
 #define NBDKIT_REGISTER_PLUGIN(plugin)                                  \
   NBDKIT_CXX_LANG_C                                                     \
@@ -53,6 +53,10 @@
 #include <sys/ioctl.h>
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
 #include <pthread.h>
 
 #if defined (__linux__) && !defined (FALLOC_FL_PUNCH_HOLE)
@@ -927,6 +931,26 @@ file_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   return 0;
 }
 
+/* Let the server send data for reads straight from the file. */
+static int
+file_pread_fd (void *handle, uint32_t count, uint64_t offset,
+               uint32_t flags, int *fd, uint64_t *fd_offset)
+{
+  struct handle *h = handle;
+
+  /* With cache=none we have to evict pages after reading them, but
+   * the data isn't read until after we return, so use .pread.
+   */
+  if (cache_mode == cache_none) {
+    *fd = -1;
+    return 0;
+  }
+
+  *fd = h->fd;
+  *fd_offset = offset;
+  return 0;
+}
+
 /* Write data to the file. */
 static int
 file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
@@ -963,6 +987,125 @@ file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
   return 0;
 }
 
+#if defined (HAVE_PREADV) && defined (HAVE_PWRITEV)
+/* Maximum number of buffers passed to each preadv/pwritev call. */
+#define FILE_IOV_MAX 64
+
+/* Call preadv or pwritev until the whole list has been transferred.
+ * *i is the current buffer and *done the number of bytes of it
+ * already transferred.
+ */
+static void
+advance_iov (const struct nbdkit_iovec *iov, unsigned iovcnt,
+             unsigned *i, uint32_t *done, size_t r)
+{
+  while (*i < iovcnt) {
+    const uint32_t left = iov[*i].len - *done;
+
+    if (r < left) {
+      *done += r;
+      return;
+    }
+    r -= left;
+    (*i)++;
+    *done = 0;
+  }
+}
+
+static int
+do_iov (struct handle *h, bool write,
+        const struct nbdkit_iovec *iov, unsigned iovcnt, uint64_t offset)
+{
+  struct iovec v[FILE_IOV_MAX];
+  unsigned i = 0, n, k;
+  uint32_t done = 0;
+  ssize_t r;
+
+  advance_iov (iov, iovcnt, &i, &done, 0);
+  while (i < iovcnt) {
+    for (n = 0, k = i; k < iovcnt && n < FILE_IOV_MAX; ++k) {
+      const uint32_t skip = k == i ? done : 0;
+
+      if (iov[k].len > skip) {
+        v[n].iov_base = (char *) iov[k].base + skip;
+        v[n].iov_len = iov[k].len - skip;
+        n++;
+      }
+    }
+
+    if (write)
+      r = pwritev (h->fd, v, n, offset);
+    else
+      r = preadv (h->fd, v, n, offset);
+    if (r == -1) {
+      nbdkit_error ("%s: %s: offset=%" PRIu64 ": %m",
+                    write ? "pwritev" : "preadv", h->name, offset);
+      return -1;
+    }
+    if (r == 0 && !write) {
+      nbdkit_error ("preadv: %s: unexpected end of file", h->name);
+      return -1;
+    }
+    offset += r;
+    advance_iov (iov, iovcnt, &i, &done, r);
+  }
+
+  return 0;
+}
+
+/* Read data from the file into a scatter-gather list. */
+static int
+file_preadv (void *handle, const struct nbdkit_iovec *iov, unsigned iovcnt,
+             uint64_t offset, uint32_t flags)
+{
+  struct handle *h = handle;
+
+  if (do_iov (h, false, iov, iovcnt, offset) == -1)
+    return -1;
+
+#if defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_DONTNEED)
+  if (cache_mode == cache_none) {
+    uint64_t count = 0;
+    unsigned i;
+
+    for (i = 0; i < iovcnt; ++i)
+      count += iov[i].len;
+    posix_fadvise (h->fd, offset, count, POSIX_FADV_DONTNEED);
+  }
+#endif
+
+  return 0;
+}
+
+/* Write data to the file from a scatter-gather list. */
+static int
+file_pwritev (void *handle, const struct nbdkit_iovec *iov, unsigned iovcnt,
+              uint64_t offset, uint32_t flags)
+{
+  struct handle *h = handle;
+
+  if (do_iov (h, true, iov, iovcnt, offset) == -1)
+    return -1;
+
+  if ((flags & NBDKIT_FLAG_FUA) && file_flush (handle, 0) == -1)
+    return -1;
+
+#if EVICT_WRITES
+  if (cache_mode == cache_none) {
+    uint64_t count = 0;
+    unsigned i;
+
+    for (i = 0; i < iovcnt; ++i)
+      count += iov[i].len;
+    if (evict_writes (h->fd, offset, count) == -1)
+      return -1;
+  }
+#endif
+
+  return 0;
+}
+#endif /* HAVE_PREADV && HAVE_PWRITEV */
+
 #if defined(FALLOC_FL_PUNCH_HOLE) || defined(FALLOC_FL_ZERO_RANGE)
 static int
 do_fallocate (int fd, int mode_, off_t offset, off_t len)
@@ -1378,7 +1521,12 @@ static struct nbdkit_plugin plugin = {
   .can_fua           = file_can_fua,
   .can_cache         = file_can_cache,
   .pread             = file_pread,
+  .pread_fd          = file_pread_fd,
   .pwrite            = file_pwrite,
+#if defined (HAVE_PREADV) && defined (HAVE_PWRITEV)
+  .preadv            = file_preadv,
+  .pwritev           = file_pwritev,
+#endif
   .flush             = file_flush,
   .trim              = file_trim,
   .zero              = file_zero,
@@ -199,6 +199,30 @@ memory_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
   return a->f->write (a, buf, count, offset);
 }
 
+/* Write data, receiving it directly into the allocator. */
+static int
+memory_pwrite_payload (void *handle, uint32_t count, uint64_t offset,
+                       uint32_t flags, struct nbdkit_payload *payload)
+{
+  CLEANUP_FREE char *buf = NULL;
+
+  /* Flushing, and thus FUA flag, is a no-op */
+  assert ((flags & ~NBDKIT_FLAG_FUA) == 0);
+
+  if (a->f->write_payload)
+    return a->f->write_payload (a, payload, count, offset);
+
+  /* The allocator can't do it, so use a temporary buffer. */
+  buf = malloc (count);
+  if (buf == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  if (nbdkit_payload_recv (payload, buf, count) == -1)
+    return -1;
+  return a->f->write (a, buf, count, offset);
+}
+
 /* Zero. */
 static int
 memory_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
@@ -254,6 +278,7 @@ static struct nbdkit_plugin plugin = {
   .can_fast_zero     = memory_can_fast_zero,
   .pread             = memory_pread,
   .pwrite            = memory_pwrite,
+  .pwrite_payload    = memory_pwrite_payload,
   .zero              = memory_zero,
   .trim              = memory_trim,
   .flush             = memory_flush,
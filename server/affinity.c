@@ -0,0 +1,316 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* CPU and NUMA affinity of server threads (--cpu-affinity).
+ *
+ * The option gives a list of CPU groups.  Each new connection is
+ * assigned to the next group in round-robin order, and the connection
+ * thread and its worker threads are pinned to the CPUs in that group.
+ * With --io-threads, the I/O threads are assigned to the groups in
+ * the same way instead.
+ *
+ * With --cpu-affinity=numa there is one group per NUMA node.  Memory
+ * is allocated on the node of the thread which first touches it, so
+ * buffers allocated by pinned threads are node-local, and the buffer
+ * pool keeps a separate free list per group so they stay that way
+ * when they are reused (see bufpool.c).
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+#include "internal.h"
+#include "ascii-ctype.h"
+#include "vector.h"
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+
+DEFINE_VECTOR_TYPE (cpu_set_vector, cpu_set_t);
+static cpu_set_vector groups = empty_vector;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned next_group;
+
+/* Parse a Linux CPU list such as "0-3,8,10-11" into set. */
+static int
+parse_cpulist (const char *str, cpu_set_t *set)
+{
+  const char *p = str;
+  char *end;
+  unsigned long first, last, cpu;
+
+  CPU_ZERO (set);
+  for (;;) {
+    if (!ascii_isdigit (*p))
+      goto error;
+    errno = 0;
+    first = last = strtoul (p, &end, 10);
+    if (errno != 0)
+      goto error;
+    p = end;
+    if (*p == '-') {
+      p++;
+      if (!ascii_isdigit (*p))
+        goto error;
+      last = strtoul (p, &end, 10);
+      if (errno != 0 || last < first)
+        goto error;
+      p = end;
+    }
+    if (last >= CPU_SETSIZE) {
+      nbdkit_error ("--cpu-affinity: CPU %lu is too large", last);
+      return -1;
+    }
+    for (cpu = first; cpu <= last; ++cpu)
+      CPU_SET (cpu, set);
+    if (*p == '\0')
+      return 0;
+    if (*p != ',')
+      goto error;
+    p++;
+  }
+
+ error:
+  nbdkit_error ("--cpu-affinity: could not parse CPU list: %s", str);
+  return -1;
+}
+
+/* Create one group for each NUMA node which has CPUs. */
+static int
+numa_groups (void)
+{
+  const char *dirname = "/sys/devices/system/node";
+  DIR *dir;
+  struct dirent *d;
+  unsigned node, max_node = 0;
+  bool found = false;
+
+  /* Nodes may be numbered sparsely, so find the largest first. */
+  dir = opendir (dirname);
+  if (dir == NULL) {
+    nbdkit_error ("--cpu-affinity=numa: %s: %m", dirname);
+    return -1;
+  }
+  while ((d = readdir (dir)) != NULL) {
+    if (sscanf (d->d_name, "node%u", &node) == 1) {
+      if (node > max_node)
+        max_node = node;
+      found = true;
+    }
+  }
+  closedir (dir);
+  if (!found) {
+    nbdkit_error ("--cpu-affinity=numa: no NUMA nodes found in %s", dirname);
+    return -1;
+  }
+
+  for (node = 0; node <= max_node; ++node) {
+    CLEANUP_FREE char *path = NULL;
+    char buf[1024];
+    FILE *fp;
+    cpu_set_t set;
+
+    if (asprintf (&path, "%s/node%u/cpulist", dirname, node) == -1) {
+      nbdkit_error ("asprintf: %m");
+      return -1;
+    }
+    fp = fopen (path, "r");
+    if (fp == NULL)
+      continue;
+    if (fgets (buf, sizeof buf, fp) == NULL)
+      buf[0] = '\0';
+    fclose (fp);
+    buf[strcspn (buf, "\n")] = '\0';
+
+    /* Memory-only nodes have an empty CPU list. */
+    if (buf[0] == '\0')
+      continue;
+    if (parse_cpulist (buf, &set) == -1)
+      return -1;
+    if (cpu_set_vector_append (&groups, set) == -1) {
+      nbdkit_error ("realloc: %m");
+      return -1;
+    }
+    debug ("--cpu-affinity: group %zu is NUMA node %u: CPUs %s",
+           groups.len-1, node, buf);
+  }
+  return 0;
+}
+
+/* Parse the --cpu-affinity option.  This is either "numa" or a list
+ * of CPU groups separated by ':', each in the format used by
+ * taskset -c (eg. "0-7,16-23:8-15,24-31").
+ */
+int
+affinity_parse (const char *spec)
+{
+  CLEANUP_FREE char *copy = NULL;
+  char *str, *saveptr;
+  cpu_set_t set;
+
+  cpu_set_vector_reset (&groups);
+
+  if (strcmp (spec, "numa") == 0) {
+    if (numa_groups () == -1)
+      return -1;
+  }
+  else {
+    copy = strdup (spec);
+    if (copy == NULL) {
+      nbdkit_error ("strdup: %m");
+      return -1;
+    }
+    for (str = strtok_r (copy, ":", &saveptr); str != NULL;
+         str = strtok_r (NULL, ":", &saveptr)) {
+      if (parse_cpulist (str, &set) == -1)
+        return -1;
+      if (cpu_set_vector_append (&groups, set) == -1) {
+        nbdkit_error ("realloc: %m");
+        return -1;
+      }
+    }
+  }
+
+  if (groups.len == 0) {
+    nbdkit_error ("--cpu-affinity: no CPUs were specified");
+    return -1;
+  }
+  return 0;
+}
+
+/* Return the number of groups, which is 1 if --cpu-affinity was not
+ * used.
+ */
+unsigned
+affinity_nr_groups (void)
+{
+  return groups.len > 0 ? groups.len : 1;
+}
+
+/* Pin the current thread to the CPUs in group g.  Threads created by
+ * this thread afterwards inherit the same affinity.
+ */
+void
+affinity_bind (unsigned g)
+{
+  int err;
+
+  threadlocal_set_affinity_group (g);
+  if (groups.len == 0)
+    return;
+
+  err = pthread_setaffinity_np (pthread_self (), sizeof (cpu_set_t),
+                                &groups.ptr[g]);
+  /* This can fail if the group contains no CPUs that the process is
+   * allowed to use.  It is not fatal.
+   */
+  if (err != 0) {
+    errno = err;
+    debug ("pthread_setaffinity_np: group %u: %m", g);
+  }
+}
+
+/* Pin the current thread to the next group in round-robin order, and
+ * return the group.
+ */
+unsigned
+affinity_bind_next (void)
+{
+  unsigned g;
+
+  if (groups.len == 0) {
+    threadlocal_set_affinity_group (0);
+    return 0;
+  }
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    g = next_group;
+    next_group = (next_group + 1) % groups.len;
+  }
+  affinity_bind (g);
+  return g;
+}
+
+void
+affinity_free (void)
+{
+  cpu_set_vector_reset (&groups);
+}
+
+#else /* !HAVE_PTHREAD_SETAFFINITY_NP */
+
+int
+affinity_parse (const char *spec)
+{
+  nbdkit_error ("--cpu-affinity is not supported on this platform");
+  return -1;
+}
+
+unsigned
+affinity_nr_groups (void)
+{
+  return 1;
+}
+
+void
+affinity_bind (unsigned g)
+{
+  threadlocal_set_affinity_group (g);
+}
+
+unsigned
+affinity_bind_next (void)
+{
+  threadlocal_set_affinity_group (0);
+  return 0;
+}
+
+void
+affinity_free (void)
+{
+  /* nothing */
+}
+
+#endif /* !HAVE_PTHREAD_SETAFFINITY_NP */
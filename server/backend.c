@@ -63,6 +63,18 @@ NBDKIT_DLL_PUBLIC int nbdkit_debug_backend_datapath = 1;
     if (nbdkit_debug_backend_datapath) debug ((fs), ##__VA_ARGS__);    \
   } while (0)
 
+/* USDT probes around each call into a plugin or filter on the data
+ * path.  The arguments are the layer index (b->i, the plugin is 0),
+ * the layer name and the operation, followed by count and offset on
+ * entry, or the return value and error on exit.
+ */
+#define probe_entry(op, count, offset)                                 \
+  DTRACE_PROBE5 (nbdkit, backend_entry, b->i, b->name, (op),           \
+                 (uint64_t) (count), (uint64_t) (offset))
+#define probe_exit(op, r, err)                                         \
+  DTRACE_PROBE5 (nbdkit, backend_exit, b->i, b->name, (op),            \
+                 (r), (r) == -1 ? *(err) : 0)
+
 void
 backend_init (struct backend *b, struct backend *next, size_t index,
               const char *filename, void *dl, const char *type)
@@ -228,6 +240,8 @@ static struct nbdkit_next_ops next_ops = {
   .can_cache = backend_can_cache,
   .pread = backend_pread,
   .pwrite = backend_pwrite,
+  .preadv = backend_preadv,
+  .pwritev = backend_pwritev,
   .flush = backend_flush,
   .trim = backend_trim,
   .zero = backend_zero,
@@ -395,6 +409,7 @@ backend_close (struct context *c)
   assert (c->state & HANDLE_OPEN);
   controlpath_debug ("%s: close", b->name);
   b->close (c);
+  extents_cache_detach (c);
   free (c->exportname);
   free (c);
   if (c_next != NULL)
@@ -402,11 +417,112 @@ backend_close (struct context *c)
 }
 
 bool
-backend_valid_range (struct context *c, uint64_t offset, uint32_t count)
+backend_valid_range (struct context *c, uint64_t offset, uint64_t count)
 {
   assert (c->exportsize <= INT64_MAX); /* Guaranteed by negotiation phase */
   return count > 0 && offset <= c->exportsize &&
-    offset + count <= c->exportsize;
+    count <= c->exportsize - offset;
+}
+
+/* A filter in context c does not implement op, so the request is
+ * passed to the next layer.  Return the context which should receive
+ * it, skipping any further layers which would only pass it on again.
+ * Layers are only skipped when their backend_* wrapper would do
+ * nothing but call down (so not if it would emulate zero, extents or
+ * cache), and not while data path debugging is on, so that -v still
+ * shows every layer.  Skipped layers fire no backend_entry or
+ * backend_exit probes, as documented in nbdkit-tracing(3).
+ */
+struct context *
+backend_passthrough (struct context *c, unsigned op)
+{
+  c = c->c_next;
+  if (verbose && nbdkit_debug_backend_datapath)
+    return c;
+
+  while (c->b->passthrough & op) {
+    switch (op) {
+    case PASSTHROUGH_ZERO:
+      if (c->can_zero != NBDKIT_ZERO_NATIVE)
+        return c;
+      break;
+    case PASSTHROUGH_EXTENTS:
+      if (c->can_extents != 1)
+        return c;
+      break;
+    case PASSTHROUGH_CACHE:
+      if (c->can_cache != NBDKIT_CACHE_NATIVE)
+        return c;
+      break;
+    }
+    c = c->c_next;
+  }
+  return c;
+}
+
+/* Helpers for scatter-gather lists.  Layers which don't implement
+ * .preadv or .pwritev fall back to their flat callback with a bounce
+ * buffer, using these to copy the data.
+ */
+uint64_t
+iovec_size (const struct nbdkit_iovec *iov, unsigned iovcnt)
+{
+  uint64_t size = 0;
+  unsigned i;
+
+  for (i = 0; i < iovcnt; ++i)
+    size += iov[i].len;
+  return size;
+}
+
+void
+iovec_scatter (const struct nbdkit_iovec *iov, unsigned iovcnt,
+               const void *buf)
+{
+  const char *p = buf;
+  unsigned i;
+
+  for (i = 0; i < iovcnt; ++i) {
+    memcpy (iov[i].base, p, iov[i].len);
+    p += iov[i].len;
+  }
+}
+
+void
+iovec_gather (void *buf, const struct nbdkit_iovec *iov, unsigned iovcnt)
+{
+  char *p = buf;
+  unsigned i;
+
+  for (i = 0; i < iovcnt; ++i) {
+    memcpy (p, iov[i].base, iov[i].len);
+    p += iov[i].len;
+  }
+}
+
+/* Bounce buffers come from the buffer pool, unless a filter has made
+ * a request larger than any request from a client.
+ */
+void *
+iovec_bounce_get (uint32_t count, bool clear)
+{
+  void *buf;
+
+  if (count <= MAX_REQUEST_SIZE)
+    return bufpool_get (count, clear);
+  buf = calloc (1, count);
+  if (buf == NULL)
+    nbdkit_error ("calloc: %m");
+  return buf;
+}
+
+void
+iovec_bounce_put (void *buf, uint32_t count)
+{
+  if (count <= MAX_REQUEST_SIZE)
+    bufpool_put (buf, count);
+  else
+    free (buf);
 }
 
 /* Wrappers for all callbacks in a filter's struct nbdkit_next_ops. */
@@ -667,7 +783,9 @@ backend_pread (struct context *c,
   datapath_debug ("%s: pread count=%" PRIu32 " offset=%" PRIu64,
                   b->name, count, offset);
 
+  probe_entry ("pread", count, offset);
   r = b->pread (c, buf, count, offset, flags, err);
+  probe_exit ("pread", r, err);
   if (r == -1)
     assert (*err);
   return r;
@@ -693,7 +811,73 @@ backend_pwrite (struct context *c,
   datapath_debug ("%s: pwrite count=%" PRIu32 " offset=%" PRIu64 " fua=%d",
                   b->name, count, offset, fua);
 
+  probe_entry ("pwrite", count, offset);
   r = b->pwrite (c, buf, count, offset, flags, err);
+  probe_exit ("pwrite", r, err);
+  if (c->extents_cache)
+    extents_cache_invalidate (c, offset, count);
+  if (r == -1)
+    assert (*err);
+  return r;
+}
+
+int
+backend_preadv (struct context *c,
+                const struct nbdkit_iovec *iov, unsigned iovcnt,
+                uint64_t offset, uint32_t flags, int *err)
+{
+  PUSH_CONTEXT_FOR_SCOPE (c);
+  struct backend *b = c->b;
+  const uint64_t count = iovec_size (iov, iovcnt);
+  int r;
+
+  assert (b->magic == BACKEND_MAGIC);
+  assert (c->handle && (c->state & HANDLE_CONNECTED));
+  assert (iovcnt > 0);
+  assert (count <= UINT32_MAX);
+  assert (backend_valid_range (c, offset, count));
+  assert (flags == 0);
+  datapath_debug ("%s: preadv count=%" PRIu64 " offset=%" PRIu64
+                  " iovcnt=%u",
+                  b->name, count, offset, iovcnt);
+
+  probe_entry ("preadv", count, offset);
+  r = b->preadv (c, iov, iovcnt, offset, flags, err);
+  probe_exit ("preadv", r, err);
+  if (r == -1)
+    assert (*err);
+  return r;
+}
+
+int
+backend_pwritev (struct context *c,
+                 const struct nbdkit_iovec *iov, unsigned iovcnt,
+                 uint64_t offset, uint32_t flags, int *err)
+{
+  PUSH_CONTEXT_FOR_SCOPE (c);
+  struct backend *b = c->b;
+  const uint64_t count = iovec_size (iov, iovcnt);
+  bool fua = !!(flags & NBDKIT_FLAG_FUA);
+  int r;
+
+  assert (b->magic == BACKEND_MAGIC);
+  assert (c->handle && (c->state & HANDLE_CONNECTED));
+  assert (c->can_write == 1);
+  assert (iovcnt > 0);
+  assert (count <= UINT32_MAX);
+  assert (backend_valid_range (c, offset, count));
+  assert (!(flags & ~NBDKIT_FLAG_FUA));
+  if (fua)
+    assert (c->can_fua > NBDKIT_FUA_NONE);
+  datapath_debug ("%s: pwritev count=%" PRIu64 " offset=%" PRIu64
+                  " iovcnt=%u fua=%d",
+                  b->name, count, offset, iovcnt, fua);
+
+  probe_entry ("pwritev", count, offset);
+  r = b->pwritev (c, iov, iovcnt, offset, flags, err);
+  probe_exit ("pwritev", r, err);
+  if (c->extents_cache)
+    extents_cache_invalidate (c, offset, count);
   if (r == -1)
     assert (*err);
   return r;
@@ -713,7 +897,9 @@ backend_flush (struct context *c,
   assert (flags == 0);
   controlpath_debug ("%s: flush", b->name);
 
+  probe_entry ("flush", 0, 0);
   r = b->flush (c, flags, err);
+  probe_exit ("flush", r, err);
   if (r == -1)
     assert (*err);
   return r;
@@ -740,7 +926,11 @@ backend_trim (struct context *c,
   datapath_debug ("%s: trim count=%" PRIu32 " offset=%" PRIu64 " fua=%d",
                   b->name, count, offset, fua);
 
+  probe_entry ("trim", count, offset);
   r = b->trim (c, count, offset, flags, err);
+  probe_exit ("trim", r, err);
+  if (c->extents_cache)
+    extents_cache_invalidate (c, offset, count);
   if (r == -1)
     assert (*err);
   return r;
@@ -773,8 +963,13 @@ backend_zero (struct context *c,
                   b->name, count, offset,
                   !!(flags & NBDKIT_FLAG_MAY_TRIM), fua, fast);
 
-  if (c->can_zero == NBDKIT_ZERO_NATIVE)
+  if (c->can_zero == NBDKIT_ZERO_NATIVE) {
+    probe_entry ("zero", count, offset);
     r = b->zero (c, count, offset, flags, err);
+    probe_exit ("zero", r, err);
+    if (c->extents_cache)
+      extents_cache_invalidate (c, offset, count);
+  }
   else { /* NBDKIT_ZERO_EMULATE */
     int writeflags = 0;
     bool need_flush = false;
@@ -824,6 +1019,7 @@ backend_extents (struct context *c,
 {
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
+  uint64_t generation = 0;
   int r;
 
   assert (b->magic == BACKEND_MAGIC);
@@ -843,9 +1039,22 @@ backend_extents (struct context *c,
       *err = errno;
     return r;
   }
+  if (c->extents_cache) {
+    r = extents_cache_lookup (c, count, offset, flags, extents, &generation);
+    if (r == -1) {
+      *err = errno;
+      return -1;
+    }
+    if (r == 1)
+      return 0;
+  }
+  probe_entry ("extents", count, offset);
   r = b->extents (c, count, offset, flags, extents, err);
+  probe_exit ("extents", r, err);
   if (r == -1)
     assert (*err);
+  else if (c->extents_cache)
+    extents_cache_insert (c, extents, generation);
   return r;
 }
 
@@ -879,7 +1088,122 @@ backend_cache (struct context *c,
     }
     return 0;
   }
+  probe_entry ("cache", count, offset);
   r = b->cache (c, count, offset, flags, err);
+  probe_exit ("cache", r, err);
+  if (r == -1)
+    assert (*err);
+  return r;
+}
+
+int
+backend_aio_pread (struct context *c,
+                   void *buf, uint32_t count, uint64_t offset,
+                   uint32_t flags, struct nbdkit_request *req, int *err)
+{
+  PUSH_CONTEXT_FOR_SCOPE (c);
+  struct backend *b = c->b;
+  int r;
+
+  assert (b->magic == BACKEND_MAGIC);
+  assert (b->aio_pread != NULL);
+  assert (c->handle && (c->state & HANDLE_CONNECTED));
+  assert (backend_valid_range (c, offset, count));
+  assert (flags == 0);
+  datapath_debug ("%s: aio_pread count=%" PRIu32 " offset=%" PRIu64,
+                  b->name, count, offset);
+
+  probe_entry ("aio_pread", count, offset);
+  r = b->aio_pread (c, buf, count, offset, flags, req, err);
+  probe_exit ("aio_pread", r, err);
+  if (r == -1)
+    assert (*err);
+  return r;
+}
+
+int
+backend_aio_pwrite (struct context *c,
+                    const void *buf, uint32_t count, uint64_t offset,
+                    uint32_t flags, struct nbdkit_request *req, int *err)
+{
+  PUSH_CONTEXT_FOR_SCOPE (c);
+  struct backend *b = c->b;
+  bool fua = !!(flags & NBDKIT_FLAG_FUA);
+  int r;
+
+  assert (b->magic == BACKEND_MAGIC);
+  assert (b->aio_pwrite != NULL);
+  assert (c->handle && (c->state & HANDLE_CONNECTED));
+  assert (c->can_write == 1);
+  assert (backend_valid_range (c, offset, count));
+  assert (!(flags & ~NBDKIT_FLAG_FUA));
+  if (fua)
+    assert (c->can_fua == NBDKIT_FUA_NATIVE);
+  datapath_debug ("%s: aio_pwrite count=%" PRIu32 " offset=%" PRIu64
+                  " fua=%d",
+                  b->name, count, offset, fua);
+
+  probe_entry ("aio_pwrite", count, offset);
+  r = b->aio_pwrite (c, buf, count, offset, flags, req, err);
+  probe_exit ("aio_pwrite", r, err);
+  if (r == -1)
+    assert (*err);
+  return r;
+}
+
+int
+backend_pread_fd (struct context *c,
+                  uint32_t count, uint64_t offset, uint32_t flags,
+                  int *fd, uint64_t *fd_offset, int *err)
+{
+  PUSH_CONTEXT_FOR_SCOPE (c);
+  struct backend *b = c->b;
+  int r;
+
+  assert (b->magic == BACKEND_MAGIC);
+  assert (b->pread_fd != NULL);
+  assert (c->handle && (c->state & HANDLE_CONNECTED));
+  assert (backend_valid_range (c, offset, count));
+  assert (flags == 0);
+  datapath_debug ("%s: pread_fd count=%" PRIu32 " offset=%" PRIu64,
+                  b->name, count, offset);
+
+  *fd = -1;
+  probe_entry ("pread_fd", count, offset);
+  r = b->pread_fd (c, count, offset, flags, fd, fd_offset, err);
+  probe_exit ("pread_fd", r, err);
+  if (r == -1)
+    assert (*err);
+  return r;
+}
+
+int
+backend_pwrite_payload (struct context *c,
+                        uint32_t count, uint64_t offset, uint32_t flags,
+                        struct nbdkit_payload *payload, int *err)
+{
+  PUSH_CONTEXT_FOR_SCOPE (c);
+  struct backend *b = c->b;
+  bool fua = !!(flags & NBDKIT_FLAG_FUA);
+  int r;
+
+  assert (b->magic == BACKEND_MAGIC);
+  assert (b->pwrite_payload != NULL);
+  assert (c->handle && (c->state & HANDLE_CONNECTED));
+  assert (c->can_write == 1);
+  assert (backend_valid_range (c, offset, count));
+  assert (!(flags & ~NBDKIT_FLAG_FUA));
+  if (fua)
+    assert (c->can_fua == NBDKIT_FUA_NATIVE);
+  datapath_debug ("%s: pwrite_payload count=%" PRIu32 " offset=%" PRIu64
+                  " fua=%d",
+                  b->name, count, offset, fua);
+
+  probe_entry ("pwrite_payload", count, offset);
+  r = b->pwrite_payload (c, count, offset, flags, payload, err);
+  probe_exit ("pwrite_payload", r, err);
+  if (c->extents_cache)
+    extents_cache_invalidate (c, offset, count);
   if (r == -1)
     assert (*err);
   return r;
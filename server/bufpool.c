@@ -0,0 +1,525 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Pool of data buffers for read and write requests.
+ *
+ * Buffers are borrowed for the lifetime of a single request and then
+ * returned, so the memory used tracks the amount of data actually in
+ * flight rather than the largest request each worker thread has ever
+ * seen.  Buffer sizes are rounded up to a power of 2 (size class).
+ * Returned buffers are kept for reuse, up to a total of --buffer-pool
+ * idle bytes, beyond which they are freed.  Buffers which are in use
+ * are not counted against this limit.
+ *
+ * Each server thread keeps one idle buffer of each of the smaller
+ * size classes for itself.  A worker normally borrows and returns the
+ * buffers for its own requests, so most requests are served from this
+ * cache, taking only the thread's own (uncontended) lock.  Other idle
+ * buffers go on free lists per size class, shared by all threads.
+ *
+ * Large buffers are allocated with mmap and the kernel is asked to
+ * back them with transparent huge pages where possible.  Since pages
+ * of an mmap are only allocated when touched, rounding up the size
+ * does not use more memory than the request needs.
+ *
+ * With --cpu-affinity there is a separate set of shared free lists,
+ * with its own lock, for each CPU group, so a buffer is only reused by
+ * threads running on the same group (usually the same NUMA node) as
+ * the thread which first touched it.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#else
+/* Only used for statistics.  idle_bytes is protected by idle_lock. */
+#define _Atomic /**/
+#endif
+
+#include "internal.h"
+#include "minmax.h"
+#include "vector.h"
+
+/* Smallest and largest size classes.  Classes are MIN_CLASS_SIZE <<
+ * i for i in [0, NR_CLASSES).
+ */
+#define MIN_CLASS_SHIFT 12
+#define MIN_CLASS_SIZE (UINT64_C(1) << MIN_CLASS_SHIFT)
+#define NR_CLASSES 15
+#if (MIN_CLASS_SIZE << (NR_CLASSES-1)) != MAX_REQUEST_SIZE
+#error "largest size class must be MAX_REQUEST_SIZE"
+#endif
+
+/* Classes this large or larger are allocated with mmap. */
+#define MMAP_CLASS_SIZE (2 * 1024 * 1024)
+
+/* Per-thread caches hold the classes smaller than MMAP_CLASS_SIZE. */
+#define NR_CACHED_CLASSES 9
+#if (MIN_CLASS_SIZE << NR_CACHED_CLASSES) != MMAP_CLASS_SIZE
+#error "NR_CACHED_CLASSES does not match MMAP_CLASS_SIZE"
+#endif
+
+/* An idle buffer, and the connection which last used it.  A buffer
+ * returned while no connection was current has owner NULL.
+ */
+struct idle_buffer {
+  void *ptr;
+  const struct connection *owner;
+};
+DEFINE_VECTOR_TYPE (idle_buffers, struct idle_buffer);
+
+/* Shared free lists for one --cpu-affinity group. */
+struct group {
+  pthread_mutex_t lock;
+  idle_buffers free_lists[NR_CLASSES]; /* protected by lock */
+};
+
+/* One cached buffer per class for a thread.  The lock is only taken
+ * by another thread in bufpool_forget_connection and bufpool_free.
+ */
+struct thread_cache {
+  pthread_mutex_t lock;
+  unsigned group;
+  struct idle_buffer slots[NR_CACHED_CLASSES]; /* protected by lock */
+};
+DEFINE_VECTOR_TYPE (thread_caches, struct thread_cache *);
+
+/* groups is allocated on first use, since the number of groups is not
+ * known until the command line has been parsed.  If the allocation
+ * fails, idle buffers are simply freed.
+ */
+static pthread_once_t groups_once = PTHREAD_ONCE_INIT;
+static struct group *groups;
+static unsigned nr_groups;
+
+/* All thread caches, so their owners can be forgotten. */
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_caches caches = empty_vector; /* protected by caches_lock */
+
+/* Bytes in idle buffers, in the free lists and thread caches. */
+#ifdef HAVE_STDATOMIC_H
+static _Atomic uint64_t idle_bytes;
+#else
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t idle_bytes;
+#endif
+
+/* Statistics. */
+static _Atomic uint64_t in_use_bytes; /* Bytes borrowed */
+static _Atomic uint64_t peak_bytes;   /* Peak of idle_bytes + in_use_bytes */
+static _Atomic uint64_t nr_gets, nr_reused, nr_freed;
+
+static unsigned
+size_class (size_t size)
+{
+  unsigned i = 0;
+
+  assert (size <= MAX_REQUEST_SIZE);
+  while ((MIN_CLASS_SIZE << i) < size)
+    i++;
+  return i;
+}
+
+/* Add n bytes to idle_bytes if that stays within --buffer-pool,
+ * returning true, otherwise return false.
+ */
+static bool
+reserve_idle (uint64_t n)
+{
+#ifdef HAVE_STDATOMIC_H
+  uint64_t old = atomic_load_explicit (&idle_bytes, memory_order_relaxed);
+
+  do {
+    if (old + n > buffer_pool_max)
+      return false;
+  } while (!atomic_compare_exchange_weak_explicit (&idle_bytes,
+                                                   &old, old + n,
+                                                   memory_order_relaxed,
+                                                   memory_order_relaxed));
+  return true;
+#else
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&idle_lock);
+  if (idle_bytes + n > buffer_pool_max)
+    return false;
+  idle_bytes += n;
+  return true;
+#endif
+}
+
+static void
+release_idle (uint64_t n)
+{
+#ifdef HAVE_STDATOMIC_H
+  atomic_fetch_sub_explicit (&idle_bytes, n, memory_order_relaxed);
+#else
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&idle_lock);
+  idle_bytes -= n;
+#endif
+}
+
+static void
+init_groups (void)
+{
+  unsigned i;
+
+  nr_groups = affinity_nr_groups ();
+  groups = calloc (nr_groups, sizeof *groups);
+  if (groups == NULL) {
+    nbdkit_error ("calloc: %m");
+    return;
+  }
+  for (i = 0; i < nr_groups; ++i)
+    pthread_mutex_init (&groups[i].lock, NULL);
+}
+
+/* Return the shared free lists for group g. */
+static struct group *
+get_group (unsigned g)
+{
+  pthread_once (&groups_once, init_groups);
+  if (groups == NULL)
+    return NULL;
+  assert (g < nr_groups);
+  return &groups[g];
+}
+
+/* Return the cache for the current thread, creating it if needed.
+ * Threads not created by the server have no cache.
+ */
+static struct thread_cache *
+get_thread_cache (void)
+{
+  struct thread_cache *cache = threadlocal_get_bufpool_cache ();
+
+  if (cache != NULL || !threadlocal_is_server_thread ())
+    return cache;
+
+  cache = calloc (1, sizeof *cache);
+  if (cache == NULL)
+    return NULL;
+  pthread_mutex_init (&cache->lock, NULL);
+  cache->group = threadlocal_get_affinity_group ();
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&caches_lock);
+    if (thread_caches_append (&caches, cache) == -1) {
+      pthread_mutex_destroy (&cache->lock);
+      free (cache);
+      return NULL;
+    }
+  }
+  threadlocal_set_bufpool_cache (cache);
+  return cache;
+}
+
+static void *
+alloc_buffer (size_t n)
+{
+  void *ptr;
+
+#if defined (HAVE_SYS_MMAN_H) && defined (MAP_ANONYMOUS)
+  if (n >= MMAP_CLASS_SIZE) {
+    ptr = mmap (NULL, n, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+                -1, 0);
+    if (ptr == MAP_FAILED) {
+      nbdkit_error ("mmap: %m");
+      return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    /* This is only a hint, so ignore errors. */
+    madvise (ptr, n, MADV_HUGEPAGE);
+#endif
+    return ptr;
+  }
+#endif
+
+  /* The buffer must not contain heap data from the server. */
+  ptr = calloc (n, 1);
+  if (ptr == NULL)
+    nbdkit_error ("calloc: %m");
+  return ptr;
+}
+
+static void
+free_buffer (void *ptr, size_t n)
+{
+#if defined (HAVE_SYS_MMAN_H) && defined (MAP_ANONYMOUS)
+  if (n >= MMAP_CLASS_SIZE) {
+    munmap (ptr, n);
+    return;
+  }
+#endif
+  free (ptr);
+}
+
+/* Put an idle buffer on the shared free list for class i of group g,
+ * or free it if the list cannot be extended.  The caller must already
+ * have reserved its size in idle_bytes.
+ */
+static void
+put_shared (unsigned g, unsigned i, struct idle_buffer b)
+{
+  const size_t n = MIN_CLASS_SIZE << i;
+  struct group *grp = get_group (g);
+
+  if (grp) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&grp->lock);
+    if (idle_buffers_append (&grp->free_lists[i], b) == 0)
+      return;
+  }
+  release_idle (n);
+  nr_freed++;
+  free_buffer (b.ptr, n);
+}
+
+static void
+update_peak (void)
+{
+  uint64_t total = idle_bytes + in_use_bytes;
+
+  /* Only statistics, so a lost update doesn't matter. */
+  if (total > peak_bytes)
+    peak_bytes = total;
+}
+
+/* Borrow a buffer of at least size bytes, which must be returned with
+ * bufpool_put.
+ *
+ * Newly allocated buffers are zeroed.  A reused buffer may contain
+ * data from an earlier request on the same connection.  This is fine
+ * because correctly written plugins should overwrite the whole buffer
+ * on each request, and previous request data from the plugin is not
+ * considered sensitive.  However if clear is true and the buffer was
+ * last used by a different connection, the first size bytes are
+ * zeroed so that data is never leaked between clients.  clear may be
+ * false if the caller is about to overwrite the whole buffer (eg. for
+ * writes).
+ */
+void *
+bufpool_get (size_t size, bool clear)
+{
+  const struct connection *conn = threadlocal_get_conn ();
+  const unsigned i = size_class (size);
+  const size_t n = MIN_CLASS_SIZE << i;
+  struct idle_buffer b = { .ptr = NULL };
+  struct thread_cache *cache = NULL;
+  struct group *grp;
+
+  nr_gets++;
+  in_use_bytes += n;
+
+  if (i < NR_CACHED_CLASSES)
+    cache = get_thread_cache ();
+  if (cache) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cache->lock);
+    b = cache->slots[i];
+    cache->slots[i].ptr = NULL;
+  }
+
+  if (b.ptr == NULL) {
+    grp = get_group (threadlocal_get_affinity_group ());
+    if (grp) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&grp->lock);
+      idle_buffers *free_list = &grp->free_lists[i];
+
+      if (free_list->len > 0) {
+        b = free_list->ptr[free_list->len-1];
+        idle_buffers_remove (free_list, free_list->len-1);
+      }
+    }
+  }
+
+  if (b.ptr == NULL) {
+    b.ptr = alloc_buffer (n);
+    if (b.ptr == NULL) {
+      in_use_bytes -= n;
+      return NULL;
+    }
+    update_peak ();
+    return b.ptr;
+  }
+
+  release_idle (n);
+  nr_reused++;
+  if (clear && (b.owner == NULL || b.owner != conn))
+    memset (b.ptr, 0, size);
+  return b.ptr;
+}
+
+/* Return a buffer borrowed with bufpool_get.  size must be the same
+ * as was passed to bufpool_get.
+ */
+void
+bufpool_put (void *ptr, size_t size)
+{
+  struct idle_buffer b = { .ptr = ptr, .owner = threadlocal_get_conn () };
+  struct thread_cache *cache = NULL;
+  unsigned i;
+  size_t n;
+
+  if (ptr == NULL)
+    return;
+
+  i = size_class (size);
+  n = MIN_CLASS_SIZE << i;
+  in_use_bytes -= n;
+
+  if (!reserve_idle (n)) {
+    nr_freed++;
+    free_buffer (ptr, n);
+    return;
+  }
+
+  if (i < NR_CACHED_CLASSES)
+    cache = get_thread_cache ();
+  if (cache) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cache->lock);
+    if (cache->slots[i].ptr == NULL) {
+      cache->slots[i] = b;
+      return;
+    }
+  }
+
+  put_shared (threadlocal_get_affinity_group (), i, b);
+}
+
+/* Called from the thread-local storage destructor when a server
+ * thread exits.  Its cached buffers go back on the shared lists.
+ */
+void
+bufpool_thread_exit (void *vcache)
+{
+  struct thread_cache *cache = vcache;
+  unsigned i;
+  size_t j;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&caches_lock);
+    for (j = 0; j < caches.len; ++j) {
+      if (caches.ptr[j] == cache) {
+        thread_caches_remove (&caches, j);
+        break;
+      }
+    }
+  }
+
+  /* Now no other thread can find the cache. */
+  for (i = 0; i < NR_CACHED_CLASSES; ++i)
+    if (cache->slots[i].ptr)
+      put_shared (cache->group, i, cache->slots[i]);
+  pthread_mutex_destroy (&cache->lock);
+  free (cache);
+}
+
+/* Called when a connection is freed.  Its address may be reused by a
+ * later connection, so forget that it owned any idle buffers.
+ */
+void
+bufpool_forget_connection (const struct connection *conn)
+{
+  unsigned g, i;
+  size_t j;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&caches_lock);
+    for (j = 0; j < caches.len; ++j) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&caches.ptr[j]->lock);
+      for (i = 0; i < NR_CACHED_CLASSES; ++i)
+        if (caches.ptr[j]->slots[i].owner == conn)
+          caches.ptr[j]->slots[i].owner = NULL;
+    }
+  }
+
+  for (g = 0; groups && g < nr_groups; ++g) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&groups[g].lock);
+    for (i = 0; i < NR_CLASSES; ++i)
+      for (j = 0; j < groups[g].free_lists[i].len; ++j)
+        if (groups[g].free_lists[i].ptr[j].owner == conn)
+          groups[g].free_lists[i].ptr[j].owner = NULL;
+  }
+}
+
+/* Free all idle buffers on exit and print statistics.  This is called
+ * after the server threads have finished, but the caches of threads
+ * which are still alive (eg. the main thread with -s) are emptied
+ * here.
+ */
+void
+bufpool_free (void)
+{
+  unsigned g, i;
+  size_t j;
+
+  debug ("buffer pool: %" PRIu64 " requests, %" PRIu64 " reused, "
+         "%" PRIu64 " freed, peak %" PRIu64 " bytes",
+         (uint64_t) nr_gets, (uint64_t) nr_reused, (uint64_t) nr_freed,
+         (uint64_t) peak_bytes);
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&caches_lock);
+    for (j = 0; j < caches.len; ++j) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&caches.ptr[j]->lock);
+      for (i = 0; i < NR_CACHED_CLASSES; ++i) {
+        if (caches.ptr[j]->slots[i].ptr) {
+          free_buffer (caches.ptr[j]->slots[i].ptr, MIN_CLASS_SIZE << i);
+          caches.ptr[j]->slots[i].ptr = NULL;
+        }
+      }
+    }
+  }
+
+  for (g = 0; groups && g < nr_groups; ++g) {
+    for (i = 0; i < NR_CLASSES; ++i) {
+      for (j = 0; j < groups[g].free_lists[i].len; ++j)
+        free_buffer (groups[g].free_lists[i].ptr[j].ptr, MIN_CLASS_SIZE << i);
+      idle_buffers_reset (&groups[g].free_lists[i]);
+    }
+    pthread_mutex_destroy (&groups[g].lock);
+  }
+  free (groups);
+  groups = NULL;
+  idle_bytes = 0;
+}
@@ -35,6 +35,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <errno.h>
+#include <time.h>
 #include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
@@ -46,6 +48,10 @@
 #include <sys/socket.h>
 #endif
 
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
 #include "internal.h"
 #include "utils.h"
 
@@ -58,9 +64,17 @@ static void free_connection (struct connection *conn);
 
 /* Don't call these raw socket functions directly.  Use conn->recv etc. */
 static int raw_recv ( void *buf, size_t len);
+#ifndef WIN32
+static ssize_t raw_recv_some_socket (void *buf, size_t len);
+#endif
 static int raw_send_socket (const void *buf, size_t len, int flags);
+static int raw_sendv_socket (const struct iovec *iov, int iovcnt, int flags);
+#if defined (HAVE_SENDFILE) && defined (HAVE_SYS_SENDFILE_H)
+static int raw_sendfile_socket (int fd, uint64_t offset, size_t len);
+#endif
 #ifndef WIN32
 static int raw_send_other (const void *buf, size_t len, int flags);
+static int raw_sendv_other (const struct iovec *iov, int iovcnt, int flags);
 #endif
 static void raw_close (int how);
 
@@ -70,6 +84,9 @@ connection_get_status (void)
   GET_CONN;
   conn_status r;
 
+#ifdef HAVE_STDATOMIC_H
+  r = atomic_load_explicit (&conn->status, memory_order_acquire);
+#else
   if (conn->nworkers &&
       pthread_mutex_lock (&conn->status_lock))
     abort ();
@@ -77,6 +94,7 @@ connection_get_status (void)
   if (conn->nworkers &&
       pthread_mutex_unlock (&conn->status_lock))
     abort ();
+#endif
   return r;
 }
 
@@ -87,28 +105,43 @@ bool
 connection_set_status (conn_status value)
 {
   GET_CONN;
-  bool ret = false;
-
+  conn_status old;
+
+#ifdef HAVE_STDATOMIC_H
+  old = atomic_load_explicit (&conn->status, memory_order_relaxed);
+  do {
+    if (value >= old)
+      return false;
+  } while (!atomic_compare_exchange_weak_explicit (&conn->status,
+                                                   &old, value,
+                                                   memory_order_acq_rel,
+                                                   memory_order_relaxed));
+#else
   if (conn->nworkers &&
       pthread_mutex_lock (&conn->status_lock))
     abort ();
-  if (value < conn->status) {
-    if (conn->nworkers && conn->status > STATUS_CLIENT_DONE &&
-        value <= STATUS_CLIENT_DONE) {
-      char c = 0;
-
-      assert (conn->status_pipe[1] >= 0);
-      if (write (conn->status_pipe[1], &c, 1) != 1 && errno != EAGAIN)
-        debug ("failed to notify pipe-to-self: %m");
-    }
-    if (conn->status >= STATUS_CLIENT_DONE && value < STATUS_CLIENT_DONE)
-      ret = true;
+  old = conn->status;
+  if (value < old)
     conn->status = value;
-  }
   if (conn->nworkers &&
       pthread_mutex_unlock (&conn->status_lock))
     abort ();
-  return ret;
+  if (value >= old)
+    return false;
+#endif
+
+  /* Only the thread which made the transition gets here, so the
+   * pipe-to-self is written at most once.
+   */
+  if (conn->nworkers && old > STATUS_CLIENT_DONE &&
+      value <= STATUS_CLIENT_DONE) {
+    char c = 0;
+
+    assert (conn->status_pipe[1] >= 0);
+    if (write (conn->status_pipe[1], &c, 1) != 1 && errno != EAGAIN)
+      debug ("failed to notify pipe-to-self: %m");
+  }
+  return old >= STATUS_CLIENT_DONE && value < STATUS_CLIENT_DONE;
 }
 
 struct worker_data {
@@ -116,29 +149,301 @@ struct worker_data {
   char *name;
 };
 
+/* A worker thread which has been waiting this long for a request
+ * exits, as long as it is not the last worker.
+ */
+#define WORKER_IDLE_TIMEOUT 5 /* seconds */
+
+/* Maximum number of queued requests performed together with
+ * --coalesce.
+ */
+#define MAX_COALESCED_REQUESTS 64
+
+/* Returns true if the reader should stop reading requests.  Must be
+ * called with workers_lock held.  Normally up to nworkers requests
+ * are queued.  With --coalesce the queue may grow beyond that until
+ * it holds coalesce_size bytes, so that there is a run of adjacent
+ * requests for a worker to combine.
+ */
+static bool
+queue_is_full (struct connection *conn)
+{
+  const size_t len = conn->queue.len;
+
+  if (len < (size_t) conn->nworkers)
+    return false;
+  if (coalesce_size == 0)
+    return true;
+  return len >= (size_t) conn->nworkers + MAX_COALESCED_REQUESTS ||
+    conn->queue_bytes >= coalesce_size;
+}
+
+/* Wait for the next request in the queue, and store it in rqs[0].
+ * With --coalesce, adjacent requests queued behind it which can be
+ * performed together are taken too.  Returns the number of requests,
+ * or 0 if the worker should exit, either because it was idle for too
+ * long or because the reader has finished and the queue is empty.
+ *
+ * The worker is removed from workers_running in the same critical
+ * section that decides it should exit.  Otherwise several workers
+ * timing out together could all see another worker still running and
+ * all exit, and queue_request would not start a new one.  On return
+ * of 0 the worker must not touch the connection again, since it may
+ * be freed as soon as workers_running drops to zero, unless *finish
+ * is set.  That means the worker was the last one on a connection
+ * served by the I/O threads (--io-threads) which has finished
+ * reading, and it must finish the connection.
+ */
+static size_t
+worker_get_requests (struct connection *conn,
+                     struct protocol_request **rqs, bool *finish)
+{
+  struct timespec deadline;
+  uint64_t count;
+  size_t i, n;
+  int r;
+
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += WORKER_IDLE_TIMEOUT;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->workers_lock);
+  conn->workers_idle++;
+  while (conn->queue.len == 0 && !conn->reader_done) {
+    r = pthread_cond_timedwait (&conn->workers_cond, &conn->workers_lock,
+                                &deadline);
+    if (r == ETIMEDOUT && conn->queue.len == 0) {
+      /* With --io-threads, idle connections don't keep any threads. */
+      if (conn->workers_running > 1 || conn->mux)
+        goto exit;
+      /* The last worker stays, so wait for another period rather
+       * than spinning on the expired deadline.
+       */
+      deadline.tv_sec += WORKER_IDLE_TIMEOUT;
+    }
+  }
+  if (conn->queue.len == 0)
+    goto exit;
+  conn->workers_idle--;
+
+  rqs[0] = conn->queue.ptr[0];
+  count = rqs[0]->count;
+  for (n = 1; coalesce_size > 0 && n < conn->queue.len &&
+         n < MAX_COALESCED_REQUESTS; ++n) {
+    if (!protocol_can_coalesce (rqs[n-1], conn->queue.ptr[n], count))
+      break;
+    rqs[n] = conn->queue.ptr[n];
+    count += rqs[n]->count;
+  }
+  for (i = 0; i < n; ++i)
+    request_queue_remove (&conn->queue, 0);
+  conn->queue_bytes -= count;
+  pthread_cond_signal (&conn->queue_cond);
+  if (conn->mux_stalled && !queue_is_full (conn)) {
+    conn->mux_stalled = false;
+    mux_resume (conn);
+  }
+  return n;
+
+ exit:
+  conn->workers_idle--;
+  conn->workers_running--;
+  debug ("exiting worker thread %s", threadlocal_get_name ());
+  pthread_cond_broadcast (&conn->workers_cond);
+  *finish = conn->mux && conn->reader_done && conn->workers_running == 0;
+  return 0;
+}
+
 static void *
 connection_worker (void *data)
 {
   struct worker_data *worker = data;
   struct connection *conn = worker->conn;
   char *name = worker->name;
+  struct protocol_request *rqs[MAX_COALESCED_REQUESTS];
+  size_t i, n;
+  bool r, finish = false;
 
   debug ("starting worker thread %s", name);
   threadlocal_new_server_thread ();
   threadlocal_set_name (name);
   threadlocal_set_conn (conn);
+  affinity_bind (conn->affinity_group);
   free (worker);
 
-  while (!quit && connection_get_status () > STATUS_CLIENT_DONE)
-    if (protocol_recv_request_send_reply ()) {
+  while ((n = worker_get_requests (conn, rqs, &finish)) > 0) {
+    if (n == 1)
+      r = protocol_process_request (rqs[0]);
+    else
+      r = protocol_process_coalesced (rqs, n);
+    if (r) {
       ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
       conn->close (SHUT_WR);
     }
-  debug ("exiting worker thread %s", threadlocal_get_name ());
+    for (i = 0; i < n; ++i)
+      free (rqs[i]);
+
+    /* If the connection is going away while the I/O threads wait for
+     * the client, make the socket readable so that they notice.
+     */
+    if (conn->mux && connection_get_status () <= STATUS_CLIENT_DONE)
+      shutdown (conn->sockin, SHUT_RD);
+  }
+
+  /* worker_get_requests has already removed this worker from
+   * workers_running, so the connection may have been freed, unless
+   * this worker has to finish it.
+   */
+  if (finish)
+    mux_finish_connection (conn);
+  threadlocal_set_conn (NULL);
   free (name);
   return NULL;
 }
 
+/* Start a new worker thread.  Must be called with workers_lock held.
+ * Workers are detached; handle_single_connection waits for
+ * workers_running to drop to zero instead of joining them.
+ */
+static int
+start_worker (struct connection *conn)
+{
+  struct worker_data *worker;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int err;
+
+  worker = malloc (sizeof *worker);
+  if (unlikely (!worker)) {
+    perror ("malloc");
+    return -1;
+  }
+  if (unlikely (asprintf (&worker->name, "%s.%u",
+                          top->plugin_name (top),
+                          conn->workers_started) < 0)) {
+    perror ("asprintf");
+    free (worker);
+    return -1;
+  }
+  worker->conn = conn;
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  err = pthread_create (&thread, &attr, connection_worker, worker);
+  pthread_attr_destroy (&attr);
+  if (unlikely (err)) {
+    errno = err;
+    perror ("pthread_create");
+    free (worker->name);
+    free (worker);
+    return -1;
+  }
+  conn->workers_running++;
+  conn->workers_started++;
+  return 0;
+}
+
+/* Hand a request to the workers, starting a new worker if none is
+ * idle.  If no worker could be started at all, process the request
+ * on the current thread instead.
+ */
+static void
+queue_request (struct connection *conn, struct protocol_request *rq)
+{
+  bool inline_request = false;
+
+  pthread_mutex_lock (&conn->workers_lock);
+  if (request_queue_append (&conn->queue, rq) == -1) {
+    nbdkit_error ("realloc: %m");
+    inline_request = true;
+  }
+  else {
+    if (conn->workers_idle == 0 && conn->workers_running < conn->nworkers)
+      start_worker (conn);
+    if (conn->workers_running == 0) {
+      request_queue_remove (&conn->queue, conn->queue.len - 1);
+      inline_request = true;
+    }
+    else {
+      conn->queue_bytes += rq->count;
+      pthread_cond_signal (&conn->workers_cond);
+    }
+  }
+  pthread_mutex_unlock (&conn->workers_lock);
+
+  if (inline_request) {
+    if (protocol_process_request (rq)) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+      conn->close (SHUT_WR);
+    }
+    free (rq);
+  }
+}
+
+/* Hand a request read by the I/O threads (--io-threads) to the
+ * workers.  Returns true if the queue is now full, in which case
+ * mux_stalled has been set and the caller must stop reading until
+ * mux_resume is called.
+ */
+bool
+connection_queue_request (struct protocol_request *rq)
+{
+  GET_CONN;
+
+  queue_request (conn, rq);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->workers_lock);
+  if (queue_is_full (conn))
+    conn->mux_stalled = true;
+  return conn->mux_stalled;
+}
+
+/* The connection thread reads requests, including any write data,
+ * and queues them for the worker threads.  Since the reader never
+ * waits for a request to be processed, a small request which
+ * arrives behind a large write is handed to a worker as soon as it
+ * has been read.  To bound the memory used by requests which have
+ * been read but not yet started, the reader stops reading while the
+ * queue is full (see queue_is_full).
+ */
+static void
+connection_reader (struct connection *conn)
+{
+  struct protocol_request *rq;
+  bool r;
+
+  while (!quit && connection_get_status () > STATUS_CLIENT_DONE) {
+    pthread_mutex_lock (&conn->workers_lock);
+    while (queue_is_full (conn))
+      pthread_cond_wait (&conn->queue_cond, &conn->workers_lock);
+    pthread_mutex_unlock (&conn->workers_lock);
+
+    rq = malloc (sizeof *rq);
+    if (rq == NULL) {
+      nbdkit_error ("malloc: %m");
+      connection_set_status (STATUS_DEAD);
+      break;
+    }
+    r = protocol_recv_request (rq);
+    if (r) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+      conn->close (SHUT_WR);
+    }
+    if (rq->action == REQUEST_NONE)
+      free (rq);
+    else
+      queue_request (conn, rq);
+  }
+
+  /* Let the workers finish the queued requests and exit. */
+  pthread_mutex_lock (&conn->workers_lock);
+  conn->reader_done = true;
+  pthread_cond_broadcast (&conn->workers_cond);
+  while (conn->workers_running > 0)
+    pthread_cond_wait (&conn->workers_cond, &conn->workers_lock);
+  pthread_mutex_unlock (&conn->workers_lock);
+  assert (conn->queue.len == 0);
+}
+
 void
 handle_single_connection (int sockin, int sockout)
 {
@@ -146,7 +451,6 @@ handle_single_connection (int sockin, int sockout)
   int r;
   struct connection *conn;
   int nworkers = threads ? threads : DEFAULT_PARALLEL_REQUESTS;
-  pthread_t *workers = NULL;
 
   DTRACE_PROBE (nbdkit, handle_single_connection);
 
@@ -168,6 +472,9 @@ handle_single_connection (int sockin, int sockout)
   if (!conn)
     goto done;
 
+  /* Worker threads are pinned to the same CPUs as this thread. */
+  conn->affinity_group = affinity_bind_next ();
+
   plugin_name = top->plugin_name (top);
   threadlocal_set_name (plugin_name);
 
@@ -189,9 +496,27 @@ handle_single_connection (int sockin, int sockout)
   if (protocol_handshake () == -1)
     goto done;
   conn->handshake_complete = true;
+  metrics_add_connection ();
 
   cancel_timeout (conn);
 
+  /* Switch to io_uring now that the handshake is over, since it reads
+   * ahead and must not consume anything that STARTTLS would need.
+   * Only plain sockets are supported.
+   */
+  if (use_io_uring && !io_threads &&
+      !conn->using_tls && conn->sendv == raw_sendv_socket)
+    uring_setup ();
+
+  /* With --io-threads, hand the connection over to the I/O threads,
+   * which finalize and free it when the client goes away.
+   */
+  if (io_threads && nworkers && !listen_stdin && mux_add_connection ()) {
+    threadlocal_set_conn (NULL);
+    unlock_connection ();
+    return;
+  }
+
   if (!nworkers) {
     /* No need for a separate thread. */
     debug ("handshake complete, processing requests serially");
@@ -200,47 +525,15 @@ handle_single_connection (int sockin, int sockout)
         conn->close (SHUT_WR);
   }
   else {
-    /* Create thread pool to process requests. */
-    debug ("handshake complete, processing requests with %d threads",
-           nworkers);
-    workers = calloc (nworkers, sizeof *workers);
-    if (unlikely (!workers)) {
-      perror ("malloc");
-      goto done;
-    }
-
-    for (nworkers = 0; nworkers < conn->nworkers; nworkers++) {
-      struct worker_data *worker = malloc (sizeof *worker);
-      int err;
-
-      if (unlikely (!worker)) {
-        perror ("malloc");
-        connection_set_status (STATUS_DEAD);
-        goto wait;
-      }
-      if (unlikely (asprintf (&worker->name, "%s.%d", plugin_name, nworkers)
-                    < 0)) {
-        perror ("asprintf");
-        connection_set_status (STATUS_DEAD);
-        free (worker);
-        goto wait;
-      }
-      worker->conn = conn;
-      err = pthread_create (&workers[nworkers], NULL, connection_worker,
-                            worker);
-      if (unlikely (err)) {
-        errno = err;
-        perror ("pthread_create");
-        connection_set_status (STATUS_DEAD);
-        free (worker);
-        goto wait;
-      }
-    }
+    /* This thread reads the requests.  Workers are started as needed
+     * when requests are in flight, up to nworkers.
+     */
+    debug ("handshake complete, processing requests with up to %d threads%s",
+           nworkers, ordered_replies ? " (ordered replies)" : "");
+    connection_reader (conn);
 
-  wait:
-    while (nworkers)
-      pthread_join (workers[--nworkers], NULL);
-    free (workers);
+    /* The plugin may still be processing asynchronous requests. */
+    protocol_wait_for_aio_requests ();
   }
 
   /* Finalize (for filters), called just before close. */
@@ -255,6 +548,22 @@ handle_single_connection (int sockin, int sockout)
   unlock_connection ();
 }
 
+/* Finalize and free a connection served by the I/O threads
+ * (--io-threads) after its last request has completed.
+ */
+void
+connection_finish (struct connection *conn)
+{
+  protocol_wait_for_aio_requests ();
+
+  /* Finalize (for filters), called just before close. */
+  lock_request ();
+  backend_finalize (conn->top_context);
+  unlock_request ();
+
+  free_connection (conn);
+}
+
 static struct connection *
 new_connection (int sockin, int sockout, int nworkers)
 {
@@ -275,7 +584,14 @@ new_connection (int sockin, int sockout, int nworkers)
   pthread_mutex_init (&conn->request_lock, NULL);
   pthread_mutex_init (&conn->read_lock, NULL);
   pthread_mutex_init (&conn->write_lock, NULL);
+  pthread_mutex_init (&conn->reply_lock, NULL);
   pthread_mutex_init (&conn->status_lock, NULL);
+  pthread_mutex_init (&conn->aio_lock, NULL);
+  pthread_mutex_init (&conn->workers_lock, NULL);
+  pthread_cond_init (&conn->aio_cond, NULL);
+  pthread_cond_init (&conn->reply_cond, NULL);
+  pthread_cond_init (&conn->workers_cond, NULL);
+  pthread_cond_init (&conn->queue_cond, NULL);
 
   conn->default_exportname = calloc (top->i + 1,
                                      sizeof *conn->default_exportname);
@@ -332,12 +648,22 @@ new_connection (int sockin, int sockout, int nworkers)
   conn->sockout = sockout;
   conn->recv = raw_recv;
 #ifndef WIN32
-  if (getsockopt (sockout, SOL_SOCKET, SO_TYPE, &opt, &optlen) == 0)
+  if (getsockopt (sockout, SOL_SOCKET, SO_TYPE, &opt, &optlen) == 0) {
+    if (sockin == sockout)
+      conn->recv_some = raw_recv_some_socket;
     conn->send = raw_send_socket;
-  else
+    conn->sendv = raw_sendv_socket;
+#if defined (HAVE_SENDFILE) && defined (HAVE_SYS_SENDFILE_H)
+    conn->sendfile = raw_sendfile_socket;
+#endif
+  }
+  else {
     conn->send = raw_send_other;
+    conn->sendv = raw_sendv_other;
+  }
 #else
   conn->send = raw_send_socket;
+  conn->sendv = raw_sendv_socket;
 #endif
   conn->close = raw_close;
 
@@ -358,7 +684,14 @@ new_connection (int sockin, int sockout, int nworkers)
   pthread_mutex_destroy (&conn->request_lock);
   pthread_mutex_destroy (&conn->read_lock);
   pthread_mutex_destroy (&conn->write_lock);
+  pthread_mutex_destroy (&conn->reply_lock);
   pthread_mutex_destroy (&conn->status_lock);
+  pthread_mutex_destroy (&conn->aio_lock);
+  pthread_cond_destroy (&conn->aio_cond);
+  pthread_cond_destroy (&conn->reply_cond);
+  pthread_mutex_destroy (&conn->workers_lock);
+  pthread_cond_destroy (&conn->workers_cond);
+  pthread_cond_destroy (&conn->queue_cond);
   free (conn);
   return NULL;
 }
@@ -371,8 +704,10 @@ free_connection (struct connection *conn)
   if (!conn)
     return;
 
+  DTRACE_PROBE1 (nbdkit, connection_close, conn);
   cancel_timeout (conn);
 
+  uring_free (conn);
   conn->close (SHUT_RDWR);
 
   /* Don't call the plugin again if quit has been set because the main
@@ -396,7 +731,15 @@ free_connection (struct connection *conn)
   pthread_mutex_destroy (&conn->request_lock);
   pthread_mutex_destroy (&conn->read_lock);
   pthread_mutex_destroy (&conn->write_lock);
+  pthread_mutex_destroy (&conn->reply_lock);
   pthread_mutex_destroy (&conn->status_lock);
+  pthread_mutex_destroy (&conn->aio_lock);
+  pthread_cond_destroy (&conn->aio_cond);
+  pthread_cond_destroy (&conn->reply_cond);
+  pthread_mutex_destroy (&conn->workers_lock);
+  pthread_cond_destroy (&conn->workers_cond);
+  pthread_cond_destroy (&conn->queue_cond);
+  free (conn->queue.ptr);
 
   free (conn->exportname_from_set_meta_context);
   free_interns ();
@@ -405,6 +748,8 @@ free_connection (struct connection *conn)
     free (conn->default_exportname[b->i]);
   free (conn->default_exportname);
 
+  metrics_remove_connection (conn);
+  bufpool_forget_connection (conn);
   conn->magic = 0;
 
   free (conn);
@@ -446,6 +791,86 @@ raw_send_socket (const void *vbuf, size_t len, int flags)
   return 0;
 }
 
+#ifndef WIN32
+/* After a short write of r bytes, skip over the iovecs (or part of an
+ * iovec) which have been written.  iov must be a private copy.
+ */
+static void
+advance_iov (struct iovec **iov, int *iovcnt, size_t r)
+{
+  while (*iovcnt > 0 && r >= (*iov)->iov_len) {
+    r -= (*iov)->iov_len;
+    (*iov)++;
+    (*iovcnt)--;
+  }
+  if (r > 0) {
+    (*iov)->iov_base = (char *) (*iov)->iov_base + r;
+    (*iov)->iov_len -= r;
+  }
+}
+
+/* Make a private copy of iov, skipping any empty buffers. */
+static int
+copy_iov (struct iovec *dst, const struct iovec *iov, int iovcnt)
+{
+  int i, n = 0;
+
+  assert (iovcnt <= SENDV_MAX_IOV);
+  for (i = 0; i < iovcnt; ++i)
+    if (iov[i].iov_len > 0)
+      dst[n++] = iov[i];
+  return n;
+}
+#endif /* !WIN32 */
+
+/* Write a list of buffers to conn->sockout using a single sendmsg()
+ * where possible.  Otherwise this behaves the same as raw_send_socket.
+ */
+static int
+raw_sendv_socket (const struct iovec *iov, int iovcnt, int flags)
+{
+#ifndef WIN32
+  GET_CONN;
+  int sock = conn->sockout;
+  struct iovec copy[SENDV_MAX_IOV], *p = copy;
+  struct msghdr msg = { 0 };
+  ssize_t r;
+  int f = 0;
+
+  if (sock < 0) {
+    errno = EBADF;
+    return -1;
+  }
+#ifdef MSG_MORE
+  if (flags & SEND_MORE)
+    f |= MSG_MORE;
+#endif
+  iovcnt = copy_iov (copy, iov, iovcnt);
+  while (iovcnt > 0) {
+    msg.msg_iov = p;
+    msg.msg_iovlen = iovcnt;
+    r = sendmsg (sock, &msg, f);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    advance_iov (&p, &iovcnt, r);
+  }
+
+  return 0;
+#else /* WIN32 */
+  int i;
+
+  for (i = 0; i < iovcnt; ++i) {
+    if (raw_send_socket (iov[i].iov_base, iov[i].iov_len,
+                         i < iovcnt - 1 ? SEND_MORE : flags) == -1)
+      return -1;
+  }
+  return 0;
+#endif /* WIN32 */
+}
+
 #ifndef WIN32
 /* Write buffer to conn->sockout with write() and either succeed completely
  * (returns 0) or fail (returns -1). flags is ignored.
@@ -472,6 +897,66 @@ raw_send_other (const void *vbuf, size_t len, int flags)
 
   return 0;
 }
+
+#if defined (HAVE_SENDFILE) && defined (HAVE_SYS_SENDFILE_H)
+/* Send len bytes starting at offset in fd to conn->sockout using
+ * sendfile(), so the data is not copied through userspace.  Either
+ * succeed completely (returns 0) or fail (returns -1).  Reaching the
+ * end of the file early is an error.
+ */
+static int
+raw_sendfile_socket (int fd, uint64_t offset, size_t len)
+{
+  GET_CONN;
+  int sock = conn->sockout;
+  off_t off = offset;
+  ssize_t r;
+
+  assert (sock >= 0);
+  while (len > 0) {
+    r = sendfile (sock, fd, &off, len);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    if (r == 0) {
+      errno = EIO;
+      return -1;
+    }
+    len -= r;
+  }
+
+  return 0;
+}
+#endif
+
+/* Write a list of buffers to conn->sockout using writev() and either
+ * succeed completely (returns 0) or fail (returns -1).  flags is
+ * ignored.
+ */
+static int
+raw_sendv_other (const struct iovec *iov, int iovcnt, int flags)
+{
+  GET_CONN;
+  int sock = conn->sockout;
+  struct iovec copy[SENDV_MAX_IOV], *p = copy;
+  ssize_t r;
+
+  assert (sock >= 0);
+  iovcnt = copy_iov (copy, iov, iovcnt);
+  while (iovcnt > 0) {
+    r = writev (sock, p, iovcnt);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    advance_iov (&p, &iovcnt, r);
+  }
+
+  return 0;
+}
 #endif /* !WIN32 */
 
 /* Read buffer from conn->sockin and either succeed completely
@@ -517,6 +1002,26 @@ raw_recv (void *vbuf, size_t len)
   return 1;
 }
 
+#ifndef WIN32
+/* Read whatever is available from the socket, up to len bytes,
+ * without waiting.  Returns the number of bytes read, 0 on EOF, or -1
+ * with errno set to EAGAIN if there is nothing to read yet.
+ */
+static ssize_t
+raw_recv_some_socket (void *buf, size_t len)
+{
+  GET_CONN;
+  ssize_t r;
+
+  do
+    r = recv (conn->sockin, buf, len, MSG_DONTWAIT);
+  while (r == -1 && errno == EINTR);
+  if (r == -1 && errno == EWOULDBLOCK)
+    errno = EAGAIN;
+  return r;
+}
+#endif
+
 /* There's no place in the NBD protocol to send back errors from
  * close, so this function ignores errors.
  *
@@ -73,6 +73,13 @@ static int crypto_auth;
 static gnutls_certificate_credentials_t x509_creds;
 static gnutls_psk_server_credentials_t psk_creds;
 
+/* Master key for session tickets (--tls-tickets).  GnuTLS derives
+ * the keys which actually encrypt tickets from this, and changes
+ * them every tls_tickets seconds.
+ */
+static gnutls_datum_t ticket_key;
+#define TICKET_KEY_SIZE 64
+
 static void print_gnutls_error (int err, const char *fs, ...)
   ATTRIBUTE_FORMAT_PRINTF (2, 3);
 
@@ -244,6 +251,56 @@ start_psk (void)
   return 0;
 }
 
+/* Set up the master key for session tickets, either loaded from
+ * --tls-ticket-key (so that several servers, or a restarted server,
+ * can resume each other's sessions) or randomly generated.
+ */
+static void
+start_tickets (void)
+{
+  int err, fd;
+  ssize_t r;
+
+  if (tls_ticket_key == NULL) {
+    err = gnutls_session_ticket_key_generate (&ticket_key);
+    if (err < 0) {
+      print_gnutls_error (err, "generating session ticket key");
+      exit (EXIT_FAILURE);
+    }
+    return;
+  }
+
+  ticket_key.data = gnutls_malloc (TICKET_KEY_SIZE);
+  if (ticket_key.data == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  ticket_key.size = TICKET_KEY_SIZE;
+
+  fd = open (tls_ticket_key, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    perror (tls_ticket_key);
+    exit (EXIT_FAILURE);
+  }
+  /* The file must contain the key and nothing else. */
+  r = read (fd, ticket_key.data, TICKET_KEY_SIZE);
+  if (r == TICKET_KEY_SIZE) {
+    char c;
+    if (read (fd, &c, 1) != 0)
+      r = -2;
+  }
+  close (fd);
+  if (r == -1) {
+    perror (tls_ticket_key);
+    exit (EXIT_FAILURE);
+  }
+  if (r != TICKET_KEY_SIZE) {
+    fprintf (stderr, "%s: %s: session ticket key must be exactly %d bytes\n",
+             program_name, tls_ticket_key, TICKET_KEY_SIZE);
+    exit (EXIT_FAILURE);
+  }
+}
+
 /* Initialize crypto.  This also handles the command line parameters
  * and loading the server certificate.
  */
@@ -278,6 +335,11 @@ crypto_init (bool tls_set_on_cli)
 
   if (r == 0) {
     debug ("TLS enabled using: %s", what);
+    if (tls_tickets > 0) {
+      start_tickets ();
+      debug ("TLS session tickets enabled, key changes every %u seconds",
+             tls_tickets);
+    }
     return;
   }
 
@@ -322,6 +384,11 @@ crypto_free (void)
       gnutls_psk_free_server_credentials (psk_creds);
       break;
     }
+    if (ticket_key.data) {
+      gnutls_memset (ticket_key.data, 0, ticket_key.size);
+      gnutls_free (ticket_key.data);
+      ticket_key.data = NULL;
+    }
   }
 
   gnutls_global_deinit ();
@@ -365,6 +432,57 @@ crypto_recv (void *vbuf, size_t len)
   return 1;
 }
 
+#ifndef WIN32
+/* Pull function used by crypto_recv_some, which reads from the
+ * socket without waiting.
+ */
+static ssize_t
+pull_nonblocking (gnutls_transport_ptr_t ptr, void *buf, size_t n)
+{
+  GET_CONN;
+  ssize_t r;
+
+  r = recv ((int) (intptr_t) ptr, buf, n, MSG_DONTWAIT);
+  if (r == -1)
+    gnutls_transport_set_errno (conn->crypto_session, errno);
+  return r;
+}
+
+/* Read whatever GnuTLS can decrypt, up to len bytes, without waiting.
+ * Returns the number of bytes read, 0 on EOF, or -1 with errno set to
+ * EAGAIN if there is nothing to read yet.
+ *
+ * Only the I/O threads (--io-threads) use this, and once they do the
+ * connection thread never reads again, so the session is switched to
+ * non-blocking reads for good.  GnuTLS keeps any partial record and
+ * carries on with it on the next call.
+ */
+static ssize_t
+crypto_recv_some (void *buf, size_t len)
+{
+  GET_CONN;
+  gnutls_session_t session = conn->crypto_session;
+  ssize_t r;
+
+  assert (session != NULL);
+
+  gnutls_transport_set_pull_function (session, pull_nonblocking);
+  do
+    r = gnutls_record_recv (session, buf, len);
+  while (r == GNUTLS_E_INTERRUPTED);
+  if (r == GNUTLS_E_AGAIN) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (r < 0) {
+    nbdkit_error ("gnutls_record_recv: %s", gnutls_strerror (r));
+    errno = EIO;
+    return -1;
+  }
+  return r;
+}
+#endif /* !WIN32 */
+
 /* If this send()'s length is so large that it is going to require
  * multiple TCP segments anyway, there's no need to try and merge it
  * with any corked data from a previous send that used SEND_MORE.
@@ -424,6 +542,83 @@ crypto_send (const void *vbuf, size_t len, int flags)
   return 0;
 }
 
+/* Write a list of buffers to GnuTLS.  The buffers are corked together
+ * so that they are sent in as few TLS records as possible.
+ */
+static int
+crypto_sendv (const struct iovec *iov, int iovcnt, int flags)
+{
+  int i;
+
+  for (i = 0; i < iovcnt; ++i) {
+    if (iov[i].iov_len == 0 && i < iovcnt - 1)
+      continue;
+    if (crypto_send (iov[i].iov_base, iov[i].iov_len,
+                     i < iovcnt - 1 ? SEND_MORE : flags) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+#if TRY_KTLS && defined (HAVE_GNUTLS_RECORD_SEND_FILE)
+/* Send len bytes starting at offset in fd.  This is only used when
+ * kTLS is enabled for sending, where GnuTLS uses sendfile(2) and the
+ * kernel encrypts the data, so it is never copied into userspace.
+ * Any data corked by a previous crypto_send must be sent first.
+ */
+static int
+crypto_sendfile (int fd, uint64_t offset, size_t len)
+{
+  GET_CONN;
+  gnutls_session_t session = conn->crypto_session;
+  off_t off = offset;
+  int err;
+  ssize_t r;
+
+  assert (session != NULL);
+
+  errno = 0;
+  err = gnutls_record_uncork (session, GNUTLS_RECORD_WAIT);
+  if (err < 0) {
+    nbdkit_error ("gnutls_record_uncork: %s", gnutls_strerror (err));
+    if (errno == 0) errno = EIO;
+    return -1;
+  }
+
+  while (len > 0) {
+    errno = 0;
+    r = gnutls_record_send_file (session, fd, &off, len);
+    if (r < 0) {
+      if (r == GNUTLS_E_INTERRUPTED || r == GNUTLS_E_AGAIN)
+        continue;
+      nbdkit_error ("gnutls_record_send_file: %s", gnutls_strerror (r));
+      if (errno == 0) errno = EIO;
+      return -1;
+    }
+    if (r == 0) {
+      errno = EIO;
+      return -1;
+    }
+    len -= r;
+  }
+
+  return 0;
+}
+#endif
+
+/* Return true if GnuTLS has already decrypted data for the current
+ * connection which has not been read yet, so that polling the socket
+ * would not show it.
+ */
+bool
+crypto_pending (void)
+{
+  GET_CONN;
+  gnutls_session_t session = conn->crypto_session;
+
+  return session != NULL && gnutls_record_check_pending (session) > 0;
+}
+
 /* There's no place in the NBD protocol to send back errors from
  * close, so this function ignores errors.
  */
@@ -740,6 +935,19 @@ crypto_negotiate_tls (int sockin, int sockout)
     goto error;
   }
 
+  /* Let clients resume this session later, skipping the key
+   * exchange and certificate checks.
+   */
+  if (ticket_key.data) {
+    err = gnutls_session_ticket_enable_server (session, &ticket_key);
+    if (err < 0) {
+      nbdkit_error ("gnutls_session_ticket_enable_server: %s",
+                    gnutls_strerror (err));
+      goto error;
+    }
+    gnutls_db_set_cache_expiration (session, tls_tickets);
+  }
+
   /* Set up GnuTLS so it reads and writes on the raw sockets. */
   gnutls_transport_set_int2 (session, sockin, sockout);
 #ifdef WIN32
@@ -769,7 +977,8 @@ crypto_negotiate_tls (int sockin, int sockout)
                   gnutls_strerror (err), (int) in, (int) out);
     goto error;
   }
-  debug ("TLS handshake completed");
+  debug ("TLS handshake completed%s",
+         gnutls_session_is_resumed (session) ? " (resumed session)" : "");
   debug_session (session);
 
   /* Set up the connection recv/send/close functions so they call
@@ -777,7 +986,24 @@ crypto_negotiate_tls (int sockin, int sockout)
    */
   conn->crypto_session = session;
   conn->recv = crypto_recv;
+  conn->recv_some = NULL;
+#ifndef WIN32
+  conn->recv_some = crypto_recv_some;
+#if TRY_KTLS
+  /* With kTLS the kernel decrypts, and GnuTLS reads the socket itself
+   * rather than through the pull function.
+   */
+  if (gnutls_transport_is_ktls_enabled (session) & GNUTLS_KTLS_RECV)
+    conn->recv_some = NULL;
+#endif
+#endif
   conn->send = crypto_send;
+  conn->sendv = crypto_sendv;
+  conn->sendfile = NULL;
+#if TRY_KTLS && defined (HAVE_GNUTLS_RECORD_SEND_FILE)
+  if (gnutls_transport_is_ktls_enabled (session) & GNUTLS_KTLS_SEND)
+    conn->sendfile = crypto_sendfile;
+#endif
   conn->close = crypto_close;
   return 0;
 
@@ -798,8 +1024,8 @@ typedef int (*get_dn3_fn) (gnutls_x509_crt_t cert, gnutls_datum_t *dn,
 static char *
 get_peer_dn (const char *fn, get_dn3_fn get_dn3)
 {
-  GET_CONN;
-  gnutls_session_t session = conn->crypto_session;
+  struct connection *conn = threadlocal_get_conn ();
+  gnutls_session_t session;
   gnutls_credentials_type_t cred;
   const gnutls_datum_t *cert_list;
   unsigned int cert_list_size = 0;
@@ -808,6 +1034,13 @@ get_peer_dn (const char *fn, get_dn3_fn get_dn3)
   int r;
   char *ret = NULL;
 
+  if (!conn) {
+    nbdkit_error ("no connection in this thread");
+    threadlocal_set_conn_needed (true);
+    return NULL;
+  }
+
+  session = conn->crypto_session;
   if (!session) {
     nbdkit_debug ("nbdkit_peer_tls_dn: no TLS session");
     goto out_no_dn;
@@ -930,6 +1163,12 @@ crypto_free (void)
   /* nothing */
 }
 
+bool
+crypto_pending (void)
+{
+  return false;
+}
+
 int
 crypto_negotiate_tls (int sockin, int sockout)
 {
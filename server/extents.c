@@ -40,6 +40,8 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 #include "cleanup.h"
 #include "isaligned.h"
@@ -356,3 +358,294 @@ nbdkit_extents_full (struct context *next_c,
   nbdkit_extents_free (ret);
   return NULL;
 }
+
+/* Extents cache (--extents-cache).
+ *
+ * The results of .extents on the top backend are remembered, so that
+ * a client which repeatedly asks about the same ranges is answered
+ * from memory.  The cache is a sorted list of non-overlapping
+ * extents, which need not be contiguous.  Writes, trims and zeroes
+ * passing through the top backend remove the range they touch.
+ *
+ * If the plugin supports multi-conn, all connections to an export
+ * see the same data, so they share one cache (kept until the server
+ * exits).  Otherwise each connection has its own.  Plugins and
+ * filters are told in .open whether the client is using TLS, and
+ * may serve different data depending on it (eg. the tls-fallback
+ * filter), so TLS and plaintext connections never share a cache.
+ *
+ * A query which misses the cache takes a snapshot of the generation
+ * number, which every invalidation increments.  The answer is only
+ * added to the cache if the generation has not changed, so an answer
+ * which raced with a write is never cached.
+ */
+
+/* When a cache holds more extents than this it is emptied. */
+#define MAX_CACHED_EXTENTS 65536
+
+struct extents_cache {
+  pthread_mutex_t lock;
+  char *exportname;             /* NULL if not shared */
+  bool using_tls;               /* only used if shared */
+  extents extents;              /* protected by lock */
+  uint64_t generation;          /* protected by lock */
+  uint64_t hits, misses;        /* protected by lock */
+};
+
+DEFINE_VECTOR_TYPE (extents_cache_list, struct extents_cache *);
+static pthread_mutex_t shared_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static extents_cache_list shared_caches = empty_vector;
+
+static struct extents_cache *
+new_extents_cache (const char *exportname, bool using_tls)
+{
+  struct extents_cache *cache;
+
+  cache = calloc (1, sizeof *cache);
+  if (cache == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  if (exportname) {
+    cache->exportname = strdup (exportname);
+    if (cache->exportname == NULL) {
+      nbdkit_error ("strdup: %m");
+      free (cache);
+      return NULL;
+    }
+    cache->using_tls = using_tls;
+  }
+  pthread_mutex_init (&cache->lock, NULL);
+  cache->extents = (extents) empty_vector;
+  return cache;
+}
+
+static void
+free_extents_cache (struct extents_cache *cache)
+{
+  if (cache->exportname)
+    debug ("extents cache for export \"%s\"%s: "
+           "%" PRIu64 " hits, %" PRIu64 " misses",
+           cache->exportname, cache->using_tls ? " (TLS)" : "",
+           cache->hits, cache->misses);
+  else
+    debug ("extents cache: %" PRIu64 " hits, %" PRIu64 " misses",
+           cache->hits, cache->misses);
+  pthread_mutex_destroy (&cache->lock);
+  free (cache->extents.ptr);
+  free (cache->exportname);
+  free (cache);
+}
+
+/* Attach a cache to the top context of a connection.  Called during
+ * the handshake, after can_multi_conn and can_extents are known.  If
+ * this fails, the context simply has no cache.
+ */
+void
+extents_cache_attach (struct context *c)
+{
+  GET_CONN;
+  struct extents_cache *cache = NULL;
+  size_t i;
+
+  if (!use_extents_cache || c->extents_cache || c->can_extents != 1)
+    return;
+
+  if (c->can_multi_conn != 1) {
+    c->extents_cache = new_extents_cache (NULL, false);
+    return;
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&shared_caches_lock);
+  for (i = 0; i < shared_caches.len; ++i) {
+    if (strcmp (shared_caches.ptr[i]->exportname, c->exportname) == 0 &&
+        shared_caches.ptr[i]->using_tls == conn->using_tls) {
+      cache = shared_caches.ptr[i];
+      break;
+    }
+  }
+  if (cache == NULL) {
+    cache = new_extents_cache (c->exportname, conn->using_tls);
+    if (cache == NULL)
+      return;
+    if (extents_cache_list_append (&shared_caches, cache) == -1) {
+      nbdkit_error ("realloc: %m");
+      free_extents_cache (cache);
+      return;
+    }
+  }
+  c->extents_cache = cache;
+}
+
+/* Called when the context is closed.  Shared caches are kept. */
+void
+extents_cache_detach (struct context *c)
+{
+  if (c->extents_cache && c->extents_cache->exportname == NULL)
+    free_extents_cache (c->extents_cache);
+  c->extents_cache = NULL;
+}
+
+/* Free the shared caches when the server exits. */
+void
+extents_cache_free (void)
+{
+  size_t i;
+
+  for (i = 0; i < shared_caches.len; ++i)
+    free_extents_cache (shared_caches.ptr[i]);
+  extents_cache_list_reset (&shared_caches);
+}
+
+/* Return the index of the first cached extent which ends after
+ * offset, or the number of extents if there is none.
+ */
+static size_t
+find_extent (const extents *v, uint64_t offset)
+{
+  size_t lo = 0, hi = v->len;
+
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    const struct nbdkit_extent *e = &v->ptr[mid];
+
+    if (e->offset + e->length <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Remove [offset, end) from the cache, splitting extents which
+ * overlap either end.  Returns the index where an extent starting at
+ * offset would be inserted, or -1 on error.
+ */
+static ssize_t
+remove_range (extents *v, uint64_t offset, uint64_t end)
+{
+  size_t i = find_extent (v, offset);
+  struct nbdkit_extent *e;
+
+  if (i < v->len && v->ptr[i].offset < offset) {
+    e = &v->ptr[i];
+    if (e->offset + e->length > end) {
+      /* The range is in the middle of this extent, so split it. */
+      const struct nbdkit_extent tail = {
+        .offset = end,
+        .length = e->offset + e->length - end,
+        .type = e->type,
+      };
+      e->length = offset - e->offset;
+      if (extents_insert (v, tail, i+1) == -1)
+        return -1;
+      return i+1;
+    }
+    e->length = offset - e->offset;
+    i++;
+  }
+
+  while (i < v->len && v->ptr[i].offset < end) {
+    e = &v->ptr[i];
+    if (e->offset + e->length > end) {
+      e->length -= end - e->offset;
+      e->offset = end;
+      break;
+    }
+    extents_remove (v, i);
+  }
+  return i;
+}
+
+/* Answer an extents query from the cache.  Returns 1 if the cache
+ * covers offset, in which case the contiguous cached extents from
+ * offset have been added to extents.  Returns 0 on a miss, and sets
+ * *generation for extents_cache_insert.  Returns -1 on error.
+ */
+int
+extents_cache_lookup (struct context *c,
+                      uint32_t count, uint64_t offset, uint32_t flags,
+                      struct nbdkit_extents *exts, uint64_t *generation)
+{
+  struct extents_cache *cache = c->extents_cache;
+  const uint64_t end = offset + count;
+  uint64_t pos = offset;
+  size_t i;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cache->lock);
+  i = find_extent (&cache->extents, offset);
+  if (i == cache->extents.len || cache->extents.ptr[i].offset > offset) {
+    cache->misses++;
+    *generation = cache->generation;
+    return 0;
+  }
+
+  cache->hits++;
+  for (; i < cache->extents.len && pos < end; ++i) {
+    const struct nbdkit_extent *e = &cache->extents.ptr[i];
+
+    if (e->offset > pos)
+      break;
+    if (nbdkit_add_extent (exts, e->offset, e->length, e->type) == -1)
+      return -1;
+    pos = e->offset + e->length;
+    if (flags & NBDKIT_FLAG_REQ_ONE)
+      break;
+  }
+  return 1;
+}
+
+/* Add the answer to a query which missed the cache. */
+void
+extents_cache_insert (struct context *c, const struct nbdkit_extents *exts,
+                      uint64_t generation)
+{
+  struct extents_cache *cache = c->extents_cache;
+  const extents *v = &exts->extents;
+  uint64_t offset, end;
+  ssize_t i;
+  size_t j;
+
+  if (v->len == 0)
+    return;
+  offset = v->ptr[0].offset;
+  end = v->ptr[v->len-1].offset + v->ptr[v->len-1].length;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cache->lock);
+  if (cache->generation != generation)
+    return;
+
+  if (cache->extents.len + v->len > MAX_CACHED_EXTENTS) {
+    debug ("extents cache: full, emptying it");
+    extents_reset (&cache->extents);
+  }
+
+  i = remove_range (&cache->extents, offset, end);
+  if (i == -1)
+    goto error;
+  if (extents_reserve (&cache->extents, v->len) == -1)
+    goto error;
+  for (j = 0; j < v->len; ++j) {
+    /* Cannot fail because of the reservation above. */
+    extents_insert (&cache->extents, v->ptr[j], i + j);
+  }
+  return;
+
+ error:
+  /* Don't leave a partly updated cache behind. */
+  extents_reset (&cache->extents);
+}
+
+/* Forget what is known about [offset, offset+count).  This must be
+ * called after the data has changed and before the client is told.
+ */
+void
+extents_cache_invalidate (struct context *c, uint64_t offset, uint64_t count)
+{
+  struct extents_cache *cache = c->extents_cache;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cache->lock);
+  cache->generation++;
+  if (remove_range (&cache->extents, offset, offset + count) == -1)
+    extents_reset (&cache->extents);
+}
@@ -542,8 +542,13 @@ filter_pread (struct context *c,
   if (f->filter.pread)
     return f->filter.pread (c_next, c->handle,
                             buf, count, offset, flags, err);
+  else if (f->filter.preadv) {
+    const struct nbdkit_iovec iov = { .base = buf, .len = count };
+    return f->filter.preadv (c_next, c->handle, &iov, 1, offset, flags, err);
+  }
   else
-    return backend_pread (c_next, buf, count, offset, flags, err);
+    return backend_pread (backend_passthrough (c, PASSTHROUGH_PREAD),
+                          buf, count, offset, flags, err);
 }
 
 static int
@@ -558,8 +563,88 @@ filter_pwrite (struct context *c,
   if (f->filter.pwrite)
     return f->filter.pwrite (c_next, c->handle,
                              buf, count, offset, flags, err);
+  else if (f->filter.pwritev) {
+    const struct nbdkit_iovec iov = { .base = (void *) buf, .len = count };
+    return f->filter.pwritev (c_next, c->handle, &iov, 1, offset, flags, err);
+  }
   else
-    return backend_pwrite (c_next, buf, count, offset, flags, err);
+    return backend_pwrite (backend_passthrough (c, PASSTHROUGH_PWRITE),
+                           buf, count, offset, flags, err);
+}
+
+/* A filter which implements .pread but not .preadv must see the
+ * whole request in one flat buffer.  Filters which implement neither
+ * pass the list through unchanged.
+ */
+static int
+filter_preadv (struct context *c,
+               const struct nbdkit_iovec *iov, unsigned iovcnt,
+               uint64_t offset, uint32_t flags, int *err)
+{
+  struct backend *b = c->b;
+  struct backend_filter *f = container_of (b, struct backend_filter, backend);
+  struct context *c_next = c->c_next;
+  uint32_t count;
+  void *buf;
+  int r;
+
+  if (f->filter.preadv)
+    return f->filter.preadv (c_next, c->handle,
+                             iov, iovcnt, offset, flags, err);
+  else if (!f->filter.pread)
+    return backend_preadv (backend_passthrough (c, PASSTHROUGH_PREADV),
+                           iov, iovcnt, offset, flags, err);
+
+  count = iovec_size (iov, iovcnt);
+  if (iovcnt == 1)
+    return f->filter.pread (c_next, c->handle,
+                            iov[0].base, count, offset, flags, err);
+
+  buf = iovec_bounce_get (count, true);
+  if (buf == NULL) {
+    *err = ENOMEM;
+    return -1;
+  }
+  r = f->filter.pread (c_next, c->handle, buf, count, offset, flags, err);
+  if (r == 0)
+    iovec_scatter (iov, iovcnt, buf);
+  iovec_bounce_put (buf, count);
+  return r;
+}
+
+static int
+filter_pwritev (struct context *c,
+                const struct nbdkit_iovec *iov, unsigned iovcnt,
+                uint64_t offset, uint32_t flags, int *err)
+{
+  struct backend *b = c->b;
+  struct backend_filter *f = container_of (b, struct backend_filter, backend);
+  struct context *c_next = c->c_next;
+  uint32_t count;
+  void *buf;
+  int r;
+
+  if (f->filter.pwritev)
+    return f->filter.pwritev (c_next, c->handle,
+                              iov, iovcnt, offset, flags, err);
+  else if (!f->filter.pwrite)
+    return backend_pwritev (backend_passthrough (c, PASSTHROUGH_PWRITEV),
+                            iov, iovcnt, offset, flags, err);
+
+  count = iovec_size (iov, iovcnt);
+  if (iovcnt == 1)
+    return f->filter.pwrite (c_next, c->handle,
+                             iov[0].base, count, offset, flags, err);
+
+  buf = iovec_bounce_get (count, false);
+  if (buf == NULL) {
+    *err = ENOMEM;
+    return -1;
+  }
+  iovec_gather (buf, iov, iovcnt);
+  r = f->filter.pwrite (c_next, c->handle, buf, count, offset, flags, err);
+  iovec_bounce_put (buf, count);
+  return r;
 }
 
 static int
@@ -573,7 +658,8 @@ filter_flush (struct context *c,
   if (f->filter.flush)
     return f->filter.flush (c_next, c->handle, flags, err);
   else
-    return backend_flush (c_next, flags, err);
+    return backend_flush (backend_passthrough (c, PASSTHROUGH_FLUSH),
+                          flags, err);
 }
 
 static int
@@ -589,7 +675,8 @@ filter_trim (struct context *c,
     return f->filter.trim (c_next, c->handle, count, offset,
                            flags, err);
   else
-    return backend_trim (c_next, count, offset, flags, err);
+    return backend_trim (backend_passthrough (c, PASSTHROUGH_TRIM),
+                         count, offset, flags, err);
 }
 
 static int
@@ -604,7 +691,8 @@ filter_zero (struct context *c,
     return f->filter.zero (c_next, c->handle,
                            count, offset, flags, err);
   else
-    return backend_zero (c_next, count, offset, flags, err);
+    return backend_zero (backend_passthrough (c, PASSTHROUGH_ZERO),
+                         count, offset, flags, err);
 }
 
 static int
@@ -621,8 +709,8 @@ filter_extents (struct context *c,
                               count, offset, flags,
                               extents, err);
   else
-    return backend_extents (c_next, count, offset, flags,
-                            extents, err);
+    return backend_extents (backend_passthrough (c, PASSTHROUGH_EXTENTS),
+                            count, offset, flags, extents, err);
 }
 
 static int
@@ -638,7 +726,8 @@ filter_cache (struct context *c,
     return f->filter.cache (c_next, c->handle,
                             count, offset, flags, err);
   else
-    return backend_cache (c_next, count, offset, flags, err);
+    return backend_cache (backend_passthrough (c, PASSTHROUGH_CACHE),
+                          count, offset, flags, err);
 }
 
 static struct backend filter_functions = {
@@ -676,6 +765,8 @@ static struct backend filter_functions = {
   .can_cache = filter_can_cache,
   .pread = filter_pread,
   .pwrite = filter_pwrite,
+  .preadv = filter_preadv,
+  .pwritev = filter_pwritev,
   .flush = filter_flush,
   .trim = filter_trim,
   .zero = filter_zero,
@@ -734,6 +825,24 @@ filter_register (struct backend *next, size_t index, const char *filename,
 
   f->filter = *filter;
 
+  /* Operations the filter leaves entirely to the next layer can skip
+   * this layer (see backend_passthrough).
+   */
+  if (!f->filter.pread && !f->filter.preadv)
+    f->backend.passthrough |= PASSTHROUGH_PREAD | PASSTHROUGH_PREADV;
+  if (!f->filter.pwrite && !f->filter.pwritev)
+    f->backend.passthrough |= PASSTHROUGH_PWRITE | PASSTHROUGH_PWRITEV;
+  if (!f->filter.flush)
+    f->backend.passthrough |= PASSTHROUGH_FLUSH;
+  if (!f->filter.trim)
+    f->backend.passthrough |= PASSTHROUGH_TRIM;
+  if (!f->filter.zero)
+    f->backend.passthrough |= PASSTHROUGH_ZERO;
+  if (!f->filter.extents)
+    f->backend.passthrough |= PASSTHROUGH_EXTENTS;
+  if (!f->filter.cache)
+    f->backend.passthrough |= PASSTHROUGH_CACHE;
+
   backend_load (&f->backend, f->filter.name, f->filter.load);
 
   return (struct backend *) f;
@@ -0,0 +1,328 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/* Pre-opened handle pool (--handle-pool).
+ *
+ * A background thread opens up to handle_pool contexts on the top
+ * backend ahead of time, outside any connection, in the same way
+ * that filters open shared contexts.  When a client selects the
+ * pooled export, the handshake takes a context from the pool instead
+ * of calling .open through the whole stack, and the thread opens
+ * another one to replace it.
+ *
+ * The pool serves a single export: the one named by -e, or else the
+ * default export, which is learned from the first client that asks
+ * for it (because .default_export is only called on behalf of a
+ * connection).  Contexts are opened with the TLS mode that
+ * nbdkit_is_tls reports outside a connection, so they are only given
+ * to clients where that matches.
+ *
+ * If .open in any layer needs the client connection (for example the
+ * ip filter with dn: rules calls nbdkit_peer_tls_dn), it cannot be
+ * called ahead of time, and the pool turns itself off.  Handles which
+ * have been in the pool for HANDLE_POOL_MAX_AGE are closed and opened
+ * again, so that clients are not given handles whose remote end may
+ * have timed out.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "internal.h"
+#include "minmax.h"
+#include "vector.h"
+
+/* How long to wait before trying again if .open fails.  This doubles
+ * after each failure, up to the maximum.
+ */
+#define HANDLE_POOL_RETRY 5 /* seconds */
+#define HANDLE_POOL_MAX_RETRY 300 /* seconds */
+
+/* How long a handle may stay in the pool. */
+#define HANDLE_POOL_MAX_AGE 60 /* seconds */
+
+struct pooled_context {
+  struct context *c;
+  time_t opened;
+};
+DEFINE_VECTOR_TYPE (context_list, struct pooled_context);
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t thread;
+static bool thread_started;
+static bool stopping;                   /* protected by lock */
+static bool disabled;                   /* protected by lock */
+static char *pool_exportname;           /* protected by lock */
+static context_list contexts = empty_vector; /* protected by lock */
+
+static struct context *
+open_context (const char *exportname)
+{
+  struct context *c;
+
+  lock_request ();
+  c = backend_open (top, read_only, exportname, true);
+  unlock_request ();
+  return c;
+}
+
+static void
+close_context (struct context *c)
+{
+  lock_request ();
+  backend_close (c);
+  unlock_request ();
+}
+
+static time_t
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  return ts.tv_sec;
+}
+
+/* Wait until woken, or until the time t.  Call with lock held. */
+static void
+wait_until (time_t t)
+{
+  struct timespec deadline = { .tv_sec = t };
+
+  pthread_cond_timedwait (&cond, &lock, &deadline);
+}
+
+static void *
+handle_pool_thread (void *arg)
+{
+  struct context *c;
+  CLEANUP_FREE char *exportname = NULL;
+  time_t retry_at = 0;
+  unsigned retry = HANDLE_POOL_RETRY;
+  bool conn_needed;
+
+  threadlocal_new_server_thread ();
+  threadlocal_set_name ("handle-pool");
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  while (!stopping) {
+    /* Close the oldest handle once it is too old.  Don't hold the
+     * lock while calling .close or .open, which may be slow.
+     */
+    if (contexts.len > 0 &&
+        now () >= contexts.ptr[0].opened + HANDLE_POOL_MAX_AGE) {
+      c = contexts.ptr[0].c;
+      context_list_remove (&contexts, 0);
+      pthread_mutex_unlock (&lock);
+      close_context (c);
+      pthread_mutex_lock (&lock);
+      continue;
+    }
+
+    if (pool_exportname == NULL) {
+      pthread_cond_wait (&cond, &lock);
+      continue;
+    }
+    if (contexts.len >= handle_pool) {
+      wait_until (contexts.ptr[0].opened + HANDLE_POOL_MAX_AGE);
+      continue;
+    }
+    if (now () < retry_at) {
+      wait_until (retry_at);
+      continue;
+    }
+
+    if (exportname == NULL) {
+      exportname = strdup (pool_exportname);
+      if (exportname == NULL) {
+        nbdkit_error ("strdup: %m");
+        return NULL;
+      }
+    }
+    pthread_mutex_unlock (&lock);
+    threadlocal_set_conn_needed (false);
+    c = open_context (exportname);
+    conn_needed = threadlocal_get_conn_needed ();
+    if (c != NULL && conn_needed) {
+      close_context (c);
+      c = NULL;
+    }
+    pthread_mutex_lock (&lock);
+
+    if (conn_needed) {
+      debug ("handle pool: disabled because .open needs the client "
+             "connection");
+      disabled = true;
+      break;
+    }
+    if (c == NULL) {
+      debug ("handle pool: open failed, retrying in %u seconds", retry);
+      retry_at = now () + retry;
+      retry = MIN (retry * 2, HANDLE_POOL_MAX_RETRY);
+      continue;
+    }
+    retry = HANDLE_POOL_RETRY;
+    if (context_list_append (&contexts,
+                             (struct pooled_context) {
+                               .c = c, .opened = now ()
+                             }) == -1) {
+      nbdkit_error ("realloc: %m");
+      pthread_mutex_unlock (&lock);
+      close_context (c);
+      pthread_mutex_lock (&lock);
+    }
+  }
+  return NULL;
+}
+
+/* Start opening handles in the background.  This must be called
+ * after nbdkit has forked into the background and the plugin's
+ * .after_fork has run.
+ */
+void
+handle_pool_start (void)
+{
+  int err;
+
+  if (handle_pool == 0)
+    return;
+
+  /* Opening a handle outside a connection would break the guarantee
+   * that only one connection at a time has a handle open.
+   */
+  if (thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_CONNECTIONS) {
+    debug ("handle pool disabled because of the thread model");
+    return;
+  }
+
+  if (export_name && *export_name) {
+    pool_exportname = strdup (export_name);
+    if (pool_exportname == NULL) {
+      nbdkit_error ("strdup: %m");
+      return;
+    }
+  }
+
+  err = pthread_create (&thread, NULL, handle_pool_thread, NULL);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return;
+  }
+  thread_started = true;
+}
+
+/* Stop the background thread and close the unused handles.  Called
+ * when the server is exiting and all connections have been closed.
+ */
+void
+handle_pool_stop (void)
+{
+  size_t i;
+
+  if (!thread_started)
+    return;
+
+  pthread_mutex_lock (&lock);
+  stopping = true;
+  pthread_cond_signal (&cond);
+  pthread_mutex_unlock (&lock);
+  pthread_join (thread, NULL);
+  thread_started = false;
+
+  debug ("handle pool: closing %zu unused handles", contexts.len);
+  for (i = 0; i < contexts.len; ++i)
+    close_context (contexts.ptr[i].c);
+  context_list_reset (&contexts);
+  free (pool_exportname);
+  pool_exportname = NULL;
+}
+
+/* Called from the handshake in place of backend_open.  Returns a
+ * pre-opened context for the export, now owned by the current
+ * connection, or NULL if the caller must open one itself.
+ */
+struct context *
+handle_pool_get (const char *exportname)
+{
+  GET_CONN;
+  struct context *c, *p;
+
+  if (!thread_started || conn->using_tls != (tls == 2))
+    return NULL;
+
+  if (!*exportname) {
+    exportname = backend_default_export (top, read_only);
+    if (exportname == NULL)
+      return NULL;
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  if (disabled)
+    return NULL;
+  if (pool_exportname == NULL) {
+    pool_exportname = strdup (exportname);
+    if (pool_exportname == NULL)
+      return NULL;
+    debug ("handle pool: opening handles for export \"%s\"", exportname);
+    pthread_cond_signal (&cond);
+    return NULL;
+  }
+  if (strcmp (pool_exportname, exportname) != 0 || contexts.len == 0 ||
+      now () >= contexts.ptr[contexts.len-1].opened + HANDLE_POOL_MAX_AGE)
+    return NULL;
+
+  /* Take the newest handle, which is the least likely to have gone
+   * stale, and wake the thread to replace it.
+   */
+  c = contexts.ptr[contexts.len-1].c;
+  context_list_remove (&contexts, contexts.len-1);
+  pthread_cond_signal (&cond);
+
+  /* The context and the contexts that filters opened beneath it
+   * with next_open now belong to this connection.
+   */
+  for (p = c; p != NULL; p = p->c_next)
+    p->conn = conn;
+
+  debug ("handle pool: using pre-opened handle, %zu left", contexts.len);
+  return c;
+}
@@ -43,6 +43,19 @@
 #include <sys/socket.h>
 #endif
 
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#endif
+
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#else
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#endif
+
 #ifdef ENABLE_PROBES
 #include <sys/sdt.h>
 #else /* !ENABLE_PROBES */
@@ -160,18 +173,28 @@ enum service_mode {
 extern const char *service_mode_string (enum service_mode);
 
 extern int tcpip_sock_af;
+extern unsigned accept_threads;
+extern uint64_t buffer_pool_max;
+extern uint64_t coalesce_size;
 extern struct debug_flag *debug_flags;
 extern const char *export_name;
+extern bool use_extents_cache;
 extern bool foreground;
+extern unsigned handle_pool;
+extern bool use_io_uring;
+extern unsigned io_threads;
 extern const char *ipaddr;
 extern bool keepalive;
 extern enum log_to log_to;
 extern const char *log_to_file;
 extern FILE *log_to_fp;
 extern unsigned mask_handshake;
+extern unsigned max_requests;
+extern char *metrics_file;
 extern bool newstyle;
 extern bool no_mc;
 extern bool no_sr;
+extern bool ordered_replies;
 extern const char *port;
 extern bool print_uri;
 extern bool read_only;
@@ -184,6 +207,8 @@ extern int tls;
 extern const char *tls_certificates_dir;
 extern const char *tls_psk;
 extern bool tls_verify_peer;
+extern unsigned tls_tickets;
+extern const char *tls_ticket_key;
 extern char *unixsocket;
 extern const char *user, *group;
 extern bool verbose;
@@ -253,11 +278,21 @@ enum {
   SEND_MORE = 1, /* Hint to use MSG_MORE/corking to group send()s */
 };
 
+/* Maximum number of buffers passed to connection_sendv_function. */
+#define SENDV_MAX_IOV 8
+
 typedef int (*connection_recv_function) (void *buf, size_t len)
   __attribute__ ((__nonnull__ (1)));
+typedef ssize_t (*connection_recv_some_function) (void *buf, size_t len)
+  __attribute__ ((__nonnull__ (1)));
 typedef int (*connection_send_function) (const void *buf, size_t len,
                                          int flags)
   __attribute__ ((__nonnull__ (1)));
+typedef int (*connection_sendv_function) (const struct iovec *iov,
+                                          int iovcnt, int flags)
+  __attribute__ ((__nonnull__ (1)));
+typedef int (*connection_sendfile_function) (int fd, uint64_t offset,
+                                             size_t len);
 typedef void (*connection_close_function) (int how);
 
 /* struct context stores data per connection and backend.  Primarily
@@ -300,6 +335,8 @@ struct context {
   int can_multi_conn;
   int can_extents;
   int can_cache;
+
+  struct extents_cache *extents_cache; /* Only in top context, if any. */
 };
 
 typedef enum {
@@ -309,6 +346,59 @@ typedef enum {
   STATUS_ACTIVE,       /* Client can make requests */
 } conn_status;
 
+/* A request which has been read from the client by
+ * protocol_recv_request, and must be passed to protocol_process_request
+ * unless action is REQUEST_NONE.  With worker threads these are
+ * called on different threads (see connections.c).
+ */
+enum request_action {
+  REQUEST_NONE,                 /* Nothing was read. */
+  REQUEST_PERFORM,              /* Perform the request and reply. */
+  REQUEST_REPLY,                /* Only reply with error. */
+  REQUEST_DROP,                 /* Connection is broken, no reply. */
+};
+
+/* What protocol_decode_request says must be done with the data (if
+ * any) following a request.
+ */
+enum request_data {
+  REQUEST_DATA_NONE,            /* There is no data. */
+  REQUEST_DATA_BUF,             /* Read the data into buf. */
+  REQUEST_DATA_SKIP,            /* Read and discard the data. */
+  REQUEST_DATA_PAYLOAD,         /* The plugin receives the data. */
+};
+
+struct protocol_request {
+  enum request_action action;
+  uint16_t cmd;
+  uint16_t flags;
+  uint32_t error;
+  uint64_t cookie;
+  uint64_t offset;
+  uint64_t count;
+  uint64_t seq;                 /* See --ordered-replies. */
+  uint64_t start;               /* See metrics_start_request. */
+  char *buf;                    /* Pooled data buffer, or NULL. */
+  struct nbdkit_request *aio;   /* Asynchronous request, or NULL. */
+  bool use_fd;                  /* Read may use .pread_fd. */
+  struct nbdkit_extents *extents;
+};
+
+DEFINE_VECTOR_TYPE (request_queue, struct protocol_request *);
+
+/* Per-connection state for the request scheduler (see scheduler.c).
+ * Protected by the scheduler lock.
+ */
+struct scheduler_flow {
+  struct scheduler_flow *next;  /* In the list of waiting flows. */
+  unsigned weight;              /* 0 until the first request. */
+  uint64_t pass;                /* Virtual time of the next admission. */
+  uint64_t next_ticket;         /* Tickets keep requests in order. */
+  uint64_t serving;
+  struct scheduler_waiter *waiters; /* Threads waiting, in ticket order. */
+  struct scheduler_waiter **waiters_tail;
+};
+
 struct connection {
   uint64_t magic;               /* Magic number used to validate struct. */
 #define CONN_MAGIC 0xc05
@@ -319,12 +409,69 @@ struct connection {
   pthread_mutex_t request_lock; /* Forces serialization of requests */
   pthread_mutex_t read_lock; /* Read entire client payload off wire */
   pthread_mutex_t write_lock; /* Protect sockout, write response to wire */
-  pthread_mutex_t status_lock; /* Track current status of client */
+  pthread_mutex_t reply_lock; /* Protects next_reply */
+  pthread_mutex_t workers_lock; /* Protects workers_*, queue, mux_* etc. */
+  pthread_mutex_t status_lock; /* Protects status without stdatomic.h */
+  pthread_mutex_t aio_lock; /* Protects aio_requests */
+
+  /* Number of asynchronous requests which have been passed to the
+   * plugin but not yet completed.  The connection cannot be closed
+   * until this drops to zero (signalled on aio_cond).
+   */
+  unsigned aio_requests;
+  pthread_cond_t aio_cond;
+
+  /* With --ordered-replies, requests are numbered in the order they
+   * are read from the client (next_request is protected by
+   * read_lock, or only used by the I/O thread reading the connection
+   * with --io-threads), and each reply waits on reply_cond until
+   * next_reply reaches its number.
+   */
+  uint64_t next_request;
+  uint64_t next_reply;
+  pthread_cond_t reply_cond;
+
+  /* The connection thread reads requests from the client and
+   * appends them to the queue.  Worker threads are started on demand,
+   * up to nworkers, take requests from the queue (waiting on
+   * workers_cond when it is empty) and exit again after they have
+   * been idle for a while.  The reader waits on queue_cond while the
+   * queue is full.  queue_bytes is the total count of the queued
+   * requests.  reader_done is set when no more requests will be
+   * queued.
+   */
+  int workers_running;
+  int workers_idle;
+  unsigned workers_started;
+  request_queue queue;
+  uint64_t queue_bytes;
+  bool reader_done;
+  pthread_cond_t workers_cond;
+  pthread_cond_t queue_cond;
+
+  /* With --io-threads, the connection has no thread of its own after
+   * the handshake.  mux holds the state of the request being read by
+   * the I/O threads, and is NULL otherwise.  mux_stalled is set when
+   * the I/O threads stopped reading because the queue was full, and
+   * the next worker to take a request from the queue calls mux_resume.
+   */
+  struct mux_state *mux;
+  bool mux_stalled;
+  size_t instance_num;
 
+  /* The status only ever decreases.  It is read on every request, so
+   * where possible it is atomic and read without taking a lock.
+   */
+#ifdef HAVE_STDATOMIC_H
+  _Atomic conn_status status;
+#else
   conn_status status;
+#endif
   int status_pipe[2]; /* track status changes via poll when nworkers > 1 */
   void *crypto_session;
   int nworkers;
+  unsigned affinity_group;      /* --cpu-affinity group */
+  struct scheduler_flow scheduler; /* --max-requests */
 
   struct context *top_context;  /* The context tied to 'top'. */
   char **default_exportname;    /* One per plugin and filter. */
@@ -338,6 +485,7 @@ struct connection {
 #endif
   bool using_tls;
   bool structured_replies;
+  bool extended_headers;
   bool meta_context_base_allocation;
 
   string_vector interns;
@@ -346,19 +494,33 @@ struct connection {
   int sockin, sockout;
   /* If nworkers > 1, only call this while read_lock is held */
   connection_recv_function recv;
+  /* Read what is available without waiting (--io-threads), or NULL
+   * if not supported.
+   */
+  connection_recv_some_function recv_some;
   /* If nworkers > 1, only call these while write_lock is held */
   connection_send_function send;
+  connection_sendv_function sendv;
+  /* Send directly from a file, or NULL if not supported. */
+  connection_sendfile_function sendfile;
   connection_close_function close;
+  /* With --io-uring, private state used by the functions above. */
+  struct uring *uring;
+
+  /* With --metrics, where requests on this connection are counted. */
+  struct export_metrics *metrics;
 };
 
 extern void handle_single_connection (int sockin, int sockout);
 extern conn_status connection_get_status (void);
 extern bool connection_set_status (conn_status value);
+extern bool connection_queue_request (struct protocol_request *rq);
+extern void connection_finish (struct connection *conn);
 
 /* protocol-handshake.c */
 extern int protocol_handshake (void);
 extern int protocol_common_open (uint64_t *exportsize, uint16_t *flags,
-                                 const char *exportname)
+                                 const char *exportname, bool probe)
   __attribute__ ((__nonnull__ (1, 2, 3)));
 
 /* protocol-handshake-oldstyle.c */
@@ -368,7 +530,18 @@ extern int protocol_handshake_oldstyle (void);
 extern int protocol_handshake_newstyle (void);
 
 /* protocol.c */
+extern bool protocol_decode_request (struct protocol_request *rq,
+                                     const void *header,
+                                     enum request_data *data);
+extern bool protocol_recv_request (struct protocol_request *rq);
+extern bool protocol_process_request (struct protocol_request *rq);
+extern bool protocol_can_coalesce (const struct protocol_request *a,
+                                   const struct protocol_request *b,
+                                   uint64_t count);
+extern bool protocol_process_coalesced (struct protocol_request **rqs,
+                                        size_t n);
 extern bool protocol_recv_request_send_reply (void);
+extern void protocol_wait_for_aio_requests (void);
 
 /* The context ID of base:allocation.  As far as I can tell it doesn't
  * matter what this is as long as nbdkit always returns the same
@@ -379,11 +552,73 @@ extern bool protocol_recv_request_send_reply (void);
 /* public.c */
 extern void free_interns (void);
 
+/* affinity.c */
+extern int affinity_parse (const char *spec);
+extern unsigned affinity_nr_groups (void);
+extern void affinity_bind (unsigned g);
+extern unsigned affinity_bind_next (void);
+extern void affinity_free (void);
+
+/* bufpool.c */
+extern void *bufpool_get (size_t size, bool clear);
+extern void bufpool_put (void *ptr, size_t size);
+extern void bufpool_forget_connection (const struct connection *conn);
+extern void bufpool_thread_exit (void *cache);
+extern void bufpool_free (void);
+
 /* crypto.c */
 #define root_tls_certificates_dir sysconfdir "/pki/" PACKAGE_NAME
 extern void crypto_init (bool tls_set_on_cli);
 extern void crypto_free (void);
 extern int crypto_negotiate_tls (int sockin, int sockout);
+extern bool crypto_pending (void);
+
+/* mux.c */
+extern bool mux_add_connection (void);
+extern void mux_resume (struct connection *conn);
+extern void mux_finish_connection (struct connection *conn);
+extern void mux_stop (void);
+
+/* uring.c */
+struct uring;
+extern int uring_setup (void);
+extern void uring_free (struct connection *conn);
+
+/* metrics.c */
+extern uint64_t metrics_start_request (void);
+extern void metrics_end_request (struct connection *conn, uint16_t cmd,
+                                 uint64_t count, uint32_t error,
+                                 uint64_t start);
+extern void metrics_add_connection (void);
+extern void metrics_remove_connection (struct connection *conn);
+extern void metrics_start (void);
+extern void metrics_stop (void);
+
+/* handle-pool.c */
+extern void handle_pool_start (void);
+extern void handle_pool_stop (void);
+extern struct context *handle_pool_get (const char *exportname);
+
+/* extents.c */
+extern void extents_cache_attach (struct context *c);
+extern void extents_cache_detach (struct context *c);
+extern void extents_cache_free (void);
+extern int extents_cache_lookup (struct context *c,
+                                 uint32_t count, uint64_t offset,
+                                 uint32_t flags,
+                                 struct nbdkit_extents *extents,
+                                 uint64_t *generation);
+extern void extents_cache_insert (struct context *c,
+                                  const struct nbdkit_extents *extents,
+                                  uint64_t generation);
+extern void extents_cache_invalidate (struct context *c,
+                                      uint64_t offset, uint64_t count);
+
+/* scheduler.c */
+extern void scheduler_add_weight (const char *arg);
+extern void scheduler_free (void);
+extern void scheduler_enter (uint16_t cmd, uint64_t count);
+extern void scheduler_leave (void);
 
 /* debug-flags.c */
 extern void add_debug_flag (const char *arg);
@@ -409,6 +644,21 @@ extern int replace_vfprintf (FILE *f, const char *fmt, va_list args)
 #endif
 
 /* backend.c */
+/* Data operations which a filter may leave to the next layer.  See
+ * backend_passthrough.
+ */
+enum {
+  PASSTHROUGH_PREAD   = 1 << 0,
+  PASSTHROUGH_PWRITE  = 1 << 1,
+  PASSTHROUGH_PREADV  = 1 << 2,
+  PASSTHROUGH_PWRITEV = 1 << 3,
+  PASSTHROUGH_FLUSH   = 1 << 4,
+  PASSTHROUGH_TRIM    = 1 << 5,
+  PASSTHROUGH_ZERO    = 1 << 6,
+  PASSTHROUGH_EXTENTS = 1 << 7,
+  PASSTHROUGH_CACHE   = 1 << 8,
+};
+
 struct backend {
   uint64_t magic;               /* Magic number used to validate struct. */
 #define BACKEND_MAGIC 0xbac
@@ -437,6 +687,11 @@ struct backend {
   /* The dlopen handle for the backend. */
   void *dl;
 
+  /* Bitmask of PASSTHROUGH_* data operations which this filter does
+   * not implement at all.  Always 0 for plugins.
+   */
+  unsigned passthrough;
+
   /* Backend callbacks. All are required. */
   void (*free) (struct backend *);
   int (*thread_model) (struct backend *);
@@ -482,6 +737,12 @@ struct backend {
   int (*pwrite) (struct context *,
                  const void *buf, uint32_t count, uint64_t offset,
                  uint32_t flags, int *err);
+  int (*preadv) (struct context *,
+                 const struct nbdkit_iovec *iov, unsigned iovcnt,
+                 uint64_t offset, uint32_t flags, int *err);
+  int (*pwritev) (struct context *,
+                  const struct nbdkit_iovec *iov, unsigned iovcnt,
+                  uint64_t offset, uint32_t flags, int *err);
   int (*flush) (struct context *, uint32_t flags, int *err);
   int (*trim) (struct context *,
                uint32_t count, uint64_t offset, uint32_t flags, int *err);
@@ -492,6 +753,31 @@ struct backend {
                   struct nbdkit_extents *extents, int *err);
   int (*cache) (struct context *,
                 uint32_t count, uint64_t offset, uint32_t flags, int *err);
+
+  /* Asynchronous data callbacks.  These are only provided by plugins
+   * which implement .aio_pread and .aio_pwrite, otherwise NULL.
+   */
+  int (*aio_pread) (struct context *,
+                    void *buf, uint32_t count, uint64_t offset,
+                    uint32_t flags, struct nbdkit_request *req, int *err);
+  int (*aio_pwrite) (struct context *,
+                     const void *buf, uint32_t count, uint64_t offset,
+                     uint32_t flags, struct nbdkit_request *req, int *err);
+
+  /* Zero-copy read.  This is only provided by plugins which
+   * implement .pread_fd, otherwise NULL.
+   */
+  int (*pread_fd) (struct context *,
+                   uint32_t count, uint64_t offset, uint32_t flags,
+                   int *fd, uint64_t *fd_offset, int *err);
+
+  /* Write receiving data directly from the client.  This is only
+   * provided by plugins which implement .pwrite_payload, otherwise
+   * NULL.
+   */
+  int (*pwrite_payload) (struct context *,
+                         uint32_t count, uint64_t offset, uint32_t flags,
+                         struct nbdkit_payload *payload, int *err);
 };
 
 extern void backend_init (struct backend *b, struct backend *next, size_t index,
@@ -523,8 +809,20 @@ extern int backend_finalize (struct context *c)
 extern void backend_close (struct context *c)
   __attribute__ ((__nonnull__ (1)));
 extern bool backend_valid_range (struct context *c,
-                                 uint64_t offset, uint32_t count)
+                                 uint64_t offset, uint64_t count)
   __attribute__ ((__nonnull__ (1)));
+extern struct context *backend_passthrough (struct context *c, unsigned op)
+  __attribute__ ((__nonnull__ (1)));
+extern uint64_t iovec_size (const struct nbdkit_iovec *iov, unsigned iovcnt)
+  __attribute__ ((__nonnull__ (1)));
+extern void iovec_scatter (const struct nbdkit_iovec *iov, unsigned iovcnt,
+                           const void *buf)
+  __attribute__ ((__nonnull__ (1, 3)));
+extern void iovec_gather (void *buf,
+                          const struct nbdkit_iovec *iov, unsigned iovcnt)
+  __attribute__ ((__nonnull__ (1, 2)));
+extern void *iovec_bounce_get (uint32_t count, bool clear);
+extern void iovec_bounce_put (void *buf, uint32_t count);
 
 extern const char *backend_export_description (struct context *c)
   __attribute__ ((__nonnull__ (1)));
@@ -563,6 +861,14 @@ extern int backend_pwrite (struct context *c,
                            const void *buf, uint32_t count, uint64_t offset,
                            uint32_t flags, int *err)
   __attribute__ ((__nonnull__ (1, 2, 6)));
+extern int backend_preadv (struct context *c,
+                           const struct nbdkit_iovec *iov, unsigned iovcnt,
+                           uint64_t offset, uint32_t flags, int *err)
+  __attribute__ ((__nonnull__ (1, 2, 6)));
+extern int backend_pwritev (struct context *c,
+                            const struct nbdkit_iovec *iov, unsigned iovcnt,
+                            uint64_t offset, uint32_t flags, int *err)
+  __attribute__ ((__nonnull__ (1, 2, 6)));
 extern int backend_flush (struct context *c,
                           uint32_t flags, int *err)
   __attribute__ ((__nonnull__ (1, 3)));
@@ -582,6 +888,25 @@ extern int backend_cache (struct context *c,
                           uint32_t count, uint64_t offset,
                           uint32_t flags, int *err)
   __attribute__ ((__nonnull__ (1, 5)));
+extern int backend_aio_pread (struct context *c,
+                              void *buf, uint32_t count, uint64_t offset,
+                              uint32_t flags, struct nbdkit_request *req,
+                              int *err)
+  __attribute__ ((__nonnull__ (1, 2, 6, 7)));
+extern int backend_aio_pwrite (struct context *c,
+                               const void *buf, uint32_t count,
+                               uint64_t offset, uint32_t flags,
+                               struct nbdkit_request *req, int *err)
+  __attribute__ ((__nonnull__ (1, 2, 6, 7)));
+extern int backend_pread_fd (struct context *c,
+                             uint32_t count, uint64_t offset, uint32_t flags,
+                             int *fd, uint64_t *fd_offset, int *err)
+  __attribute__ ((__nonnull__ (1, 5, 6, 7)));
+extern int backend_pwrite_payload (struct context *c,
+                                   uint32_t count, uint64_t offset,
+                                   uint32_t flags,
+                                   struct nbdkit_payload *payload, int *err)
+  __attribute__ ((__nonnull__ (1, 5, 6)));
 
 /* plugins.c */
 typedef struct nbdkit_plugin *(*plugin_init_function) (void);
@@ -619,6 +944,7 @@ extern void accept_incoming_connections (const sockets *socks)
 /* threadlocal.c */
 extern void threadlocal_init (void);
 extern void threadlocal_new_server_thread (void);
+extern bool threadlocal_is_server_thread (void);
 extern void threadlocal_set_name (const char *name)
   __attribute__ ((__nonnull__ (1)));
 extern const char *threadlocal_get_name (void);
@@ -629,9 +955,14 @@ extern int threadlocal_get_errno (void);
 extern void threadlocal_set_last_error (char *msg);
 extern void threadlocal_clear_last_error (void);
 extern const char *threadlocal_get_last_error (void);
-extern void *threadlocal_buffer (size_t size);
 extern void threadlocal_set_conn (struct connection *conn);
 extern struct connection *threadlocal_get_conn (void);
+extern void threadlocal_set_conn_needed (bool needed);
+extern bool threadlocal_get_conn_needed (void);
+extern void threadlocal_set_affinity_group (unsigned g);
+extern unsigned threadlocal_get_affinity_group (void);
+extern void threadlocal_set_bufpool_cache (void *cache);
+extern void *threadlocal_get_bufpool_cache (void);
 extern struct context *threadlocal_get_context (void);
 
 extern struct context *threadlocal_push_context (struct context *ctx);
@@ -96,19 +96,29 @@ static void switch_stdio (void);
 static void winsock_init (void);
 
 int tcpip_sock_af = AF_UNSPEC;  /* -4, -6 */
+unsigned accept_threads;        /* --accept-threads */
+uint64_t buffer_pool_max = 64 * 1024 * 1024; /* --buffer-pool */
+uint64_t coalesce_size;         /* --coalesce */
 struct debug_flag *debug_flags; /* -D */
 bool exit_with_parent;          /* --exit-with-parent */
 const char *export_name;        /* -e */
+bool use_extents_cache;         /* --extents-cache */
 bool foreground;                /* -f */
+unsigned handle_pool;           /* --handle-pool */
+unsigned io_threads;            /* --io-threads */
+bool use_io_uring;              /* --io-uring */
 const char *ipaddr;             /* -i */
 bool keepalive;                 /* --keepalive */
 enum log_to log_to = LOG_TO_DEFAULT; /* --log */
 const char *log_to_file;        /* --log=/path */
 FILE *log_to_fp;                /* --log=/path */
 unsigned mask_handshake = ~0U;  /* --mask-handshake */
+unsigned max_requests;          /* --max-requests */
+char *metrics_file;             /* --metrics */
 bool newstyle = true;           /* false = -o, true = -n */
 bool no_mc;                     /* --no-meta-contexts */
 bool no_sr;                     /* --no-sr */
+bool ordered_replies;           /* --ordered-replies */
 char *pidfile;                  /* -P */
 const char *port;               /* -p */
 bool print_uri;                 /* --print-uri */
@@ -123,6 +133,8 @@ int tls;                        /* --tls : 0=off 1=on 2=require */
 const char *tls_certificates_dir; /* --tls-certificates */
 const char *tls_psk;            /* --tls-psk */
 bool tls_verify_peer;           /* --tls-verify-peer */
+unsigned tls_tickets;          /* --tls-tickets */
+const char *tls_ticket_key;    /* --tls-ticket-key */
 char *unixsocket;               /* -U */
 const char *user, *group;       /* -u & -g */
 bool verbose;                   /* -v */
@@ -214,6 +226,11 @@ dump_config (void)
   printf ("%s=%s\n", "filterdir", filterdir);
   printf ("%s=%s\n", "host_cpu", host_cpu);
   printf ("%s=%s\n", "host_os", host_os);
+#ifdef HAVE_LIBURING
+  printf ("io_uring=yes\n");
+#else
+  printf ("io_uring=no\n");
+#endif
   printf ("%s=%s\n", "libdir", libdir);
   printf ("%s=%s\n", "mandir", mandir);
   printf ("%s=%d\n", "max_api_version", MAX_API_VERSION);
@@ -319,6 +336,46 @@ main (int argc, char *argv[])
       break;
 
     switch (c) {
+    case ACCEPT_THREADS_OPTION:
+#ifndef WIN32
+      if (nbdkit_parse_unsigned ("accept-threads", optarg,
+                                 &accept_threads) == -1)
+        exit (EXIT_FAILURE);
+      break;
+#else
+      fprintf (stderr, "%s: --accept-threads is not supported on Windows\n",
+               program_name);
+      exit (EXIT_FAILURE);
+#endif
+
+    case BUFFER_POOL_OPTION:
+      {
+        int64_t r = nbdkit_parse_size (optarg);
+        if (r == -1)
+          exit (EXIT_FAILURE);
+        buffer_pool_max = r;
+      }
+      break;
+
+    case COALESCE_OPTION:
+      {
+        int64_t r = nbdkit_parse_size (optarg);
+        if (r == -1)
+          exit (EXIT_FAILURE);
+        if (r > MAX_REQUEST_SIZE) {
+          fprintf (stderr, "%s: --coalesce: size must be <= %d\n",
+                   program_name, MAX_REQUEST_SIZE);
+          exit (EXIT_FAILURE);
+        }
+        coalesce_size = r;
+      }
+      break;
+
+    case CPU_AFFINITY_OPTION:
+      if (affinity_parse (optarg) == -1)
+        exit (EXIT_FAILURE);
+      break;
+
     case DUMP_CONFIG_OPTION:
       dump_config ();
       cleanup_random_fifo ();
@@ -342,6 +399,10 @@ main (int argc, char *argv[])
       }
       break;
 
+    case EXTENTS_CACHE_OPTION:
+      use_extents_cache = true;
+      break;
+
     case FILTER_OPTION:
       {
         struct filter_filename *t;
@@ -361,6 +422,20 @@ main (int argc, char *argv[])
       help = true;
       break;
 
+    case HANDLE_POOL_OPTION:
+      if (nbdkit_parse_unsigned ("handle-pool", optarg, &handle_pool) == -1)
+        exit (EXIT_FAILURE);
+      break;
+
+    case IO_THREADS_OPTION:
+      if (nbdkit_parse_unsigned ("io-threads", optarg, &io_threads) == -1)
+        exit (EXIT_FAILURE);
+      break;
+
+    case IO_URING_OPTION:
+      use_io_uring = true;
+      break;
+
     case KEEPALIVE_OPTION:
       keepalive = true;
       break;
@@ -402,6 +477,17 @@ main (int argc, char *argv[])
         exit (EXIT_FAILURE);
       break;
 
+    case MAX_REQUESTS_OPTION:
+      if (nbdkit_parse_unsigned ("max-requests", optarg, &max_requests) == -1)
+        exit (EXIT_FAILURE);
+      break;
+
+    case METRICS_OPTION:
+      metrics_file = nbdkit_absolute_path (optarg);
+      if (metrics_file == NULL)
+        exit (EXIT_FAILURE);
+      break;
+
     case NO_MC_OPTION:
       no_mc = true;
       break;
@@ -410,10 +496,18 @@ main (int argc, char *argv[])
       no_sr = true;
       break;
 
+    case ORDERED_REPLIES_OPTION:
+      ordered_replies = true;
+      break;
+
     case PRINT_URI:
       print_uri = true;
       break;
 
+    case REQUEST_WEIGHT_OPTION:
+      scheduler_add_weight (optarg);
+      break;
+
     case RUN_OPTION:
       if (socket_activation) {
         fprintf (stderr, "%s: cannot use socket activation with --run flag\n",
@@ -477,6 +571,15 @@ main (int argc, char *argv[])
       tls_verify_peer = true;
       break;
 
+    case TLS_TICKETS_OPTION:
+      if (nbdkit_parse_unsigned ("tls-tickets", optarg, &tls_tickets) == -1)
+        exit (EXIT_FAILURE);
+      break;
+
+    case TLS_TICKET_KEY_OPTION:
+      tls_ticket_key = optarg;
+      break;
+
     case VSOCK_OPTION:
 #if defined (AF_VSOCK) && defined (VMADDR_CID_ANY)
       vsock = true;
@@ -644,6 +747,14 @@ main (int argc, char *argv[])
     exit (EXIT_FAILURE);
   }
 
+  /* --tls-ticket-key is only used with --tls-tickets. */
+  if (tls_ticket_key && tls_tickets == 0) {
+    fprintf (stderr,
+             "%s: --tls-ticket-key requires --tls-tickets\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+
   /* Set the umask to a known value.  This makes the behaviour of
    * plugins when creating files more predictable, and also removes an
    * implicit dependency on umask when calling mkstemp(3).
@@ -943,6 +1054,8 @@ main (int argc, char *argv[])
   configured = true;
 
   start_serving ();
+  handle_pool_stop ();
+  metrics_stop ();
 
   top->cleanup (top);
   top->free (top);
@@ -950,9 +1063,14 @@ main (int argc, char *argv[])
 
   free (unixsocket);
   free (pidfile);
+  free (metrics_file);
   free (uri);
 
   cleanup_random_fifo ();
+  bufpool_free ();
+  extents_cache_free ();
+  scheduler_free ();
+  affinity_free ();
   crypto_free ();
   close_quit_pipe ();
 
@@ -1221,6 +1339,8 @@ start_serving (void)
     change_user ();
     write_pidfile ();
     top->after_fork (top);
+    metrics_start ();
+    handle_pool_start ();
     accept_incoming_connections (&socks);
     break;
 
@@ -1229,6 +1349,7 @@ start_serving (void)
     change_user ();
     write_pidfile ();
     top->after_fork (top);
+    metrics_start ();
     threadlocal_new_server_thread ();
     handle_single_connection (saved_stdin, saved_stdout);
     break;
@@ -1252,6 +1373,8 @@ start_serving (void)
     fork_into_background ();
     write_pidfile ();
     top->after_fork (top);
+    metrics_start ();
+    handle_pool_start ();
     accept_incoming_connections (&socks);
     break;
 
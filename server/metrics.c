@@ -0,0 +1,433 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Request metrics (--metrics).
+ *
+ * For each export name the server counts connections and, for each
+ * NBD command, requests, errors and bytes, and keeps a histogram of
+ * request latencies.  Latency is measured from the time the request
+ * header has been read until the reply has been sent.
+ *
+ * Histograms use log-linear buckets in the style of HdrHistogram:
+ * each power of 2 (in microseconds) is split into 8 equal buckets, so
+ * any latency is recorded with a relative error of at most 1/8 while
+ * a histogram needs only a few KB (see common/include/histogram.h).
+ *
+ * A background thread periodically writes everything to the metrics
+ * file in the Prometheus text exposition format, suitable for the
+ * node_exporter textfile collector.  The file is replaced atomically
+ * each time, and written once more when the server exits.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#else
+/* Only used for statistics. */
+#define _Atomic /**/
+#endif
+
+#include "internal.h"
+#include "histogram.h"
+#include "nbd-protocol.h"
+#include "vector.h"
+
+/* How often the metrics file is rewritten. */
+#define METRICS_INTERVAL 10 /* seconds */
+
+/* Plugins may accept any export name, so to bound memory and the size
+ * of the metrics file only this many exports are counted separately.
+ * Connections to any further exports are counted under OTHER_EXPORT.
+ */
+#define MAX_EXPORTS 64
+#define OTHER_EXPORT "other"
+
+/* Commands are indexed by their NBD_CMD_* number. */
+#define NR_COMMANDS (NBD_CMD_BLOCK_STATUS + 1)
+
+static const char *command_names[NR_COMMANDS] = {
+  [NBD_CMD_READ] = "read",
+  [NBD_CMD_WRITE] = "write",
+  [NBD_CMD_FLUSH] = "flush",
+  [NBD_CMD_TRIM] = "trim",
+  [NBD_CMD_CACHE] = "cache",
+  [NBD_CMD_WRITE_ZEROES] = "write_zeroes",
+  [NBD_CMD_BLOCK_STATUS] = "block_status",
+};
+
+struct command_metrics {
+  _Atomic uint64_t requests;
+  _Atomic uint64_t errors;
+  _Atomic uint64_t bytes;
+  _Atomic uint64_t latency_sum;         /* microseconds */
+  _Atomic uint64_t buckets[HISTOGRAM_NR_BUCKETS];
+};
+
+struct export_metrics {
+  char *name;
+  _Atomic uint64_t connections;         /* currently open */
+  _Atomic uint64_t connections_total;
+  struct command_metrics commands[NR_COMMANDS];
+};
+
+DEFINE_VECTOR_TYPE (export_metrics_list, struct export_metrics *);
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static export_metrics_list exports = empty_vector; /* protected by lock */
+static bool stopping;                   /* protected by lock */
+static bool thread_started;
+static pthread_t thread;
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C (1000000000) + ts.tv_nsec;
+}
+
+/* Return the start time to pass to metrics_end_request, or 0 if
+ * metrics are not enabled.
+ */
+uint64_t
+metrics_start_request (void)
+{
+  return metrics_file ? now_ns () : 0;
+}
+
+/* Record a request which has been replied to.  start is the value
+ * returned by metrics_start_request when the request was read.
+ */
+void
+metrics_end_request (struct connection *conn, uint16_t cmd,
+                     uint64_t count, uint32_t error, uint64_t start)
+{
+  struct command_metrics *m;
+  uint64_t us;
+
+  if (!conn->metrics || start == 0 || cmd >= NR_COMMANDS ||
+      command_names[cmd] == NULL)
+    return;
+
+  us = (now_ns () - start) / 1000;
+  m = &conn->metrics->commands[cmd];
+  m->requests++;
+  if (error)
+    m->errors++;
+  else if (cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE)
+    m->bytes += count;
+  m->latency_sum += us;
+  m->buckets[histogram_bucket_of (us)]++;
+}
+
+/* Called when the handshake is complete, to find (or create) the
+ * metrics for the export the client chose.
+ */
+void
+metrics_add_connection (void)
+{
+  GET_CONN;
+  const char *name = conn->top_context->exportname;
+  struct export_metrics *e = NULL;
+  size_t i;
+
+  if (!metrics_file)
+    return;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+ again:
+  for (i = 0; i < exports.len; ++i) {
+    if (strcmp (exports.ptr[i]->name, name) == 0) {
+      e = exports.ptr[i];
+      break;
+    }
+  }
+  if (e == NULL && exports.len >= MAX_EXPORTS &&
+      strcmp (name, OTHER_EXPORT) != 0) {
+    name = OTHER_EXPORT;
+    goto again;
+  }
+  if (e == NULL) {
+    e = calloc (1, sizeof *e);
+    if (e == NULL) {
+      nbdkit_error ("calloc: %m");
+      return;
+    }
+    e->name = strdup (name);
+    if (e->name == NULL || export_metrics_list_append (&exports, e) == -1) {
+      nbdkit_error ("malloc: %m");
+      free (e->name);
+      free (e);
+      return;
+    }
+  }
+  e->connections++;
+  e->connections_total++;
+  conn->metrics = e;
+}
+
+void
+metrics_remove_connection (struct connection *conn)
+{
+  if (conn->metrics)
+    conn->metrics->connections--;
+  conn->metrics = NULL;
+}
+
+/* Print a label value, escaped as Prometheus requires. */
+static void
+print_label (FILE *fp, const char *s)
+{
+  for (; *s; ++s) {
+    switch (*s) {
+    case '\\': fputs ("\\\\", fp); break;
+    case '"': fputs ("\\\"", fp); break;
+    case '\n': fputs ("\\n", fp); break;
+    default: fputc (*s, fp);
+    }
+  }
+}
+
+static void
+print_labels (FILE *fp, const struct export_metrics *e, int cmd)
+{
+  fputs ("{export=\"", fp);
+  print_label (fp, e->name);
+  if (cmd >= 0)
+    fprintf (fp, "\",op=\"%s", command_names[cmd]);
+  fputs ("\"", fp);
+}
+
+static void
+print_counter (FILE *fp, const char *name, const char *help, size_t offset)
+{
+  size_t i;
+  int cmd;
+
+  fprintf (fp, "# HELP %s %s\n", name, help);
+  fprintf (fp, "# TYPE %s counter\n", name);
+  for (i = 0; i < exports.len; ++i) {
+    for (cmd = 0; cmd < NR_COMMANDS; ++cmd) {
+      const struct command_metrics *m = &exports.ptr[i]->commands[cmd];
+
+      if (command_names[cmd] == NULL)
+        continue;
+      fputs (name, fp);
+      print_labels (fp, exports.ptr[i], cmd);
+      fprintf (fp, "} %" PRIu64 "\n",
+               *(const _Atomic uint64_t *) ((const char *) m + offset));
+    }
+  }
+}
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static void
+print_latency (FILE *fp, const struct export_metrics *e, int cmd)
+{
+  const struct command_metrics *m = &e->commands[cmd];
+  uint64_t counts[HISTOGRAM_NR_BUCKETS];
+  uint64_t total = 0, seen, rank;
+  size_t i, q;
+
+  /* Take a copy, so that the quantiles are consistent with count. */
+  for (i = 0; i < HISTOGRAM_NR_BUCKETS; ++i) {
+    counts[i] = m->buckets[i];
+    total += counts[i];
+  }
+
+  for (q = 0, i = 0, seen = 0; q < sizeof quantiles / sizeof quantiles[0];
+       ++q) {
+    rank = quantiles[q] * total;
+    if (rank == 0)
+      rank = 1;
+    while (i < HISTOGRAM_NR_BUCKETS - 1 && seen + counts[i] < rank)
+      seen += counts[i++];
+    fputs ("nbdkit_request_duration_seconds", fp);
+    print_labels (fp, e, cmd);
+    fprintf (fp, ",quantile=\"%g\"} %g\n", quantiles[q],
+             total ? histogram_bucket_upper_bound (i) / 1e6 : 0.);
+  }
+  fputs ("nbdkit_request_duration_seconds_sum", fp);
+  print_labels (fp, e, cmd);
+  fprintf (fp, "} %g\n", m->latency_sum / 1e6);
+  fputs ("nbdkit_request_duration_seconds_count", fp);
+  print_labels (fp, e, cmd);
+  fprintf (fp, "} %" PRIu64 "\n", total);
+}
+
+/* Write the metrics file.  Must be called with lock held. */
+static void
+write_metrics (void)
+{
+  CLEANUP_FREE char *tmpfile = NULL;
+  FILE *fp;
+  size_t i;
+  int cmd;
+
+  if (asprintf (&tmpfile, "%s.tmp", metrics_file) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return;
+  }
+  fp = fopen (tmpfile, "w");
+  if (fp == NULL) {
+    nbdkit_error ("%s: %m", tmpfile);
+    return;
+  }
+
+  fputs ("# HELP nbdkit_connections Number of open connections.\n"
+         "# TYPE nbdkit_connections gauge\n", fp);
+  for (i = 0; i < exports.len; ++i) {
+    fputs ("nbdkit_connections", fp);
+    print_labels (fp, exports.ptr[i], -1);
+    fprintf (fp, "} %" PRIu64 "\n", exports.ptr[i]->connections);
+  }
+  fputs ("# HELP nbdkit_connections_total Number of connections.\n"
+         "# TYPE nbdkit_connections_total counter\n", fp);
+  for (i = 0; i < exports.len; ++i) {
+    fputs ("nbdkit_connections_total", fp);
+    print_labels (fp, exports.ptr[i], -1);
+    fprintf (fp, "} %" PRIu64 "\n", exports.ptr[i]->connections_total);
+  }
+
+  print_counter (fp, "nbdkit_requests_total",
+                 "Number of requests.",
+                 offsetof (struct command_metrics, requests));
+  print_counter (fp, "nbdkit_request_errors_total",
+                 "Number of requests which failed.",
+                 offsetof (struct command_metrics, errors));
+  print_counter (fp, "nbdkit_request_bytes_total",
+                 "Bytes read or written by successful requests.",
+                 offsetof (struct command_metrics, bytes));
+
+  fputs ("# HELP nbdkit_request_duration_seconds "
+         "Time from reading the request to sending the reply.\n"
+         "# TYPE nbdkit_request_duration_seconds summary\n", fp);
+  for (i = 0; i < exports.len; ++i)
+    for (cmd = 0; cmd < NR_COMMANDS; ++cmd)
+      if (command_names[cmd] != NULL)
+        print_latency (fp, exports.ptr[i], cmd);
+
+  if (fclose (fp) == EOF) {
+    nbdkit_error ("%s: %m", tmpfile);
+    unlink (tmpfile);
+    return;
+  }
+  if (rename (tmpfile, metrics_file) == -1) {
+    nbdkit_error ("rename: %s: %m", metrics_file);
+    unlink (tmpfile);
+  }
+}
+
+static void *
+metrics_thread (void *arg)
+{
+  struct timespec deadline;
+
+  threadlocal_new_server_thread ();
+  threadlocal_set_name ("metrics");
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  while (!stopping) {
+    write_metrics ();
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += METRICS_INTERVAL;
+    while (!stopping &&
+           pthread_cond_timedwait (&cond, &lock, &deadline) != ETIMEDOUT)
+      ;
+  }
+  return NULL;
+}
+
+/* Start writing the metrics file.  This must be called after nbdkit
+ * has forked into the background.
+ */
+void
+metrics_start (void)
+{
+  int err;
+
+  if (!metrics_file)
+    return;
+
+  err = pthread_create (&thread, NULL, metrics_thread, NULL);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return;
+  }
+  thread_started = true;
+}
+
+/* Write the final metrics and free them.  Called when the server is
+ * exiting and all connections have been closed.
+ */
+void
+metrics_stop (void)
+{
+  size_t i;
+
+  if (!metrics_file)
+    return;
+
+  if (thread_started) {
+    pthread_mutex_lock (&lock);
+    stopping = true;
+    pthread_cond_signal (&cond);
+    pthread_mutex_unlock (&lock);
+    pthread_join (thread, NULL);
+    thread_started = false;
+  }
+
+  pthread_mutex_lock (&lock);
+  write_metrics ();
+  for (i = 0; i < exports.len; ++i) {
+    free (exports.ptr[i]->name);
+    free (exports.ptr[i]);
+  }
+  export_metrics_list_reset (&exports);
+  pthread_mutex_unlock (&lock);
+}
@@ -0,0 +1,482 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Event-driven connection multiplexing (--io-threads).
+ *
+ * Normally each connection has a thread of its own which reads
+ * requests, and worker threads are started on demand.  With
+ * --io-threads=N, once the handshake is complete the connection
+ * thread instead adds the socket to a shared epoll set and exits.  A
+ * fixed pool of N I/O threads wait on the epoll set.  When a socket
+ * becomes readable, one of them reads whatever has arrived without
+ * waiting, and decoded requests are queued for the connection's
+ * worker threads as in connections.c.  A request which has only
+ * partly arrived is kept in the connection's struct mux_state, and
+ * reading carries on from there next time the socket is readable, so
+ * a slow client never holds an I/O thread.
+ *
+ * Sockets are registered with EPOLLONESHOT, so only one I/O thread
+ * at a time reads from a connection.  The socket is re-armed when
+ * there is nothing more to read, or left disarmed while the queue is
+ * full (mux_stalled) until a worker takes a request and calls
+ * mux_resume.
+ *
+ * The connection is finished when reading has stopped and the last
+ * worker has exited, by whichever of the two happens last.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "internal.h"
+#include "minmax.h"
+#include "protostrings.h"
+#include "vector.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* The request being read from a connection.  Only the I/O thread
+ * which is reading the connection touches this.
+ */
+struct mux_state {
+  union {
+    struct nbd_request compact;
+    struct nbd_request_ext ext;
+  } header;
+  size_t header_len;            /* Bytes of the header read so far. */
+
+  /* The request whose data is being read, or NULL while reading the
+   * header.
+   */
+  struct protocol_request *rq;
+  enum request_data data;       /* REQUEST_DATA_BUF or _SKIP. */
+  uint64_t data_len;            /* Bytes of the data read so far. */
+};
+
+DEFINE_VECTOR_TYPE (connection_list, struct connection *);
+
+static pthread_once_t mux_once = PTHREAD_ONCE_INIT;
+static int epfd = -1;
+
+/* Connections currently served by the I/O threads.  A connection is
+ * removed from the list just before it is finalized, and nr_conns is
+ * decremented afterwards.
+ */
+static pthread_mutex_t mux_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mux_cond = PTHREAD_COND_INITIALIZER;
+static connection_list conns = empty_vector;
+static size_t nr_conns;
+
+static void *mux_thread (void *);
+
+static void
+mux_init (void)
+{
+  pthread_attr_t attrs;
+  pthread_t thread;
+  unsigned i;
+  int err;
+
+  epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epfd == -1) {
+    nbdkit_error ("epoll_create1: %m");
+    return;
+  }
+
+  pthread_attr_init (&attrs);
+  pthread_attr_setdetachstate (&attrs, PTHREAD_CREATE_DETACHED);
+  for (i = 0; i < io_threads; ++i) {
+    err = pthread_create (&thread, &attrs, mux_thread,
+                          (void *) (uintptr_t) (i % affinity_nr_groups ()));
+    if (err != 0) {
+      errno = err;
+      nbdkit_error ("pthread_create: %m");
+      break;
+    }
+  }
+  pthread_attr_destroy (&attrs);
+
+  if (i == 0) {
+    close (epfd);
+    epfd = -1;
+    return;
+  }
+  debug ("started %u I/O threads", i);
+}
+
+/* Wait in epoll until the socket is readable.  If kick is set, also
+ * wait until it is writable, which is almost always true at once.
+ * This is used when data may already be buffered (by GnuTLS), which
+ * epoll would not see.
+ */
+static void
+arm (struct connection *conn, bool kick)
+{
+  struct epoll_event ev = {
+    .events = EPOLLIN | EPOLLONESHOT | (kick ? EPOLLOUT : 0),
+    .data.ptr = conn,
+  };
+
+  if (epoll_ctl (epfd, EPOLL_CTL_MOD, conn->sockin, &ev) == -1) {
+    nbdkit_error ("epoll_ctl: %m");
+    connection_set_status (STATUS_DEAD);
+    shutdown (conn->sockin, SHUT_RD);
+  }
+}
+
+/* Called by a worker (with workers_lock held) after it has taken a
+ * request from the queue of a connection which had stalled.
+ */
+void
+mux_resume (struct connection *conn)
+{
+  arm (conn, true);
+}
+
+/* Queue a request which has been read.  Returns true if the queue is
+ * full, in which case the I/O thread must stop reading.
+ */
+static bool
+dispatch (struct protocol_request *rq)
+{
+  if (rq->action == REQUEST_NONE) {
+    free (rq);
+    return false;
+  }
+  return connection_queue_request (rq);
+}
+
+/* Read from a connection which has become readable, until there is
+ * nothing more to read, the queue is full or the connection is
+ * finished.  Returns true if the connection should be finished.
+ */
+static bool
+serve (struct connection *conn)
+{
+  struct mux_state *m = conn->mux;
+  struct protocol_request *rq;
+  size_t len;
+  ssize_t r;
+  bool shut;
+
+  for (;;) {
+    if (quit || connection_get_status () <= STATUS_CLIENT_DONE)
+      goto done;
+
+    /* Read the request header. */
+    if (m->rq == NULL) {
+      len = conn->extended_headers
+        ? sizeof m->header.ext : sizeof m->header.compact;
+      r = conn->recv_some ((char *) &m->header + m->header_len,
+                           len - m->header_len);
+      if (r == -1 && errno == EAGAIN)
+        break;
+      if (r == -1) {
+        nbdkit_error ("read request: %m");
+        connection_set_status (STATUS_DEAD);
+        goto done;
+      }
+      if (r == 0) {
+        if (m->header_len > 0) {
+          nbdkit_error ("read request: %s", strerror (EBADMSG));
+          connection_set_status (STATUS_DEAD);
+        }
+        else {
+          debug ("client closed input socket, closing connection");
+          connection_set_status (STATUS_CLIENT_DONE);
+        }
+        goto done;
+      }
+      m->header_len += r;
+      if (m->header_len < len)
+        continue;
+      m->header_len = 0;
+
+      rq = malloc (sizeof *rq);
+      if (rq == NULL) {
+        nbdkit_error ("malloc: %m");
+        connection_set_status (STATUS_DEAD);
+        goto done;
+      }
+      shut = protocol_decode_request (rq, &m->header, &m->data);
+      if (shut) {
+        ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+        conn->close (SHUT_WR);
+      }
+      if (m->data == REQUEST_DATA_NONE) {
+        if (dispatch (rq))
+          return false;
+        continue;
+      }
+      assert (m->data == REQUEST_DATA_BUF || m->data == REQUEST_DATA_SKIP);
+      m->rq = rq;
+      m->data_len = 0;
+    }
+
+    /* Read the data following the request. */
+    rq = m->rq;
+    if (m->data == REQUEST_DATA_BUF)
+      r = conn->recv_some (rq->buf + m->data_len, rq->count - m->data_len);
+    else {
+      char buf[BUFSIZ];
+
+      r = conn->recv_some (buf, MIN (sizeof buf, rq->count - m->data_len));
+    }
+    if (r == -1 && errno == EAGAIN)
+      break;
+    if (r == 0) {
+      errno = EBADMSG;
+      r = -1;
+    }
+    if (r == -1) {
+      nbdkit_error ("read data: %s: %m", name_of_nbd_cmd (rq->cmd));
+      /* The connection is broken so no reply can be sent. */
+      m->rq = NULL;
+      rq->action = REQUEST_DROP;
+      connection_set_status (STATUS_DEAD);
+      dispatch (rq);
+      goto done;
+    }
+    m->data_len += r;
+    if (m->data_len == rq->count) {
+      m->rq = NULL;
+      if (dispatch (rq))
+        return false;
+    }
+  }
+
+  /* Nothing more to read for now. */
+  arm (conn, false);
+  return false;
+
+  /* No more requests will be read.  If there are workers, the last
+   * one to exit finishes the connection.
+   */
+ done:
+  assert (m->rq == NULL);
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->workers_lock);
+  conn->reader_done = true;
+  pthread_cond_broadcast (&conn->workers_cond);
+  return conn->workers_running == 0;
+}
+
+/* Remove a connection from the list.  Must be called with mux_lock
+ * held.
+ */
+static void
+remove_connection (struct connection *conn)
+{
+  size_t i;
+
+  for (i = 0; i < conns.len; ++i) {
+    if (conns.ptr[i] == conn) {
+      connection_list_remove (&conns, i);
+      return;
+    }
+  }
+  abort ();
+}
+
+/* Finalize and free a connection.  This is called either by the I/O
+ * thread which stopped reading it, or by its last worker thread.
+ */
+void
+mux_finish_connection (struct connection *conn)
+{
+  if (epoll_ctl (epfd, EPOLL_CTL_DEL, conn->sockin, NULL) == -1)
+    debug ("epoll_ctl: EPOLL_CTL_DEL: %m");
+
+  pthread_mutex_lock (&mux_lock);
+  remove_connection (conn);
+  pthread_mutex_unlock (&mux_lock);
+
+  assert (conn->queue.len == 0);
+  free (conn->mux);
+  conn->mux = NULL;
+  connection_finish (conn);
+
+  pthread_mutex_lock (&mux_lock);
+  nr_conns--;
+  pthread_cond_broadcast (&mux_cond);
+  pthread_mutex_unlock (&mux_lock);
+}
+
+static void *
+mux_thread (void *arg)
+{
+  struct epoll_event ev;
+  struct connection *conn;
+  int r;
+
+  threadlocal_new_server_thread ();
+  threadlocal_set_name (top->plugin_name (top));
+  affinity_bind ((uintptr_t) arg);
+
+  for (;;) {
+    r = epoll_wait (epfd, &ev, 1, -1);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      nbdkit_error ("epoll_wait: %m");
+      return NULL;
+    }
+    if (r == 0)
+      continue;
+
+    conn = ev.data.ptr;
+    threadlocal_set_instance_num (conn->instance_num);
+    threadlocal_set_conn (conn);
+    if (serve (conn))
+      mux_finish_connection (conn);
+    threadlocal_set_conn (NULL);
+    threadlocal_set_instance_num (0);
+  }
+}
+
+/* Hand the current connection over to the I/O threads.  This is
+ * called after the handshake.  Returns false if the connection
+ * thread should carry on serving the connection itself.
+ */
+bool
+mux_add_connection (void)
+{
+  GET_CONN;
+  struct epoll_event ev = {
+    .events = EPOLLIN | EPOLLONESHOT,
+    .data.ptr = conn,
+  };
+
+  if (conn->recv_some == NULL)
+    return false;
+
+  pthread_once (&mux_once, mux_init);
+  if (epfd == -1)
+    return false;
+
+  conn->mux = calloc (1, sizeof *conn->mux);
+  if (conn->mux == NULL) {
+    nbdkit_error ("calloc: %m");
+    return false;
+  }
+  conn->instance_num = threadlocal_get_instance_num ();
+
+  pthread_mutex_lock (&mux_lock);
+  if (connection_list_append (&conns, conn) == -1) {
+    nbdkit_error ("realloc: %m");
+    pthread_mutex_unlock (&mux_lock);
+    goto err;
+  }
+  nr_conns++;
+  pthread_mutex_unlock (&mux_lock);
+
+  /* Data which GnuTLS has already decrypted (possibly during the
+   * handshake) does not show up in epoll.
+   */
+  if (conn->using_tls && crypto_pending ())
+    ev.events |= EPOLLOUT;
+
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, conn->sockin, &ev) == -1) {
+    nbdkit_error ("epoll_ctl: %m");
+    pthread_mutex_lock (&mux_lock);
+    remove_connection (conn);
+    nr_conns--;
+    pthread_mutex_unlock (&mux_lock);
+    goto err;
+  }
+  debug ("handshake complete, connection handed to the I/O threads");
+  return true;
+
+ err:
+  free (conn->mux);
+  conn->mux = NULL;
+  return false;
+}
+
+/* Called when the server is shutting down.  Make every connection's
+ * socket readable, so that the I/O threads notice quit and finish
+ * the connections, and wait until they are all gone.
+ */
+void
+mux_stop (void)
+{
+  size_t i;
+
+  if (epfd == -1)
+    return;
+
+  pthread_mutex_lock (&mux_lock);
+  for (i = 0; i < conns.len; ++i)
+    shutdown (conns.ptr[i]->sockin, SHUT_RD);
+  while (nr_conns > 0)
+    pthread_cond_wait (&mux_cond, &mux_lock);
+  pthread_mutex_unlock (&mux_lock);
+}
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+bool
+mux_add_connection (void)
+{
+  return false;
+}
+
+void
+mux_resume (struct connection *conn)
+{
+  abort ();
+}
+
+void
+mux_finish_connection (struct connection *conn)
+{
+  abort ();
+}
+
+void
+mux_stop (void)
+{
+  /* nothing */
+}
+
+#endif /* !HAVE_SYS_EPOLL_H */
@@ -40,17 +40,29 @@
 
 enum {
   HELP_OPTION = CHAR_MAX + 1,
+  ACCEPT_THREADS_OPTION,
+  BUFFER_POOL_OPTION,
+  COALESCE_OPTION,
+  CPU_AFFINITY_OPTION,
   DUMP_CONFIG_OPTION,
   DUMP_PLUGIN_OPTION,
   EXIT_WITH_PARENT_OPTION,
+  EXTENTS_CACHE_OPTION,
   FILTER_OPTION,
+  HANDLE_POOL_OPTION,
+  IO_THREADS_OPTION,
+  IO_URING_OPTION,
   KEEPALIVE_OPTION,
   LOG_OPTION,
   LONG_OPTIONS_OPTION,
   MASK_HANDSHAKE_OPTION,
+  MAX_REQUESTS_OPTION,
+  METRICS_OPTION,
   NO_MC_OPTION,
   NO_SR_OPTION,
+  ORDERED_REPLIES_OPTION,
   PRINT_URI,
+  REQUEST_WEIGHT_OPTION,
   RUN_OPTION,
   SELINUX_LABEL_OPTION,
   SHORT_OPTIONS_OPTION,
@@ -59,6 +71,8 @@ enum {
   TLS_OPTION,
   TLS_CERTIFICATES_OPTION,
   TLS_PSK_OPTION,
+  TLS_TICKETS_OPTION,
+  TLS_TICKET_KEY_OPTION,
   TLS_VERIFY_PEER_OPTION,
   VSOCK_OPTION,
 };
@@ -67,6 +81,10 @@ static const char *short_options = "46D:e:fg:i:nop:P:rst:u:U:vV";
 static const struct option long_options[] = {
   { "ipv4-only",        no_argument,       NULL, '4' },
   { "ipv6-only",        no_argument,       NULL, '6' },
+  { "accept-threads",   required_argument, NULL, ACCEPT_THREADS_OPTION },
+  { "buffer-pool",      required_argument, NULL, BUFFER_POOL_OPTION },
+  { "coalesce",         required_argument, NULL, COALESCE_OPTION },
+  { "cpu-affinity",     required_argument, NULL, CPU_AFFINITY_OPTION },
   { "debug",            required_argument, NULL, 'D' },
   { "dump-config",      no_argument,       NULL, DUMP_CONFIG_OPTION },
   { "dump-plugin",      no_argument,       NULL, DUMP_PLUGIN_OPTION },
@@ -74,11 +92,15 @@ static const struct option long_options[] = {
   { "export",           required_argument, NULL, 'e' },
   { "export-name",      required_argument, NULL, 'e' },
   { "exportname",       required_argument, NULL, 'e' },
+  { "extents-cache",    no_argument,       NULL, EXTENTS_CACHE_OPTION },
   { "filter",           required_argument, NULL, FILTER_OPTION },
   { "foreground",       no_argument,       NULL, 'f' },
   { "no-fork",          no_argument,       NULL, 'f' },
   { "group",            required_argument, NULL, 'g' },
   { "help",             no_argument,       NULL, HELP_OPTION },
+  { "handle-pool",      required_argument, NULL, HANDLE_POOL_OPTION },
+  { "io-threads",       required_argument, NULL, IO_THREADS_OPTION },
+  { "io-uring",         no_argument,       NULL, IO_URING_OPTION },
   { "ip-addr",          required_argument, NULL, 'i' },
   { "ipaddr",           required_argument, NULL, 'i' },
   { "keepalive",        no_argument,       NULL, KEEPALIVE_OPTION },
@@ -86,6 +108,8 @@ static const struct option long_options[] = {
   { "log",              required_argument, NULL, LOG_OPTION },
   { "long-options",     no_argument,       NULL, LONG_OPTIONS_OPTION },
   { "mask-handshake",   required_argument, NULL, MASK_HANDSHAKE_OPTION },
+  { "max-requests",     required_argument, NULL, MAX_REQUESTS_OPTION },
+  { "metrics",          required_argument, NULL, METRICS_OPTION },
   { "new-style",        no_argument,       NULL, 'n' },
   { "newstyle",         no_argument,       NULL, 'n' },
   { "no-mc",            no_argument,       NULL, NO_MC_OPTION },
@@ -94,6 +118,7 @@ static const struct option long_options[] = {
   { "no-structured-replies", no_argument,  NULL, NO_SR_OPTION },
   { "old-style",        no_argument,       NULL, 'o' },
   { "oldstyle",         no_argument,       NULL, 'o' },
+  { "ordered-replies",  no_argument,       NULL, ORDERED_REPLIES_OPTION },
   { "pid-file",         required_argument, NULL, 'P' },
   { "pidfile",          required_argument, NULL, 'P' },
   { "print-uri",        no_argument,       NULL, PRINT_URI },
@@ -101,6 +126,7 @@ static const struct option long_options[] = {
   { "port",             required_argument, NULL, 'p' },
   { "read-only",        no_argument,       NULL, 'r' },
   { "readonly",         no_argument,       NULL, 'r' },
+  { "request-weight",   required_argument, NULL, REQUEST_WEIGHT_OPTION },
   { "run",              required_argument, NULL, RUN_OPTION },
   { "selinux-label",    required_argument, NULL, SELINUX_LABEL_OPTION },
   { "short-options",    no_argument,       NULL, SHORT_OPTIONS_OPTION },
@@ -115,6 +141,8 @@ static const struct option long_options[] = {
   { "tls",              required_argument, NULL, TLS_OPTION },
   { "tls-certificates", required_argument, NULL, TLS_CERTIFICATES_OPTION },
   { "tls-psk",          required_argument, NULL, TLS_PSK_OPTION },
+  { "tls-tickets",      required_argument, NULL, TLS_TICKETS_OPTION },
+  { "tls-ticket-key",   required_argument, NULL, TLS_TICKET_KEY_OPTION },
   { "tls-verify-peer",  no_argument,       NULL, TLS_VERIFY_PEER_OPTION },
   { "unix",             required_argument, NULL, 'U' },
   { "user",             required_argument, NULL, 'u' },
@@ -193,6 +193,12 @@ plugin_dump_fields (struct backend *b)
   HAS (zero);
   HAS (extents);
   HAS (cache);
+  HAS (aio_pread);
+  HAS (aio_pwrite);
+  HAS (pread_fd);
+  HAS (pwrite_payload);
+  HAS (preadv);
+  HAS (pwritev);
 
   HAS (_pread_v1);
   HAS (_pwrite_v1);
@@ -694,6 +700,83 @@ plugin_pwrite (struct context *c,
   return r;
 }
 
+/* Plugins which don't implement .preadv and .pwritev are given one
+ * flat buffer, which only needs a bounce buffer if there is more
+ * than one buffer in the list.
+ */
+static int
+plugin_preadv (struct context *c,
+               const struct nbdkit_iovec *iov, unsigned iovcnt,
+               uint64_t offset, uint32_t flags, int *err)
+{
+  struct backend *b = c->b;
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  const uint32_t count = iovec_size (iov, iovcnt);
+  void *buf;
+  int r;
+
+  if (p->plugin.preadv) {
+    r = p->plugin.preadv (c->handle, iov, iovcnt, offset, 0);
+    if (r == -1)
+      *err = get_errno (p);
+    return r;
+  }
+
+  if (iovcnt == 1)
+    return plugin_pread (c, iov[0].base, count, offset, flags, err);
+
+  buf = iovec_bounce_get (count, true);
+  if (buf == NULL) {
+    *err = ENOMEM;
+    return -1;
+  }
+  r = plugin_pread (c, buf, count, offset, flags, err);
+  if (r == 0)
+    iovec_scatter (iov, iovcnt, buf);
+  iovec_bounce_put (buf, count);
+  return r;
+}
+
+static int
+plugin_pwritev (struct context *c,
+                const struct nbdkit_iovec *iov, unsigned iovcnt,
+                uint64_t offset, uint32_t flags, int *err)
+{
+  struct backend *b = c->b;
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  const uint32_t count = iovec_size (iov, iovcnt);
+  bool fua = flags & NBDKIT_FLAG_FUA;
+  bool need_flush = false;
+  void *buf;
+  int r;
+
+  if (p->plugin.pwritev) {
+    if (fua && backend_can_fua (c) != NBDKIT_FUA_NATIVE) {
+      flags &= ~NBDKIT_FLAG_FUA;
+      need_flush = true;
+    }
+    r = p->plugin.pwritev (c->handle, iov, iovcnt, offset, flags);
+    if (r != -1 && need_flush)
+      r = plugin_flush (c, 0, err);
+    if (r == -1 && !*err)
+      *err = get_errno (p);
+    return r;
+  }
+
+  if (iovcnt == 1)
+    return plugin_pwrite (c, iov[0].base, count, offset, flags, err);
+
+  buf = iovec_bounce_get (count, false);
+  if (buf == NULL) {
+    *err = ENOMEM;
+    return -1;
+  }
+  iovec_gather (buf, iov, iovcnt);
+  r = plugin_pwrite (c, buf, count, offset, flags, err);
+  iovec_bounce_put (buf, count);
+  return r;
+}
+
 static int
 plugin_trim (struct context *c,
              uint32_t count, uint64_t offset, uint32_t flags, int *err)
@@ -839,6 +922,74 @@ plugin_cache (struct context *c,
   return r;
 }
 
+static int
+plugin_aio_pread (struct context *c,
+                  void *buf, uint32_t count, uint64_t offset, uint32_t flags,
+                  struct nbdkit_request *req, int *err)
+{
+  struct backend *b = c->b;
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  int r;
+
+  assert (p->plugin.aio_pread);
+
+  r = p->plugin.aio_pread (c->handle, buf, count, offset, flags, req);
+  if (r == -1)
+    *err = get_errno (p);
+  return r;
+}
+
+static int
+plugin_aio_pwrite (struct context *c,
+                   const void *buf, uint32_t count, uint64_t offset,
+                   uint32_t flags, struct nbdkit_request *req, int *err)
+{
+  struct backend *b = c->b;
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  int r;
+
+  assert (p->plugin.aio_pwrite);
+
+  r = p->plugin.aio_pwrite (c->handle, buf, count, offset, flags, req);
+  if (r == -1)
+    *err = get_errno (p);
+  return r;
+}
+
+static int
+plugin_pread_fd (struct context *c,
+                 uint32_t count, uint64_t offset, uint32_t flags,
+                 int *fd, uint64_t *fd_offset, int *err)
+{
+  struct backend *b = c->b;
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  int r;
+
+  assert (p->plugin.pread_fd);
+
+  r = p->plugin.pread_fd (c->handle, count, offset, flags, fd, fd_offset);
+  if (r == -1)
+    *err = get_errno (p);
+  return r;
+}
+
+static int
+plugin_pwrite_payload (struct context *c,
+                       uint32_t count, uint64_t offset, uint32_t flags,
+                       struct nbdkit_payload *payload, int *err)
+{
+  struct backend *b = c->b;
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  int r;
+
+  assert (p->plugin.pwrite_payload);
+
+  r = p->plugin.pwrite_payload (c->handle, count, offset, flags, payload);
+  if (r == -1)
+    *err = get_errno (p);
+  return r;
+}
+
 static struct backend plugin_functions = {
   .free = plugin_free,
   .thread_model = plugin_thread_model,
@@ -874,11 +1025,17 @@ static struct backend plugin_functions = {
   .can_cache = plugin_can_cache,
   .pread = plugin_pread,
   .pwrite = plugin_pwrite,
+  .preadv = plugin_preadv,
+  .pwritev = plugin_pwritev,
   .flush = plugin_flush,
   .trim = plugin_trim,
   .zero = plugin_zero,
   .extents = plugin_extents,
   .cache = plugin_cache,
+  .aio_pread = plugin_aio_pread,
+  .aio_pwrite = plugin_aio_pwrite,
+  .pread_fd = plugin_pread_fd,
+  .pwrite_payload = plugin_pwrite_payload,
 };
 
 /* Register and load a plugin. */
@@ -948,6 +1105,27 @@ plugin_register (size_t index, const char *filename,
     exit (EXIT_FAILURE);
   }
 
+  /* The asynchronous callbacks are optional, and the server checks
+   * for them in the backend struct to decide whether to use them.
+   * They are only supported by API version 2 plugins.
+   */
+  if (p->plugin._api_version < 2 || p->plugin.aio_pread == NULL)
+    p->backend.aio_pread = NULL;
+  if (p->plugin._api_version < 2 || p->plugin.aio_pwrite == NULL)
+    p->backend.aio_pwrite = NULL;
+  if (p->plugin._api_version < 2 || p->plugin.pread_fd == NULL)
+    p->backend.pread_fd = NULL;
+  if (p->plugin._api_version < 2 || p->plugin.pwrite_payload == NULL)
+    p->backend.pwrite_payload = NULL;
+
+  /* Plugins without .preadv and .pwritev fall back to .pread and
+   * .pwrite, see plugin_preadv and plugin_pwritev.
+   */
+  if (p->plugin._api_version < 2) {
+    p->plugin.preadv = NULL;
+    p->plugin.pwritev = NULL;
+  }
+
   backend_load (&p->backend, p->plugin.name, p->plugin.load);
 
   return (struct backend *) p;
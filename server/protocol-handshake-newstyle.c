@@ -304,11 +304,13 @@ conn_recv_full (void *buf, size_t len, const char *fmt, ...)
 
 /* Sub-function of negotiate_handshake_newstyle_options below.  It
  * must be called on all non-error paths out of the options for-loop
- * in that function, and must not cause any wire traffic.
+ * in that function, and must not cause any wire traffic.  probe is
+ * set for NBD_OPT_INFO (see protocol_common_open).
  */
 static int
 finish_newstyle_options (uint64_t *exportsize,
-                         const char *exportname_in, uint32_t exportnamelen)
+                         const char *exportname_in, uint32_t exportnamelen,
+                         bool probe)
 {
   GET_CONN;
 
@@ -335,7 +337,8 @@ finish_newstyle_options (uint64_t *exportsize,
     conn->meta_context_base_allocation = false;
   }
 
-  if (protocol_common_open (exportsize, &conn->eflags, exportname) == -1)
+  if (protocol_common_open (exportsize, &conn->eflags, exportname,
+                            probe) == -1)
     return -1;
 
   debug ("newstyle negotiation: flags: export 0x%x", conn->eflags);
@@ -467,7 +470,7 @@ negotiate_handshake_newstyle_options (void)
       /* We have to finish the handshake by sending handshake_finish.
        * On failure, we have to disconnect.
        */
-      if (finish_newstyle_options (&exportsize, data, optlen) == -1)
+      if (finish_newstyle_options (&exportsize, data, optlen, false) == -1)
         return -1;
 
       memset (&handshake_finish, 0, sizeof handshake_finish);
@@ -563,6 +566,7 @@ negotiate_handshake_newstyle_options (void)
         debug ("using TLS on this connection");
         /* Wipe out any cached state. */
         conn->structured_replies = false;
+        conn->extended_headers = false;
         free (conn->exportname_from_set_meta_context);
         conn->exportname_from_set_meta_context = NULL;
         conn->meta_context_base_allocation = false;
@@ -636,7 +640,8 @@ negotiate_handshake_newstyle_options (void)
          * disconnecting.
          */
         if (finish_newstyle_options (&exportsize,
-                                     &data[4], exportnamelen) == -1) {
+                                     &data[4], exportnamelen,
+                                     option == NBD_OPT_INFO) == -1) {
           if (conn->top_context) {
             if (backend_finalize (conn->top_context) == -1)
               return -1;
@@ -777,6 +782,15 @@ negotiate_handshake_newstyle_options (void)
         break;
       }
 
+      if (conn->extended_headers) {
+        if (send_newstyle_option_reply (option, NBD_REP_ERR_EXT_HEADER_REQD)
+            == -1)
+          return -1;
+        debug ("newstyle negotiation: %s: extended headers already in use",
+               name_of_nbd_opt (option));
+        break;
+      }
+
       if (conn->structured_replies) {
         if (send_newstyle_option_reply (option, NBD_REP_ERR_INVALID) == -1)
           return -1;
@@ -791,6 +805,48 @@ negotiate_handshake_newstyle_options (void)
       conn->structured_replies = true;
       break;
 
+    case NBD_OPT_EXTENDED_HEADERS:
+      if (optlen != 0) {
+        debug ("ignoring request, client sent unexpected payload: %s",
+               name_of_nbd_opt (option));
+        if (send_newstyle_option_reply (option, NBD_REP_ERR_INVALID)
+            == -1)
+          return -1;
+        if (conn_recv_full (data, optlen,
+                            "read: %s: %m", name_of_nbd_opt (option)) == -1)
+          return -1;
+        continue;
+      }
+
+      debug ("newstyle negotiation: %s: client requested extended headers",
+             name_of_nbd_opt (option));
+
+      /* Extended headers imply structured replies, so --no-sr
+       * disables them too.
+       */
+      if (no_sr) {
+        if (send_newstyle_option_reply (option, NBD_REP_ERR_UNSUP) == -1)
+          return -1;
+        debug ("newstyle negotiation: %s: extended headers are disabled",
+               name_of_nbd_opt (option));
+        break;
+      }
+
+      if (conn->extended_headers) {
+        if (send_newstyle_option_reply (option, NBD_REP_ERR_INVALID) == -1)
+          return -1;
+        debug ("newstyle negotiation: %s: extended headers already in use",
+               name_of_nbd_opt (option));
+        break;
+      }
+
+      if (send_newstyle_option_reply (option, NBD_REP_ACK) == -1)
+        return -1;
+
+      conn->extended_headers = true;
+      conn->structured_replies = true;
+      break;
+
     case NBD_OPT_LIST_META_CONTEXT:
     case NBD_OPT_SET_META_CONTEXT:
       {
@@ -70,17 +70,23 @@ protocol_handshake (void)
  * The protocols must defer this as late as possible so that
  * unauthorized clients can't cause unnecessary work in .open by
  * simply opening a TCP connection.
+ *
+ * probe is set for NBD_OPT_INFO, where the context is closed again
+ * straight away, so it is not worth taking one from the handle pool.
  */
 int
 protocol_common_open (uint64_t *exportsize, uint16_t *flags,
-                      const char *exportname)
+                      const char *exportname, bool probe)
 {
   GET_CONN;
   int64_t size;
   uint16_t eflags = NBD_FLAG_HAS_FLAGS;
   int fl;
 
-  conn->top_context = backend_open (top, read_only, exportname, false);
+  if (!probe)
+    conn->top_context = handle_pool_get (exportname);
+  if (conn->top_context == NULL)
+    conn->top_context = backend_open (top, read_only, exportname, false);
   if (conn->top_context == NULL)
     return -1;
 
@@ -163,6 +169,7 @@ protocol_common_open (uint64_t *exportsize, uint16_t *flags,
   fl = backend_can_extents (conn->top_context);
   if (fl == -1)
     return -1;
+  extents_cache_attach (conn->top_context);
 
   if (conn->structured_replies)
     eflags |= NBD_FLAG_SEND_DF;
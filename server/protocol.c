@@ -44,12 +44,27 @@
 
 #include "internal.h"
 #include "byte-swapping.h"
+#include "iszero.h"
 #include "minmax.h"
 #include "nbd-protocol.h"
 #include "protostrings.h"
+#include "utils.h"
+
+/* Backend requests are limited to 32 bits, but with extended headers
+ * the client may send trim, zero, cache and block status requests
+ * larger than that.  These are split into chunks of at most this
+ * size, which keeps each chunk aligned to any minimum block size
+ * (which cannot exceed 64K).
+ */
+#define MAX_CHUNK_SIZE (UINT32_MAX & ~0xffff)
+
+/* Runs of zeroes in read replies are only sent as holes in aligned
+ * units of this size (see send_structured_reply_read).
+ */
+#define READ_HOLE_GRANULE 4096
 
 static bool
-validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
+validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint64_t count,
                   uint32_t *error)
 {
   GET_CONN;
@@ -75,7 +90,7 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
     if (!backend_valid_range (conn->top_context, offset, count)) {
       /* XXX Allow writes to extend the disk? */
       nbdkit_error ("invalid request: %s: offset and count are out of range: "
-                    "offset=%" PRIu64 " count=%" PRIu32,
+                    "offset=%" PRIu64 " count=%" PRIu64,
                     name_of_nbd_cmd (cmd), offset, count);
       *error = (cmd == NBD_CMD_WRITE ||
                 cmd == NBD_CMD_WRITE_ZEROES) ? ENOSPC : EINVAL;
@@ -102,11 +117,18 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
   /* Validate flags */
   if (flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE |
                 NBD_CMD_FLAG_DF | NBD_CMD_FLAG_REQ_ONE |
-                NBD_CMD_FLAG_FAST_ZERO)) {
+                NBD_CMD_FLAG_FAST_ZERO |
+                (conn->extended_headers ? NBD_CMD_FLAG_PAYLOAD_LEN : 0))) {
     nbdkit_error ("invalid request: unknown flag (0x%x)", flags);
     *error = EINVAL;
     return false;
   }
+  if ((flags & NBD_CMD_FLAG_PAYLOAD_LEN) &&
+      cmd != NBD_CMD_WRITE) {
+    nbdkit_error ("invalid request: PAYLOAD_LEN flag needs WRITE request");
+    *error = EINVAL;
+    return false;
+  }
   if ((flags & NBD_CMD_FLAG_NO_HOLE) &&
       cmd != NBD_CMD_WRITE_ZEROES) {
     nbdkit_error ("invalid request: NO_HOLE flag needs WRITE_ZEROES request");
@@ -149,7 +171,7 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
   /* Refuse over-large read and write requests. */
   if ((cmd == NBD_CMD_WRITE || cmd == NBD_CMD_READ) &&
       count > MAX_REQUEST_SIZE) {
-    nbdkit_error ("invalid request: %s: data request is too large (%" PRIu32
+    nbdkit_error ("invalid request: %s: data request is too large (%" PRIu64
                   " > %d)",
                   name_of_nbd_cmd (cmd), count, MAX_REQUEST_SIZE);
     *error = ENOMEM;
@@ -210,6 +232,79 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
   return true;                     /* Command validates. */
 }
 
+/* Call a backend function which takes a 32 bit count, splitting the
+ * request into chunks if necessary.
+ */
+typedef int (*backend_range_function) (struct context *c,
+                                       uint32_t count, uint64_t offset,
+                                       uint32_t flags, int *err);
+
+static int
+split_request (backend_range_function fn, struct context *c,
+               uint64_t count, uint64_t offset, uint32_t flags, int *err)
+{
+  while (count > 0) {
+    const uint32_t n = MIN (count, MAX_CHUNK_SIZE);
+
+    if (fn (c, n, offset, flags, err) == -1)
+      return -1;
+    count -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+/* Get block status.  If the client asked about more than we can pass
+ * to the backend in a single call, then as long as the backend
+ * answered for the whole of each chunk, carry on asking about the
+ * next chunk.  This lets a client map a large disk in a single round
+ * trip.
+ */
+static int
+block_status (struct context *c, uint64_t count, uint64_t offset,
+              uint32_t flags, struct nbdkit_extents *extents, int *err)
+{
+  const uint64_t end = offset + count;
+  uint32_t n = MIN (count, MAX_CHUNK_SIZE);
+  uint64_t pos = offset + n;
+
+  if (backend_extents (c, n, offset, flags, extents, err) == -1)
+    return -1;
+
+  while (!(flags & NBDKIT_FLAG_REQ_ONE)) {
+    const struct nbdkit_extent last =
+      nbdkit_get_extent (extents, nbdkit_extents_count (extents) - 1);
+    const uint64_t covered = last.offset + last.length;
+    CLEANUP_EXTENTS_FREE struct nbdkit_extents *t = NULL;
+    size_t i;
+
+    if (covered < pos || covered >= end)
+      break;
+
+    n = MIN (end - covered, MAX_CHUNK_SIZE);
+    pos = covered + n;
+    t = nbdkit_extents_new (covered, backend_get_size (c));
+    if (t == NULL) {
+      *err = errno;
+      return -1;
+    }
+    /* We already have a valid answer, so just return that if this
+     * fails.
+     */
+    if (backend_extents (c, n, covered, flags, t, err) == -1)
+      break;
+    for (i = 0; i < nbdkit_extents_count (t); ++i) {
+      const struct nbdkit_extent e = nbdkit_get_extent (t, i);
+
+      if (nbdkit_add_extent (extents, e.offset, e.length, e.type) == -1) {
+        *err = errno;
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
 /* This is called with the request lock held to actually execute the
  * request (by calling the plugin).  Note that the request fields have
  * been validated already in 'validate_request' so we don't have to
@@ -226,7 +321,7 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
  * for success).
  */
 static uint32_t
-handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
+handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint64_t count,
                 void *buf, struct nbdkit_extents *extents)
 {
   GET_CONN;
@@ -265,12 +360,12 @@ handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
   case NBD_CMD_TRIM:
     if (flags & NBD_CMD_FLAG_FUA)
       f |= NBDKIT_FLAG_FUA;
-    if (backend_trim (c, count, offset, f, &err) == -1)
+    if (split_request (backend_trim, c, count, offset, f, &err) == -1)
       return err;
     break;
 
   case NBD_CMD_CACHE:
-    if (backend_cache (c, count, offset, 0, &err) == -1)
+    if (split_request (backend_cache, c, count, offset, 0, &err) == -1)
       return err;
     break;
 
@@ -281,15 +376,14 @@ handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
       f |= NBDKIT_FLAG_FUA;
     if (flags & NBD_CMD_FLAG_FAST_ZERO)
       f |= NBDKIT_FLAG_FAST_ZERO;
-    if (backend_zero (c, count, offset, f, &err) == -1)
+    if (split_request (backend_zero, c, count, offset, f, &err) == -1)
       return err;
     break;
 
   case NBD_CMD_BLOCK_STATUS:
     if (flags & NBD_CMD_FLAG_REQ_ONE)
       f |= NBDKIT_FLAG_REQ_ONE;
-    if (backend_extents (c, count, offset, f,
-                         extents, &err) == -1)
+    if (block_status (c, count, offset, f, extents, &err) == -1)
       return err;
     break;
 
@@ -300,19 +394,105 @@ handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
   return 0;
 }
 
+/* Can this read be served from a file descriptor supplied by the
+ * plugin's .pread_fd callback?  Only plugins (not filters) implement
+ * it, and the connection must be able to send directly from a file.
+ */
+static bool
+can_use_pread_fd (uint16_t cmd)
+{
+  GET_CONN;
+
+  return cmd == NBD_CMD_READ &&
+    conn->sendfile != NULL &&
+    conn->top_context->b->pread_fd != NULL;
+}
+
+/* Does [offset, offset+count) of the file contain a hole?  If the
+ * file descriptor cannot be queried then assume it is all data.
+ */
+static bool
+fd_range_is_sparse (int fd, uint64_t offset, uint32_t count)
+{
+#ifdef SEEK_HOLE
+  off_t pos;
+
+  if (count == 0)
+    return false;
+  pos = lseek (fd, offset, SEEK_HOLE);
+  return pos >= 0 && (uint64_t) pos < offset + count;
+#else
+  return false;
+#endif
+}
+
+/* This is called instead of handle_request for reads when
+ * can_use_pread_fd is true.  If the plugin returns a file descriptor
+ * then *fd and *fd_offset are set, otherwise the data is read into
+ * the per-thread buffer (*buf) in the usual way.
+ *
+ * Data sent with sendfile is never seen by the server, so when the
+ * reply could contain holes and the range is sparse the data is read
+ * from the file descriptor instead, letting send_structured_reply_read
+ * find the zeroes.
+ */
+static uint32_t
+handle_read_fd (uint64_t offset, uint32_t count,
+                char **buf, int *fd, uint64_t *fd_offset)
+{
+  GET_CONN;
+  struct context *c = conn->top_context;
+  int err = 0;
+
+  threadlocal_set_errno (0);
+  threadlocal_clear_last_error ();
+
+  if (backend_pread_fd (c, count, offset, 0, fd, fd_offset, &err) == -1)
+    return err;
+  if (*fd >= 0) {
+    if ((!conn->structured_replies && !conn->extended_headers) ||
+        !fd_range_is_sparse (*fd, *fd_offset, count))
+      return 0;
+
+    *buf = bufpool_get (count, false);
+    if (*buf == NULL)
+      return ENOMEM;
+    if (full_pread (*fd, *buf, count, *fd_offset) == -1) {
+      err = errno;
+      nbdkit_error ("pread: %m");
+      *fd = -1;
+      return err;
+    }
+    *fd = -1;
+    return 0;
+  }
+
+  /* The plugin declined, so fall back to .pread. */
+  *buf = bufpool_get (count, true);
+  if (*buf == NULL)
+    return ENOMEM;
+  return handle_request (NBD_CMD_READ, 0, offset, count, *buf, NULL);
+}
+
 static int
-skip_over_write_buffer (int sock, size_t count)
+skip_over_write_buffer (uint64_t count)
 {
+  GET_CONN;
   char buf[BUFSIZ];
-  ssize_t r;
+  size_t n;
+  int r;
 
   if (count > MAX_REQUEST_SIZE * 2) {
     nbdkit_error ("write request too large to skip");
     return -1;
   }
 
+  /* This must go through conn->recv, which may be TLS or may have
+   * read ahead.
+   */
   while (count > 0) {
-    r = read (sock, buf, count > BUFSIZ ? BUFSIZ : count);
+    n = count > BUFSIZ ? BUFSIZ : count;
+    r = conn->recv (buf, n);
     if (r == -1) {
       nbdkit_error ("skipping write buffer: %m");
       return -1;
@@ -322,11 +502,130 @@ skip_over_write_buffer (int sock, size_t count)
       errno = EBADMSG;
       return -1;
     }
-    count -= r;
+    count -= n;
+  }
+  return 0;
+}
+
+/* The data for a write which is being received by the plugin's
+ * .pwrite_payload callback.
+ */
+struct nbdkit_payload {
+  uint64_t magic;
+#define PAYLOAD_MAGIC 0xa11
+  uint32_t remaining;           /* Bytes not yet received */
+  bool failed;                  /* Set if the connection failed */
+};
+
+/* Can this write be received directly by the plugin?  This is only
+ * possible when there are no filters.  Because the plugin is called
+ * while the read lock is held, the request lock must not be needed,
+ * which means the parallel thread model.  The I/O threads
+ * (--io-threads) never block reading from the client, so they don't
+ * use this either.
+ */
+static bool
+can_use_pwrite_payload (uint16_t cmd, uint16_t flags)
+{
+  GET_CONN;
+  struct context *c = conn->top_context;
+
+  return cmd == NBD_CMD_WRITE &&
+    thread_model >= NBDKIT_THREAD_MODEL_PARALLEL &&
+    !conn->mux &&
+    c->b->pwrite_payload != NULL &&
+    (!(flags & NBD_CMD_FLAG_FUA) || c->can_fua == NBDKIT_FUA_NATIVE);
+}
+
+NBDKIT_DLL_PUBLIC int
+nbdkit_payload_recv (struct nbdkit_payload *payload, void *buf,
+                     uint32_t count)
+{
+  GET_CONN;
+  int r;
+
+  assert (payload != NULL);
+  assert (payload->magic == PAYLOAD_MAGIC);
+
+  if (payload->failed) {
+    nbdkit_error ("nbdkit_payload_recv: connection has failed");
+    errno = EIO;
+    return -1;
+  }
+  if (count > payload->remaining) {
+    nbdkit_error ("nbdkit_payload_recv: count (%" PRIu32 ") is larger "
+                  "than the remaining data (%" PRIu32 ")",
+                  count, payload->remaining);
+    errno = EINVAL;
+    return -1;
+  }
+
+  r = conn->recv (buf, count);
+  if (r == 0) {
+    errno = EBADMSG;
+    r = -1;
+  }
+  if (r == -1) {
+    nbdkit_error ("read data: %s: %m", name_of_nbd_cmd (NBD_CMD_WRITE));
+    payload->failed = true;
+    return -1;
   }
+  payload->remaining -= count;
   return 0;
 }
 
+/* This is called with the read lock held instead of receiving the
+ * data and calling handle_request, for writes where
+ * can_use_pwrite_payload is true.  The return value is the errno to
+ * send to the client.  If the connection failed then *failed is set.
+ *
+ * The write counts against --max-requests like any other, so the
+ * reader may wait here for a slot before the plugin is called.
+ */
+static uint32_t
+handle_write_payload (uint16_t flags, uint64_t offset, uint32_t count,
+                      bool *failed)
+{
+  GET_CONN;
+  struct context *c = conn->top_context;
+  struct nbdkit_payload payload = {
+    .magic = PAYLOAD_MAGIC, .remaining = count,
+  };
+  uint32_t f = 0;
+  int err = 0, r;
+
+  threadlocal_set_errno (0);
+  threadlocal_clear_last_error ();
+
+  if (flags & NBD_CMD_FLAG_FUA)
+    f |= NBDKIT_FLAG_FUA;
+  scheduler_enter (NBD_CMD_WRITE, count);
+  lock_request ();
+  r = backend_pwrite_payload (c, count, offset, f, &payload, &err);
+  unlock_request ();
+  scheduler_leave ();
+  payload.magic = 0;
+
+  *failed = payload.failed;
+  if (payload.failed)
+    return EIO;
+
+  /* Discard any data that the plugin did not receive. */
+  if (payload.remaining > 0) {
+    if (skip_over_write_buffer (payload.remaining) == -1) {
+      *failed = true;
+      return EIO;
+    }
+    if (r == 0) {
+      nbdkit_error ("%s: pwrite_payload did not receive all of the data",
+                    c->b->name);
+      return EIO;
+    }
+  }
+
+  return r == -1 ? err : 0;
+}
+
 /* Convert a system errno to an NBD_E* error code. */
 static int
 nbd_errno (int error, uint16_t flags)
@@ -376,70 +675,232 @@ send_simple_reply (uint64_t cookie, uint16_t cmd, uint16_t flags,
   GET_CONN;
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
   struct nbd_simple_reply reply;
+  struct iovec iov[2];
   int r;
-  int f = (cmd == NBD_CMD_READ && !error) ? SEND_MORE : 0;
 
   reply.magic = htobe32 (NBD_SIMPLE_REPLY_MAGIC);
   reply.cookie = cookie;
   reply.error = htobe32 (nbd_errno (error, flags));
 
-  r = conn->send (&reply, sizeof reply, f);
+  /* The reply header and any read data are sent together. */
+  iov[0].iov_base = &reply;
+  iov[0].iov_len = sizeof reply;
+  iov[1].iov_base = (void *) buf;
+  iov[1].iov_len = cmd == NBD_CMD_READ && !error ? count : 0;
+
+  r = conn->sendv (iov, 2, 0);
   if (r == -1) {
     nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
     return connection_set_status (STATUS_DEAD);
   }
+  return false;
+}
 
-  /* Send the read data buffer. */
-  if (cmd == NBD_CMD_READ && !error) {
-    r = conn->send (buf, count, 0);
-    if (r == -1) {
-      nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
-      return connection_set_status (STATUS_DEAD);
-    }
+/* Space for the header of a structured reply chunk, which is larger
+ * if extended headers were negotiated.
+ */
+union chunk_header {
+  struct nbd_structured_reply compact;
+  struct nbd_extended_reply ext;
+};
+
+/* Fill in the header of a structured reply chunk, returning the iovec
+ * which covers it.  If extended headers were negotiated then every
+ * reply uses the extended header, which also echoes the offset from
+ * the client's request.
+ */
+static struct iovec
+chunk_header (union chunk_header *h, uint64_t cookie,
+              uint16_t flags, uint16_t type,
+              uint64_t offset, uint64_t length)
+{
+  GET_CONN;
+  struct iovec iov = { .iov_base = h };
+
+  if (conn->extended_headers) {
+    h->ext.magic = htobe32 (NBD_EXTENDED_REPLY_MAGIC);
+    h->ext.cookie = cookie;
+    h->ext.flags = htobe16 (flags);
+    h->ext.type = htobe16 (type);
+    h->ext.offset = htobe64 (offset);
+    h->ext.length = htobe64 (length);
+    iov.iov_len = sizeof h->ext;
+  }
+  else {
+    assert (length <= UINT32_MAX);
+    h->compact.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
+    h->compact.cookie = cookie;
+    h->compact.flags = htobe16 (flags);
+    h->compact.type = htobe16 (type);
+    h->compact.length = htobe32 (length);
+    iov.iov_len = sizeof h->compact;
+  }
+  return iov;
+}
+
+/* Send a single NBD_REPLY_TYPE_OFFSET_DATA or NBD_REPLY_TYPE_OFFSET_HOLE
+ * chunk covering [offset, offset+count) of a read reply.
+ */
+static int
+send_read_chunk (uint64_t cookie, uint16_t flags, bool hole,
+                 const char *buf, uint32_t count, uint64_t offset,
+                 uint64_t req_offset, int send_flags)
+{
+  GET_CONN;
+  union chunk_header h;
+  struct iovec iov[3];
+
+  if (hole) {
+    struct nbd_chunk_offset_hole offset_hole;
+
+    iov[0] = chunk_header (&h, cookie, flags, NBD_REPLY_TYPE_OFFSET_HOLE,
+                           req_offset, sizeof offset_hole);
+    offset_hole.offset = htobe64 (offset);
+    offset_hole.length = htobe32 (count);
+    iov[1].iov_base = &offset_hole;
+    iov[1].iov_len = sizeof offset_hole;
+    return conn->sendv (iov, 2, send_flags);
+  }
+  else {
+    struct nbd_chunk_offset_data offset_data;
+
+    iov[0] = chunk_header (&h, cookie, flags, NBD_REPLY_TYPE_OFFSET_DATA,
+                           req_offset,
+                           (uint64_t) count + sizeof offset_data);
+    offset_data.offset = htobe64 (offset);
+    iov[1].iov_base = &offset_data;
+    iov[1].iov_len = sizeof offset_data;
+    iov[2].iov_base = (void *) buf;
+    iov[2].iov_len = count;
+    return conn->sendv (iov, 3, send_flags);
   }
-  return false;
 }
 
+/* Send a read reply, replacing runs of zeroes in the buffer with
+ * NBD_REPLY_TYPE_OFFSET_HOLE chunks.  The buffer is examined in
+ * granules aligned to the export offset so that a reply never
+ * fragments into holes smaller than READ_HOLE_GRANULE (except at the
+ * ends of the request).  If the client set NBD_CMD_FLAG_DF then the
+ * reply must be a single chunk, which can still be a hole if the
+ * whole buffer is zero.
+ */
 static bool
-send_structured_reply_read (uint64_t cookie, uint16_t cmd,
+send_structured_reply_read (uint64_t cookie, uint16_t cmd, uint16_t flags,
                             const char *buf, uint32_t count, uint64_t offset)
 {
   GET_CONN;
-  /* Once we are really using structured replies and sending data back
-   * in chunks, we'll be able to grab the write lock for each chunk,
-   * allowing other threads to interleave replies.  As we're not doing
-   * that yet we acquire the lock for the whole function.
+  /* Other threads must not interleave replies between our chunks, so
+   * the lock is held for the whole function.
    */
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
-  struct nbd_structured_reply reply;
-  struct nbd_chunk_offset_data offset_data;
+  const bool df = flags & NBD_CMD_FLAG_DF;
+  uint32_t pos, end, n;
+  bool hole;
   int r;
 
   assert (cmd == NBD_CMD_READ);
 
-  reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
-  reply.cookie = cookie;
-  reply.flags = htobe16 (NBD_REPLY_FLAG_DONE);
-  reply.type = htobe16 (NBD_REPLY_TYPE_OFFSET_DATA);
-  reply.length = htobe32 (count + sizeof offset_data);
+  /* A zero length read still needs a (data) chunk. */
+  pos = 0;
+  do {
+    /* The first granule runs up to the next aligned boundary. */
+    if (df)
+      n = count;
+    else
+      n = MIN (count - pos,
+               READ_HOLE_GRANULE - ((offset + pos) & (READ_HOLE_GRANULE-1)));
+    hole = n > 0 && is_zero (&buf[pos], n);
+    end = pos + n;
+
+    /* Extend the run while following granules are of the same kind. */
+    while (end < count) {
+      n = MIN (count - end, READ_HOLE_GRANULE);
+      if (is_zero (&buf[end], n) != hole)
+        break;
+      end += n;
+    }
 
-  r = conn->send (&reply, sizeof reply, SEND_MORE);
-  if (r == -1) {
-    nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
-    return connection_set_status (STATUS_DEAD);
+    r = send_read_chunk (cookie, end == count ? NBD_REPLY_FLAG_DONE : 0,
+                         hole, &buf[pos], end - pos, offset + pos, offset,
+                         end == count ? 0 : SEND_MORE);
+    if (r == -1) {
+      nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
+      return connection_set_status (STATUS_DEAD);
+    }
+    pos = end;
+  } while (pos < count);
+
+  return false;
+}
+
+/* Send a successful read reply where the data is sent straight from
+ * a file descriptor returned by .pread_fd, using conn->sendfile.  The
+ * reply is always a single data chunk (or a simple reply).  Sparse
+ * ranges don't come here, see handle_read_fd.
+ */
+static bool
+send_reply_fd (uint64_t cookie, uint16_t flags,
+               uint64_t offset, uint32_t count,
+               int fd, uint64_t fd_offset)
+{
+  GET_CONN;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+  struct nbd_simple_reply reply;
+  union chunk_header h;
+  struct nbd_chunk_offset_data offset_data;
+  struct iovec iov[2];
+  int iovcnt, r;
+
+  if (connection_get_status () < STATUS_CLIENT_DONE)
+    return false;
+
+  if (!conn->extended_headers && !conn->structured_replies) {
+    reply.magic = htobe32 (NBD_SIMPLE_REPLY_MAGIC);
+    reply.cookie = cookie;
+    reply.error = htobe32 (NBD_SUCCESS);
+    iov[0].iov_base = &reply;
+    iov[0].iov_len = sizeof reply;
+    iovcnt = 1;
+  }
+  else {
+    iov[0] = chunk_header (&h, cookie, NBD_REPLY_FLAG_DONE,
+                           NBD_REPLY_TYPE_OFFSET_DATA, offset,
+                           (uint64_t) count + sizeof offset_data);
+    offset_data.offset = htobe64 (offset);
+    iov[1].iov_base = &offset_data;
+    iov[1].iov_len = sizeof offset_data;
+    iovcnt = 2;
   }
 
-  /* Send the offset + read data buffer. */
-  offset_data.offset = htobe64 (offset);
-  r = conn->send (&offset_data, sizeof offset_data, SEND_MORE);
+  r = conn->sendv (iov, iovcnt, SEND_MORE);
+  if (r == 0)
+    r = conn->sendfile (fd, fd_offset, count);
   if (r == -1) {
-    nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
+    nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (NBD_CMD_READ));
     return connection_set_status (STATUS_DEAD);
   }
+  return false;
+}
+
+/* With extended headers, commands which don't return data still get
+ * a structured reply with no payload.
+ */
+static bool
+send_structured_reply_done (uint64_t cookie, uint16_t cmd, uint64_t offset)
+{
+  GET_CONN;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+  union chunk_header h;
+  struct iovec iov;
+  int r;
 
-  r = conn->send (buf, count, 0);
+  assert (conn->extended_headers);
+
+  iov = chunk_header (&h, cookie, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE,
+                      offset, 0);
+  r = conn->sendv (&iov, 1, 0);
   if (r == -1) {
-    nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
+    nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
     return connection_set_status (STATUS_DEAD);
   }
   return false;
@@ -533,235 +994,881 @@ extents_to_block_descriptors (struct nbdkit_extents *extents,
   return blocks;
 }
 
+/* Convert a list of extents into NBD_REPLY_TYPE_BLOCK_STATUS_EXT
+ * blocks, used when extended headers were negotiated.  This is
+ * simpler than the 32 bit case above since extents never have to be
+ * split.
+ */
+static struct nbd_block_descriptor_64 *
+extents_to_block_descriptors_64 (struct nbdkit_extents *extents,
+                                 uint16_t flags,
+                                 uint64_t count, uint64_t offset,
+                                 size_t *nr_blocks)
+{
+  const bool req_one = flags & NBD_CMD_FLAG_REQ_ONE;
+  const size_t nr_extents = nbdkit_extents_count (extents);
+  uint64_t pos = offset;
+  size_t i;
+  struct nbd_block_descriptor_64 *blocks;
+
+  /* This is checked in server/plugins.c. */
+  assert (nr_extents >= 1);
+
+  blocks = calloc (req_one ? 1 : nr_extents,
+                   sizeof (struct nbd_block_descriptor_64));
+  if (blocks == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
+  *nr_blocks = 0;
+  for (i = 0; i < nr_extents; ++i) {
+    const struct nbdkit_extent e = nbdkit_get_extent (extents, i);
+
+    if (i == 0)
+      assert (e.offset == offset);
+
+    /* With REQ_ONE we must not exceed count of the original request. */
+    blocks[i].length = htobe64 (req_one ? MIN (e.length, count) : e.length);
+    blocks[i].status_flags = htobe64 (e.type & 3);
+    (*nr_blocks)++;
+
+    pos += e.length;
+    if (req_one || pos >= offset + count)
+      break;
+  }
+
+  return blocks;
+}
+
 static bool
 send_structured_reply_block_status (uint64_t cookie,
                                     uint16_t cmd, uint16_t flags,
-                                    uint32_t count, uint64_t offset,
+                                    uint64_t count, uint64_t offset,
                                     struct nbdkit_extents *extents)
 {
   GET_CONN;
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
-  struct nbd_structured_reply reply;
   CLEANUP_FREE struct nbd_block_descriptor_32 *blocks = NULL;
+  union chunk_header h;
+  struct iovec iov[3];
   size_t nr_blocks;
   uint32_t context_id;
-  size_t i;
   int r;
 
   assert (conn->meta_context_base_allocation);
   assert (cmd == NBD_CMD_BLOCK_STATUS);
+  assert (!conn->extended_headers);
 
   blocks = extents_to_block_descriptors (extents, flags, count, offset,
                                          &nr_blocks);
   if (blocks == NULL)
     return connection_set_status (STATUS_DEAD);
 
-  reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
-  reply.cookie = cookie;
-  reply.flags = htobe16 (NBD_REPLY_FLAG_DONE);
-  reply.type = htobe16 (NBD_REPLY_TYPE_BLOCK_STATUS);
-  reply.length = htobe32 (sizeof context_id +
-                          nr_blocks * sizeof (struct nbd_block_descriptor_32));
+  /* Send the header, the base:allocation context ID and all the
+   * block descriptors together.
+   */
+  iov[0] = chunk_header (&h, cookie, NBD_REPLY_FLAG_DONE,
+                         NBD_REPLY_TYPE_BLOCK_STATUS, offset,
+                         sizeof context_id + nr_blocks * sizeof blocks[0]);
+  context_id = htobe32 (base_allocation_id);
+  iov[1].iov_base = &context_id;
+  iov[1].iov_len = sizeof context_id;
+  iov[2].iov_base = blocks;
+  iov[2].iov_len = nr_blocks * sizeof blocks[0];
 
-  r = conn->send (&reply, sizeof reply, SEND_MORE);
+  r = conn->sendv (iov, 3, 0);
   if (r == -1) {
     nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
     return connection_set_status (STATUS_DEAD);
   }
+  return false;
+}
 
-  /* Send the base:allocation context ID. */
-  context_id = htobe32 (base_allocation_id);
-  r = conn->send (&context_id, sizeof context_id, SEND_MORE);
+static bool
+send_structured_reply_block_status_64 (uint64_t cookie,
+                                       uint16_t cmd, uint16_t flags,
+                                       uint64_t count, uint64_t offset,
+                                       struct nbdkit_extents *extents)
+{
+  GET_CONN;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+  CLEANUP_FREE struct nbd_block_descriptor_64 *blocks = NULL;
+  struct nbd_chunk_block_status_64 chunk;
+  union chunk_header h;
+  struct iovec iov[3];
+  size_t nr_blocks;
+  int r;
+
+  assert (conn->meta_context_base_allocation);
+  assert (cmd == NBD_CMD_BLOCK_STATUS);
+  assert (conn->extended_headers);
+
+  blocks = extents_to_block_descriptors_64 (extents, flags, count, offset,
+                                            &nr_blocks);
+  if (blocks == NULL)
+    return connection_set_status (STATUS_DEAD);
+
+  /* Send the header, the base:allocation context ID and number of
+   * descriptors, and the block descriptors together.
+   */
+  iov[0] = chunk_header (&h, cookie, NBD_REPLY_FLAG_DONE,
+                         NBD_REPLY_TYPE_BLOCK_STATUS_EXT, offset,
+                         sizeof chunk + nr_blocks * sizeof blocks[0]);
+  chunk.context_id = htobe32 (base_allocation_id);
+  chunk.count = htobe32 (nr_blocks);
+  iov[1].iov_base = &chunk;
+  iov[1].iov_len = sizeof chunk;
+  iov[2].iov_base = blocks;
+  iov[2].iov_len = nr_blocks * sizeof blocks[0];
+
+  r = conn->sendv (iov, 3, 0);
   if (r == -1) {
     nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
     return connection_set_status (STATUS_DEAD);
   }
-
-  /* Send each block descriptor. */
-  for (i = 0; i < nr_blocks; ++i) {
-    r = conn->send (&blocks[i], sizeof blocks[i],
-                    i == nr_blocks - 1 ? 0 : SEND_MORE);
-    if (r == -1) {
-      nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
-      return connection_set_status (STATUS_DEAD);
-    }
-  }
   return false;
 }
 
 static bool
 send_structured_reply_error (uint64_t cookie, uint16_t cmd, uint16_t flags,
-                             uint32_t error)
+                             uint64_t offset, uint32_t error)
 {
   GET_CONN;
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
-  struct nbd_structured_reply reply;
   struct nbd_chunk_error error_data;
+  union chunk_header h;
+  struct iovec iov[2];
   int r;
 
-  reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
-  reply.cookie = cookie;
-  reply.flags = htobe16 (NBD_REPLY_FLAG_DONE);
-  reply.type = htobe16 (NBD_REPLY_TYPE_ERROR);
-  reply.length = htobe32 (0 /* no human readable error */ + sizeof error_data);
-
-  r = conn->send (&reply, sizeof reply, SEND_MORE);
-  if (r == -1) {
-    nbdkit_error ("write error reply: %m");
-    return connection_set_status (STATUS_DEAD);
-  }
-
-  /* Send the error. */
+  iov[0] = chunk_header (&h, cookie, NBD_REPLY_FLAG_DONE,
+                         NBD_REPLY_TYPE_ERROR, offset,
+                         0 /* no human readable error */ + sizeof error_data);
   error_data.error = htobe32 (nbd_errno (error, flags));
   error_data.len = htobe16 (0);
-  r = conn->send (&error_data, sizeof error_data, 0);
+  iov[1].iov_base = &error_data;
+  iov[1].iov_len = sizeof error_data;
+
+  r = conn->sendv (iov, 2, 0);
   if (r == -1) {
-    nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
+    nbdkit_error ("write error reply: %s: %m", name_of_nbd_cmd (cmd));
     return connection_set_status (STATUS_DEAD);
   }
   /* No human readable error message at the moment. */
   return false;
 }
 
-/* Do a recv/send sequence. Return true if the caller should shutdown. */
-bool
-protocol_recv_request_send_reply (void)
+/* With --ordered-replies, wait until all earlier requests have been
+ * replied to.  Each call must be paired with a call to
+ * end_ordered_reply, even if no reply is sent.
+ */
+static void
+begin_ordered_reply (uint64_t seq)
 {
   GET_CONN;
-  int r;
-  conn_status cs;
-  struct nbd_request request;
-  uint16_t cmd, flags;
-  uint32_t magic, count, error = 0;
+
+  if (!ordered_replies)
+    return;
+
+  pthread_mutex_lock (&conn->reply_lock);
+  while (conn->next_reply != seq)
+    pthread_cond_wait (&conn->reply_cond, &conn->reply_lock);
+  pthread_mutex_unlock (&conn->reply_lock);
+}
+
+static void
+end_ordered_reply (uint64_t seq)
+{
+  GET_CONN;
+
+  if (!ordered_replies)
+    return;
+
+  pthread_mutex_lock (&conn->reply_lock);
+  assert (conn->next_reply == seq);
+  conn->next_reply++;
+  pthread_cond_broadcast (&conn->reply_cond);
+  pthread_mutex_unlock (&conn->reply_lock);
+}
+
+/* Send the reply to a request.  Return true if the caller should
+ * shutdown.
+ */
+static bool
+send_reply (uint64_t cookie, uint16_t cmd, uint16_t flags,
+            uint64_t offset, uint64_t count,
+            const char *buf, struct nbdkit_extents *extents,
+            uint32_t error)
+{
+  GET_CONN;
+
+  if (connection_get_status () < STATUS_CLIENT_DONE)
+    return false;
+
+  if (error != 0) {
+    /* Since we're about to send only the limited NBD_E* errno to the
+     * client, don't lose the information about what really happened
+     * on the server side.  Make sure there is a way for the operator
+     * to retrieve the real error.
+     */
+    debug ("sending error reply: %s", strerror (error));
+  }
+
+  /* Currently we prefer to send simple replies for everything except
+   * where we have to (ie. NBD_CMD_READ and NBD_CMD_BLOCK_STATUS when
+   * structured_replies have been negotiated).  However this prevents
+   * us from sending human-readable error messages to the client, so
+   * we should reconsider this in future.  Simple replies cannot be
+   * used at all once extended headers have been negotiated.
+   */
+  if (!conn->extended_headers &&
+      (!conn->structured_replies ||
+       (cmd != NBD_CMD_READ && cmd != NBD_CMD_BLOCK_STATUS)))
+    return send_simple_reply (cookie, cmd, flags, buf, count, error);
+
+  if (error)
+    return send_structured_reply_error (cookie, cmd, flags, offset, error);
+
+  switch (cmd) {
+  case NBD_CMD_READ:
+    return send_structured_reply_read (cookie, cmd, flags, buf, count, offset);
+
+  case NBD_CMD_BLOCK_STATUS:
+    if (conn->extended_headers)
+      return send_structured_reply_block_status_64 (cookie, cmd, flags,
+                                                    count, offset, extents);
+    return send_structured_reply_block_status (cookie, cmd, flags,
+                                               count, offset, extents);
+
+  default:
+    return send_structured_reply_done (cookie, cmd, offset);
+  }
+}
+
+/* A read or write request which has been handed to the plugin's
+ * .aio_pread or .aio_pwrite callback, and is waiting for the plugin
+ * to call nbdkit_request_complete.  Unlike synchronous requests, the
+ * data buffer is allocated per request since the worker thread goes
+ * on to handle other requests in the meantime.
+ */
+struct nbdkit_request {
+  uint64_t magic;
+#define REQUEST_MAGIC 0xa10
+  struct connection *conn;
+  uint64_t cookie;
+  uint16_t cmd;
+  uint16_t flags;
+  uint32_t count;
   uint64_t offset;
-  char *buf = NULL;
-  CLEANUP_EXTENTS_FREE struct nbdkit_extents *extents = NULL;
+  char *buf;
+  uint64_t start;               /* See metrics_start_request. */
+};
+
+/* Can this request be handed to the plugin asynchronously?  Only
+ * plugins (not filters) can implement the asynchronous callbacks, so
+ * this is only possible when there are no filters.  We also need
+ * worker threads, which implies the parallel thread model.
+ */
+static bool
+can_use_aio (uint16_t cmd, uint16_t flags)
+{
+  GET_CONN;
+  struct context *c = conn->top_context;
 
-  /* Read the request packet. */
-  {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->read_lock);
-    r = conn->recv (&request, sizeof request);
-    cs = connection_get_status ();
-    if (cs <= STATUS_CLIENT_DONE)
-      return false;
-    if (r == -1) {
-      nbdkit_error ("read request: %m");
-      return connection_set_status (STATUS_DEAD);
-    }
-    if (r == 0) {
-      debug ("client closed input socket, closing connection");
-      return connection_set_status (STATUS_CLIENT_DONE); /* disconnect */
-    }
+  /* The plugin may complete requests in any order, so this cannot be
+   * used when replies must be ordered.
+   */
+  if (conn->nworkers == 0 || ordered_replies)
+    return false;
 
-    magic = be32toh (request.magic);
-    if (magic != NBD_REQUEST_MAGIC) {
-      nbdkit_error ("invalid request: 'magic' field is incorrect (0x%x)",
-                    magic);
-      return connection_set_status (STATUS_DEAD);
-    }
+  switch (cmd) {
+  case NBD_CMD_READ:
+    return c->b->aio_pread != NULL;
+  case NBD_CMD_WRITE:
+    /* If FUA has to be emulated by the server then use the
+     * synchronous path which knows how to do that.
+     */
+    return c->b->aio_pwrite != NULL &&
+      (!(flags & NBD_CMD_FLAG_FUA) || c->can_fua == NBDKIT_FUA_NATIVE);
+  default:
+    return false;
+  }
+}
 
-    flags = be16toh (request.flags);
-    cmd = be16toh (request.type);
+static struct nbdkit_request *
+new_aio_request (uint64_t cookie, uint16_t cmd, uint16_t flags,
+                 uint64_t offset, uint32_t count)
+{
+  GET_CONN;
+  struct nbdkit_request *req;
 
-    offset = be64toh (request.offset);
-    count = be32toh (request.count);
+  req = malloc (sizeof *req);
+  if (req == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+  /* Read buffers are cleared so we cannot leak data to the client if
+   * the plugin fails to fill the whole buffer.
+   */
+  req->buf = bufpool_get (count, cmd == NBD_CMD_READ);
+  if (req->buf == NULL) {
+    free (req);
+    return NULL;
+  }
+  req->magic = REQUEST_MAGIC;
+  req->conn = conn;
+  req->cookie = cookie;
+  req->cmd = cmd;
+  req->flags = flags;
+  req->offset = offset;
+  req->count = count;
+  return req;
+}
 
-    if (cmd == NBD_CMD_DISC) {
-      debug ("client sent %s, closing connection", name_of_nbd_cmd (cmd));
-      return connection_set_status (STATUS_CLIENT_DONE); /* disconnect */
-    }
+static void
+free_aio_request (struct nbdkit_request *req)
+{
+  req->magic = 0;
+  bufpool_put (req->buf, req->count);
+  free (req);
+}
+
+/* Hand the request to the plugin.  On return the request may already
+ * have been completed and freed.  Returns -1 (setting *err) if the
+ * plugin failed the request synchronously, in which case the caller
+ * still owns req.
+ */
+static int
+submit_aio_request (struct nbdkit_request *req, int *err)
+{
+  struct connection *conn = req->conn;
+  struct context *c = conn->top_context;
+  uint32_t f = 0;
+  int r;
+
+  threadlocal_set_errno (0);
+  threadlocal_clear_last_error ();
+
+  pthread_mutex_lock (&conn->aio_lock);
+  conn->aio_requests++;
+  pthread_mutex_unlock (&conn->aio_lock);
+
+  lock_request ();
+  if (req->cmd == NBD_CMD_READ)
+    r = backend_aio_pread (c, req->buf, req->count, req->offset, 0,
+                           req, err);
+  else {
+    if (req->flags & NBD_CMD_FLAG_FUA)
+      f |= NBDKIT_FLAG_FUA;
+    r = backend_aio_pwrite (c, req->buf, req->count, req->offset, f,
+                            req, err);
+  }
+  unlock_request ();
+
+  if (r == -1) {
+    pthread_mutex_lock (&conn->aio_lock);
+    if (--conn->aio_requests == 0)
+      pthread_cond_broadcast (&conn->aio_cond);
+    pthread_mutex_unlock (&conn->aio_lock);
+  }
+  return r;
+}
+
+/* Called by the plugin, possibly from a thread that nbdkit did not
+ * create, to complete a request started by .aio_pread or .aio_pwrite.
+ * This sends the reply to the client and releases the request.
+ */
+NBDKIT_DLL_PUBLIC void
+nbdkit_request_complete (struct nbdkit_request *req, int err)
+{
+  struct connection *conn, *saved_conn;
+
+  assert (req != NULL);
+  assert (req->magic == REQUEST_MAGIC);
+  conn = req->conn;
+
+  /* The reply functions need to find the connection in thread-local
+   * storage.  Plugin threads won't have any, so create it on first
+   * use (it is freed when the thread exits).  A server thread may be
+   * completing a request that belongs to another connection, so
+   * save and restore the current connection.
+   */
+  if (!threadlocal_is_server_thread ())
+    threadlocal_new_server_thread ();
+  saved_conn = threadlocal_get_conn ();
+  threadlocal_set_conn (conn);
+
+  if (err < 0)
+    err = EIO;
+
+  /* The write has now happened, so the extents cache must forget the
+   * range before the client can see the reply.
+   */
+  if (req->cmd == NBD_CMD_WRITE && conn->top_context->extents_cache)
+    extents_cache_invalidate (conn->top_context, req->offset, req->count);
+
+  if (send_reply (req->cookie, req->cmd, req->flags, req->offset,
+                  req->count, req->buf, NULL, err)) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+    conn->close (SHUT_WR);
+  }
+  DTRACE_PROBE4 (nbdkit, request_reply, conn, req->cookie, req->cmd, err);
+  metrics_end_request (conn, req->cmd, req->count, err, req->start);
+  free_aio_request (req);
+  scheduler_leave ();
+
+  threadlocal_set_conn (saved_conn);
+
+  /* This must be last, since the connection may be freed as soon as
+   * the count drops to zero.
+   */
+  pthread_mutex_lock (&conn->aio_lock);
+  if (--conn->aio_requests == 0)
+    pthread_cond_broadcast (&conn->aio_cond);
+  pthread_mutex_unlock (&conn->aio_lock);
+}
+
+/* Wait until the plugin has completed all asynchronous requests on
+ * this connection.  Called before the connection is closed.
+ */
+void
+protocol_wait_for_aio_requests (void)
+{
+  GET_CONN;
+
+  pthread_mutex_lock (&conn->aio_lock);
+  while (conn->aio_requests > 0) {
+    debug ("waiting for %u asynchronous request(s) to complete",
+           conn->aio_requests);
+    pthread_cond_wait (&conn->aio_cond, &conn->aio_lock);
+  }
+  pthread_mutex_unlock (&conn->aio_lock);
+}
 
-    /* Validate the request. */
-    if (!validate_request (cmd, flags, offset, count, &error)) {
-      if (cmd == NBD_CMD_WRITE &&
-          skip_over_write_buffer (conn->sockin, count) < 0) {
-        return connection_set_status (STATUS_DEAD);
+/* Decode a request header which has been read from the client into
+ * *rq, and get ready to receive any data following it.  *data says
+ * what must be done with the data (rq->count bytes).  If the request
+ * should not be performed, rq->action is set to REQUEST_NONE (nothing
+ * to reply to, for example because the client disconnected) or to
+ * REQUEST_REPLY (an error reply, after skipping the data).  Return
+ * true if the caller should shutdown.
+ *
+ * Requests are decoded in the order they are read, by one thread at
+ * a time.
+ */
+bool
+protocol_decode_request (struct protocol_request *rq, const void *header,
+                         enum request_data *data)
+{
+  GET_CONN;
+  const struct nbd_request *compact = header;
+  const struct nbd_request_ext *ext = header;
+  uint32_t magic, expected_magic;
+  bool payload;
+
+  memset (rq, 0, sizeof *rq);
+  rq->action = REQUEST_NONE;
+  *data = REQUEST_DATA_NONE;
+
+  /* The two request formats share all fields except count. */
+  magic = be32toh (compact->magic);
+  expected_magic = conn->extended_headers
+    ? NBD_EXTENDED_REQUEST_MAGIC : NBD_REQUEST_MAGIC;
+  if (magic != expected_magic) {
+    nbdkit_error ("invalid request: 'magic' field is incorrect (0x%x)",
+                  magic);
+    return connection_set_status (STATUS_DEAD);
+  }
+
+  rq->start = metrics_start_request ();
+  rq->flags = be16toh (compact->flags);
+  rq->cmd = be16toh (compact->type);
+  rq->cookie = compact->cookie;
+  rq->offset = be64toh (compact->offset);
+  if (conn->extended_headers)
+    rq->count = be64toh (ext->count);
+  else
+    rq->count = be32toh (compact->count);
+
+  /* Is there data following the request?  With extended headers,
+   * PAYLOAD_LEN means count is the payload length for commands other
+   * than write, which we reject below but must still skip over.
+   */
+  payload = rq->count > 0 &&
+    (rq->cmd == NBD_CMD_WRITE ||
+     (conn->extended_headers && (rq->flags & NBD_CMD_FLAG_PAYLOAD_LEN)));
+
+  DTRACE_PROBE6 (nbdkit, request_receive, conn, rq->cookie, rq->cmd,
+                 rq->flags, rq->offset, rq->count);
+
+  if (rq->cmd == NBD_CMD_DISC) {
+    debug ("client sent %s, closing connection", name_of_nbd_cmd (rq->cmd));
+    return connection_set_status (STATUS_CLIENT_DONE); /* disconnect */
+  }
+
+  /* Every request from here on must pass through send_reply or
+   * drop_reply so that ordered replies are retired in sequence.
+   */
+  rq->seq = conn->next_request++;
+
+  /* Validate the request. */
+  if (!validate_request (rq->cmd, rq->flags, rq->offset, rq->count,
+                         &rq->error))
+    goto skip_payload;
+
+  /* Get the data buffer used for either read or write requests.
+   * For asynchronous requests this is allocated per request.
+   * Reads which may be served from a file descriptor and writes
+   * received directly by the plugin don't need a buffer here.
+   * Otherwise the buffer is borrowed from the pool and returned
+   * after the reply has been sent.
+   */
+  if (rq->cmd == NBD_CMD_READ || rq->cmd == NBD_CMD_WRITE) {
+    if (can_use_aio (rq->cmd, rq->flags)) {
+      rq->aio = new_aio_request (rq->cookie, rq->cmd, rq->flags,
+                                 rq->offset, rq->count);
+      if (rq->aio) {
+        rq->aio->start = rq->start;
+        rq->buf = rq->aio->buf;
       }
-      goto send_reply;
     }
+    else if (can_use_pread_fd (rq->cmd))
+      rq->use_fd = true;
+    else if (can_use_pwrite_payload (rq->cmd, rq->flags))
+      *data = REQUEST_DATA_PAYLOAD;
+    else
+      rq->buf = bufpool_get (rq->count, rq->cmd == NBD_CMD_READ);
+    if (rq->buf == NULL && !rq->use_fd && *data != REQUEST_DATA_PAYLOAD) {
+      rq->error = ENOMEM;
+      goto skip_payload;
+    }
+  }
 
-    /* Get the data buffer used for either read or write requests.
-     * This is a common per-thread data buffer, it must not be freed.
-     */
-    if (cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE) {
-      buf = threadlocal_buffer ((size_t) count);
-      if (buf == NULL) {
-        error = ENOMEM;
-        if (cmd == NBD_CMD_WRITE &&
-            skip_over_write_buffer (conn->sockin, count) < 0) {
-          return connection_set_status (STATUS_DEAD);
-        }
-        goto send_reply;
-      }
+  /* Allocate the extents list for block status only. */
+  if (rq->cmd == NBD_CMD_BLOCK_STATUS) {
+    rq->extents = nbdkit_extents_new (rq->offset,
+                                      backend_get_size (conn->top_context));
+    if (rq->extents == NULL) {
+      rq->error = ENOMEM;
+      goto reply;
     }
+  }
 
-    /* Allocate the extents list for block status only. */
-    if (cmd == NBD_CMD_BLOCK_STATUS) {
-      extents = nbdkit_extents_new (offset,
-                                    backend_get_size (conn->top_context));
-      if (extents == NULL) {
-        error = ENOMEM;
-        goto send_reply;
-      }
+  if (*data == REQUEST_DATA_PAYLOAD) {
+    if (quit || connection_get_status () < STATUS_ACTIVE) {
+      rq->error = ESHUTDOWN;
+      goto skip_payload;
+    }
+    rq->action = REQUEST_REPLY;
+    return false;
+  }
+
+  if (rq->cmd == NBD_CMD_WRITE)
+    *data = REQUEST_DATA_BUF;
+  rq->action = REQUEST_PERFORM;
+  return false;
+
+ skip_payload:
+  if (payload) {
+    if (rq->count > MAX_REQUEST_SIZE * 2) {
+      nbdkit_error ("write request too large to skip");
+      rq->action = REQUEST_DROP;
+      return connection_set_status (STATUS_DEAD);
     }
+    *data = REQUEST_DATA_SKIP;
+  }
+ reply:
+  rq->action = REQUEST_REPLY;
+  return false;
+}
+
+/* Read the next request, and any data following it, from the client
+ * into *rq.  If nothing was read because the client disconnected or
+ * the connection failed, rq->action is set to REQUEST_NONE.  Otherwise
+ * rq must be passed to protocol_process_request.  Return true if the
+ * caller should shutdown.
+ */
+bool
+protocol_recv_request (struct protocol_request *rq)
+{
+  GET_CONN;
+  int r;
+  union {
+    struct nbd_request compact;
+    struct nbd_request_ext ext;
+  } request;
+  enum request_data data;
+  bool failed;
+
+  memset (rq, 0, sizeof *rq);
+  rq->action = REQUEST_NONE;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->read_lock);
+
+  /* Read the request packet. */
+  r = conn->recv (&request,
+                  conn->extended_headers
+                  ? sizeof request.ext : sizeof request.compact);
+  if (connection_get_status () <= STATUS_CLIENT_DONE)
+    return false;
+  if (r == -1) {
+    nbdkit_error ("read request: %m");
+    return connection_set_status (STATUS_DEAD);
+  }
+  if (r == 0) {
+    debug ("client closed input socket, closing connection");
+    return connection_set_status (STATUS_CLIENT_DONE); /* disconnect */
+  }
+
+  if (protocol_decode_request (rq, &request, &data))
+    return true;
+
+  switch (data) {
+  case REQUEST_DATA_NONE:
+    break;
+
+  case REQUEST_DATA_SKIP:
+    if (skip_over_write_buffer (rq->count) < 0)
+      goto drop;
+    break;
+
+    /* Let the plugin receive and write the data.  This has to happen
+     * here, while we are still the only thread reading from the
+     * client.
+     */
+  case REQUEST_DATA_PAYLOAD:
+    rq->error = handle_write_payload (rq->flags, rq->offset, rq->count,
+                                      &failed);
+    assert ((int) rq->error >= 0);
+    if (failed)
+      goto drop;
+    break;
 
     /* Receive the write data buffer. */
-    if (cmd == NBD_CMD_WRITE) {
-      r = conn->recv (buf, count);
-      if (r == 0) {
-        errno = EBADMSG;
-        r = -1;
-      }
-      if (r == -1) {
-        nbdkit_error ("read data: %s: %m", name_of_nbd_cmd (cmd));
-        return connection_set_status (STATUS_DEAD);
-      }
+  case REQUEST_DATA_BUF:
+    r = conn->recv (rq->buf, rq->count);
+    if (r == 0) {
+      errno = EBADMSG;
+      r = -1;
+    }
+    if (r == -1) {
+      nbdkit_error ("read data: %s: %m", name_of_nbd_cmd (rq->cmd));
+      goto drop;
     }
+    break;
   }
+  return false;
+
+  /* The connection is broken so no reply can be sent. */
+ drop:
+  rq->action = REQUEST_DROP;
+  return connection_set_status (STATUS_DEAD);
+}
 
-  /* Perform the request.  Only this part happens inside the request lock. */
-  if (quit || cs < STATUS_ACTIVE) {
+/* Perform a request read by protocol_recv_request, send the reply,
+ * and release everything held by rq.  Return true if the caller
+ * should shutdown.
+ */
+bool
+protocol_process_request (struct protocol_request *rq)
+{
+  GET_CONN;
+  CLEANUP_EXTENTS_FREE struct nbdkit_extents *extents = rq->extents;
+  char *buf = rq->buf;
+  uint32_t error = rq->error;
+  int fd = -1;
+  uint64_t fd_offset = 0;
+  bool r;
+
+  switch (rq->action) {
+  case REQUEST_PERFORM:
+    break;
+  case REQUEST_REPLY:
+    goto send_reply;
+  case REQUEST_DROP:
+    goto drop_reply;
+  case REQUEST_NONE:
+  default:
+    abort ();
+  }
+
+  DTRACE_PROBE3 (nbdkit, request_dispatch, conn, rq->cookie, rq->cmd);
+
+  /* Perform the request.  Only this part happens inside the request
+   * lock, and it waits for a slot if --max-requests is used.
+   */
+  scheduler_enter (rq->cmd, rq->count);
+  if (quit || connection_get_status () < STATUS_ACTIVE) {
     error = ESHUTDOWN;
   }
+  else if (rq->aio) {
+    int err = 0;
+
+    /* If the plugin accepts the request then the reply is sent when
+     * the plugin calls nbdkit_request_complete, and the request is no
+     * longer ours to touch.  The scheduler slot is released there.
+     */
+    if (submit_aio_request (rq->aio, &err) == 0)
+      return false;
+    error = err;
+  }
+  else if (rq->use_fd) {
+    lock_request ();
+    error = handle_read_fd (rq->offset, rq->count, &buf, &fd, &fd_offset);
+    assert ((int) error >= 0);
+    unlock_request ();
+  }
   else {
     lock_request ();
-    error = handle_request (cmd, flags, offset, count, buf, extents);
+    error = handle_request (rq->cmd, rq->flags, rq->offset, rq->count,
+                            buf, extents);
     assert ((int) error >= 0);
     unlock_request ();
   }
+  scheduler_leave ();
 
   /* Send the reply packet. */
  send_reply:
-  if (connection_get_status () < STATUS_CLIENT_DONE)
-    return false;
+  begin_ordered_reply (rq->seq);
+  if (fd >= 0 && error == 0)
+    r = send_reply_fd (rq->cookie, rq->flags, rq->offset, rq->count,
+                       fd, fd_offset);
+  else
+    r = send_reply (rq->cookie, rq->cmd, rq->flags, rq->offset, rq->count,
+                    buf, extents, error);
+  end_ordered_reply (rq->seq);
+  DTRACE_PROBE4 (nbdkit, request_reply, conn, rq->cookie, rq->cmd, error);
+  metrics_end_request (conn, rq->cmd, rq->count, error, rq->start);
+  if (rq->aio)
+    free_aio_request (rq->aio);
+  else
+    bufpool_put (buf, rq->count);
+  return r;
+
+  /* The connection is broken so no reply can be sent.  The status was
+   * already set by protocol_recv_request.
+   */
+ drop_reply:
+  begin_ordered_reply (rq->seq);
+  end_ordered_reply (rq->seq);
+  if (rq->aio)
+    free_aio_request (rq->aio);
+  else
+    bufpool_put (buf, rq->count);
+  return false;
+}
 
-  if (error != 0) {
-    /* Since we're about to send only the limited NBD_E* errno to the
-     * client, don't lose the information about what really happened
-     * on the server side.  Make sure there is a way for the operator
-     * to retrieve the real error.
-     */
-    debug ("sending error reply: %s", strerror (error));
+/* Can request b be performed together with the run of queued
+ * requests ending with a, whose lengths add up to count?  Only
+ * adjacent reads, or adjacent writes without FUA, which use pooled
+ * buffers are combined (see --coalesce).
+ */
+bool
+protocol_can_coalesce (const struct protocol_request *a,
+                       const struct protocol_request *b, uint64_t count)
+{
+  GET_CONN;
+  uint32_t minimum, preferred, maximum;
+
+  if (a->action != REQUEST_PERFORM || b->action != REQUEST_PERFORM ||
+      a->cmd != b->cmd)
+    return false;
+  switch (a->cmd) {
+  case NBD_CMD_READ:
+    break;
+  case NBD_CMD_WRITE:
+    if ((a->flags | b->flags) & NBD_CMD_FLAG_FUA)
+      return false;
+    break;
+  default:
+    return false;
   }
+  if (a->aio || b->aio || a->use_fd || b->use_fd)
+    return false;
+  if (a->offset + a->count != b->offset)
+    return false;
 
-  /* Currently we prefer to send simple replies for everything except
-   * where we have to (ie. NBD_CMD_READ and NBD_CMD_BLOCK_STATUS when
-   * structured_replies have been negotiated).  However this prevents
-   * us from sending human-readable error messages to the client, so
-   * we should reconsider this in future.
-   */
-  if (!conn->structured_replies ||
-      (cmd != NBD_CMD_READ && cmd != NBD_CMD_BLOCK_STATUS))
-    return send_simple_reply (request.cookie, cmd, flags, buf, count, error);
+  count += b->count;
+  if (count > coalesce_size)
+    return false;
+  if (backend_block_size (conn->top_context,
+                          &minimum, &preferred, &maximum) == -1)
+    return false;
+  if (maximum > 0 && count > maximum)
+    return false;
+  return true;
+}
 
-  if (error)
-    return send_structured_reply_error (request.cookie, cmd, flags, error);
+/* Perform a run of adjacent requests chosen by protocol_can_coalesce
+ * with a single call to the backend, reading into or writing from
+ * each request's own buffer.  Then send the replies as usual.  If the
+ * combined call fails, each request is performed again by itself so
+ * that it gets its own error.  Return true if the caller should
+ * shutdown.
+ */
+bool
+protocol_process_coalesced (struct protocol_request **rqs, size_t n)
+{
+  GET_CONN;
+  CLEANUP_FREE struct nbdkit_iovec *iov = NULL;
+  struct context *c = conn->top_context;
+  const uint16_t cmd = rqs[0]->cmd;
+  const uint64_t offset = rqs[0]->offset;
+  int err = 0;
+  bool r = false;
+  size_t i;
+  int ret;
+
+  assert (n > 1);
+  iov = malloc (n * sizeof *iov);
+  if (iov == NULL || quit || connection_get_status () < STATUS_ACTIVE)
+    goto process;
+
+  for (i = 0; i < n; ++i) {
+    iov[i].base = rqs[i]->buf;
+    iov[i].len = rqs[i]->count;
+    DTRACE_PROBE3 (nbdkit, request_dispatch, conn, rqs[i]->cookie, cmd);
+  }
 
+  threadlocal_set_errno (0);
+  threadlocal_clear_last_error ();
+  scheduler_enter (cmd, iovec_size (iov, n));
+  lock_request ();
   if (cmd == NBD_CMD_READ)
-    return send_structured_reply_read (request.cookie, cmd, buf, count,
-                                       offset);
+    ret = backend_preadv (c, iov, n, offset, 0, &err);
+  else
+    ret = backend_pwritev (c, iov, n, offset, 0, &err);
+  unlock_request ();
+  scheduler_leave ();
+
+  if (ret == 0) {
+    for (i = 0; i < n; ++i) {
+      rqs[i]->action = REQUEST_REPLY;
+      rqs[i]->error = 0;
+    }
+  }
+  else
+    debug ("%s of %zu coalesced requests failed, "
+           "performing them separately",
+           name_of_nbd_cmd (cmd), n);
+
+ process:
+  for (i = 0; i < n; ++i) {
+    if (protocol_process_request (rqs[i]))
+      r = true;
+  }
+  return r;
+}
+
+/* Do a recv/send sequence. Return true if the caller should shutdown. */
+bool
+protocol_recv_request_send_reply (void)
+{
+  struct protocol_request rq;
+  bool r;
 
-  /* NBD_CMD_BLOCK_STATUS */
-  return send_structured_reply_block_status (request.cookie, cmd, flags,
-                                             count, offset, extents);
+  r = protocol_recv_request (&rq);
+  if (rq.action != REQUEST_NONE && protocol_process_request (&rq))
+    r = true;
+  return r;
 }
@@ -840,6 +840,7 @@ nbdkit_peer_name (struct sockaddr *addr, socklen_t *addrlen)
 
   if (!conn) {
     nbdkit_error ("no connection in this thread");
+    threadlocal_set_conn_needed (true);
     return -1;
   }
 
@@ -989,6 +990,7 @@ get_peercred_common (int64_t *pid, int64_t *uid, int64_t *gid)
 
   if (!conn) {
     nbdkit_error ("no connection in this thread");
+    threadlocal_set_conn_needed (true);
     return -1;
   }
 
@@ -1047,6 +1049,7 @@ nbdkit_peer_security_context (void)
 
   if (!conn) {
     nbdkit_error ("no connection in this thread");
+    threadlocal_set_conn_needed (true);
     return NULL;
   }
 
@@ -0,0 +1,286 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Fair-share request scheduler (--max-requests, --request-weight).
+ *
+ * At most max_requests requests are performed at the same time
+ * across all connections.  Each connection is a flow with a weight,
+ * taken from the export it selected (default 1).  When the limit is
+ * reached, requests wait and the next one admitted comes from the
+ * waiting flow with the lowest pass.  Admitting a request advances
+ * its flow's pass by the cost of the request divided by the weight,
+ * so over time each busy flow gets a share of the plugin in
+ * proportion to its weight, whatever its queue depth or request
+ * size.  Within a flow, requests are admitted in arrival order.
+ *
+ * A flow which becomes busy after being idle starts from the pass of
+ * the most recently admitted request, so it cannot save up credit.
+ *
+ * Each waiting thread has a condition variable of its own, and only
+ * the thread holding the next ticket of the flow which next_flow
+ * selects is woken, so a free slot doesn't wake every waiting thread.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "cleanup.h"
+#include "strndup.h"
+
+#include "internal.h"
+#include "nbd-protocol.h"
+
+/* Fixed cost of every request, plus the number of bytes read or
+ * written.  This makes a small read cheaper than a large one, but not
+ * free.
+ */
+#define REQUEST_COST 65536
+
+struct request_weight {
+  struct request_weight *next;
+  char *exportname;
+  unsigned weight;
+};
+
+static struct request_weight *weights;
+
+/* A thread waiting in scheduler_enter. */
+struct scheduler_waiter {
+  struct scheduler_waiter *next;
+  pthread_cond_t cond;
+  uint64_t ticket;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned in_flight;               /* protected by lock */
+static uint64_t vtime;                   /* protected by lock */
+static struct scheduler_flow *waiting;   /* protected by lock */
+static uint64_t nr_admitted, nr_delayed; /* protected by lock */
+
+/* Parse a single --request-weight=EXPORTNAME=WEIGHT option.  The
+ * export name may itself contain '=', so split at the last one.
+ */
+void
+scheduler_add_weight (const char *arg)
+{
+  struct request_weight *w;
+  const char *p;
+
+  p = strrchr (arg, '=');
+  if (p == NULL) {
+    fprintf (stderr,
+             "%s: --request-weight must have the format EXPORTNAME=WEIGHT\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  w = malloc (sizeof *w);
+  if (w == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  w->exportname = strndup (arg, p - arg);
+  if (w->exportname == NULL) {
+    perror ("strndup");
+    exit (EXIT_FAILURE);
+  }
+  if (nbdkit_parse_unsigned ("request-weight", p+1, &w->weight) == -1)
+    exit (EXIT_FAILURE);
+  if (w->weight == 0) {
+    fprintf (stderr, "%s: --request-weight: weight must be >= 1\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  w->next = weights;
+  weights = w;
+}
+
+void
+scheduler_free (void)
+{
+  struct request_weight *w, *next;
+
+  if (max_requests > 0)
+    debug ("scheduler: %" PRIu64 " requests, %" PRIu64 " delayed",
+           nr_admitted, nr_delayed);
+
+  for (w = weights; w != NULL; w = next) {
+    next = w->next;
+    free (w->exportname);
+    free (w);
+  }
+  weights = NULL;
+}
+
+/* The last matching option wins, and weights is in reverse order. */
+static unsigned
+lookup_weight (const char *exportname)
+{
+  struct request_weight *w;
+
+  for (w = weights; w != NULL; w = w->next) {
+    if (strcmp (w->exportname, exportname) == 0)
+      return w->weight;
+  }
+  return 1;
+}
+
+/* The waiting flow with the lowest pass.  Call with lock held. */
+static struct scheduler_flow *
+next_flow (void)
+{
+  struct scheduler_flow *f, *best = NULL;
+
+  for (f = waiting; f != NULL; f = f->next) {
+    if (best == NULL || f->pass < best->pass)
+      best = f;
+  }
+  return best;
+}
+
+static bool
+can_admit (struct scheduler_flow *flow, uint64_t ticket)
+{
+  return in_flight < max_requests &&
+    ticket == flow->serving &&
+    next_flow () == flow;
+}
+
+/* If a slot is free, wake the thread whose request is admitted next.
+ * Call with lock held.
+ */
+static void
+wake_next (void)
+{
+  struct scheduler_flow *flow;
+
+  if (in_flight >= max_requests)
+    return;
+  flow = next_flow ();
+  if (flow && flow->waiters && flow->waiters->ticket == flow->serving)
+    pthread_cond_signal (&flow->waiters->cond);
+}
+
+/* Wait until a request on the current connection may be performed.
+ * Every call must be paired with scheduler_leave once the request
+ * has been performed (for asynchronous requests, when it completes).
+ */
+void
+scheduler_enter (uint16_t cmd, uint64_t count)
+{
+  struct connection *conn = threadlocal_get_conn ();
+  struct scheduler_flow *flow, **fp;
+  uint64_t ticket, cost;
+
+  if (max_requests == 0)
+    return;
+
+  assert (conn != NULL);
+  flow = &conn->scheduler;
+  cost = REQUEST_COST;
+  if (cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE)
+    cost += count;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+  if (flow->weight == 0) {
+    flow->weight = lookup_weight (conn->top_context->exportname);
+    if (flow->weight > 1)
+      debug ("scheduler: export \"%s\" has weight %u",
+             conn->top_context->exportname, flow->weight);
+  }
+
+  /* Add the flow to the waiting list if it was idle. */
+  if (flow->next_ticket == flow->serving) {
+    if (flow->pass < vtime)
+      flow->pass = vtime;
+    flow->next = waiting;
+    waiting = flow;
+  }
+  ticket = flow->next_ticket++;
+
+  if (!can_admit (flow, ticket)) {
+    struct scheduler_waiter w = { .ticket = ticket };
+
+    nr_delayed++;
+    pthread_cond_init (&w.cond, NULL);
+    if (flow->waiters == NULL)
+      flow->waiters_tail = &flow->waiters;
+    *flow->waiters_tail = &w;
+    flow->waiters_tail = &w.next;
+    do
+      pthread_cond_wait (&w.cond, &lock);
+    while (!can_admit (flow, ticket));
+
+    /* Tickets are taken in order, so this is the first waiter. */
+    assert (flow->waiters == &w);
+    flow->waiters = w.next;
+    pthread_cond_destroy (&w.cond);
+  }
+
+  /* Admit the request. */
+  flow->serving++;
+  if (flow->serving == flow->next_ticket) {
+    for (fp = &waiting; *fp != flow; fp = &(*fp)->next)
+      ;
+    *fp = flow->next;
+    flow->next = NULL;
+  }
+  vtime = flow->pass;
+  flow->pass += cost / flow->weight;
+  in_flight++;
+  nr_admitted++;
+
+  /* Another request may be admissible now. */
+  wake_next ();
+}
+
+void
+scheduler_leave (void)
+{
+  if (max_requests == 0)
+    return;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  assert (in_flight > 0);
+  in_flight--;
+  wake_next ();
+}
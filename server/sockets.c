@@ -40,6 +40,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/types.h>
 
 #ifdef HAVE_SYS_SOCKET_H
@@ -168,6 +170,92 @@ bind_unix_socket (sockets *socks)
   debug ("bound to unix socket %s", unixsocket);
 }
 
+/* With --accept-threads, each TCP/IP address is bound this many
+ * times using SO_REUSEPORT, so each acceptor thread has its own
+ * listening socket and the kernel spreads new connections across
+ * them.  The sockets are stored in order, so socket i belongs to
+ * acceptor i % nr_shards.  If this is 1, acceptor threads share the
+ * listening sockets.
+ */
+static unsigned nr_shards = 1;
+
+/* Bind and listen on a single address.  Returns the socket, or -1
+ * if the address should be ignored (the error is saved in
+ * *saved_errno).  Other errors are fatal.
+ */
+static int
+bind_tcpip_address (const struct addrinfo *a, bool reuseport,
+                    int *saved_errno)
+{
+  int sock, opt;
+
+  set_selinux_label ();
+
+#ifdef SOCK_CLOEXEC
+  sock = socket (a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+#else
+  /* Fortunately, this code is only run at startup, so there is no
+   * risk of the fd leaking to a plugin's fork()
+   */
+  sock = set_cloexec (socket (a->ai_family, a->ai_socktype, a->ai_protocol));
+#endif
+  if (sock == -1) {
+    if (errno == EAFNOSUPPORT) {
+      /* If ipv6.disable=1 was specified to the Linux kernel then
+       * getaddrinfo may still return AF_INET6 sockets but socket(2)
+       * will return this error.  I think it's safe to basically
+       * ignore this error.
+       */
+      *saved_errno = errno;
+      debug ("bind_tcpip_socket: socket: %m (ignored)");
+      return -1;
+    }
+    else {
+      perror ("bind_tcpip_socket: socket");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  opt = 1;
+  if (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt) == -1)
+    perror ("setsockopt: SO_REUSEADDR");
+
+#ifdef SO_REUSEPORT
+  if (reuseport &&
+      setsockopt (sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof opt) == -1) {
+    perror ("setsockopt: SO_REUSEPORT");
+    exit (EXIT_FAILURE);
+  }
+#endif
+
+#ifdef IPV6_V6ONLY
+  if (a->ai_family == PF_INET6) {
+    if (setsockopt (sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof opt) == -1)
+      perror ("setsockopt: IPv6 only");
+  }
+#endif
+
+  if (bind (sock, a->ai_addr, a->ai_addrlen) == -1) {
+    if (errno == EADDRINUSE) {
+      *saved_errno = errno;
+      debug ("bind_tcpip_socket: bind: %m (ignored)");
+      closesocket (sock);
+      return -1;
+    }
+    perror ("bind");
+    exit (EXIT_FAILURE);
+  }
+
+  if (listen (sock, SOMAXCONN) == -1) {
+    perror ("listen");
+    exit (EXIT_FAILURE);
+  }
+
+  clear_selinux_label ();
+
+  return sock;
+}
+
 void
 bind_tcpip_socket (sockets *socks)
 {
@@ -175,11 +263,17 @@ bind_tcpip_socket (sockets *socks)
   struct addrinfo *ai = NULL;
   struct addrinfo hints;
   struct addrinfo *a;
-  int err, opt;
+  unsigned shard;
+  int err, sock;
   int saved_errno = 0;
 
   ipport = port ? port : "10809";
 
+#ifdef SO_REUSEPORT
+  if (accept_threads > 1)
+    nr_shards = accept_threads;
+#endif
+
   memset (&hints, 0, sizeof hints);
   hints.ai_flags = AI_PASSIVE;
   hints.ai_family = tcpip_sock_af;
@@ -196,67 +290,23 @@ bind_tcpip_socket (sockets *socks)
   }
 
   for (a = ai; a != NULL; a = a->ai_next) {
-    int sock;
-
-    set_selinux_label ();
-
-#ifdef SOCK_CLOEXEC
-    sock = socket (a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
-#else
-    /* Fortunately, this code is only run at startup, so there is no
-     * risk of the fd leaking to a plugin's fork()
-     */
-    sock = set_cloexec (socket (a->ai_family, a->ai_socktype, a->ai_protocol));
-#endif
-    if (sock == -1) {
-      if (errno == EAFNOSUPPORT) {
-        /* If ipv6.disable=1 was specified to the Linux kernel then
-         * getaddrinfo may still return AF_INET6 sockets but socket(2)
-         * will return this error.  I think it's safe to basically
-         * ignore this error.
+    for (shard = 0; shard < nr_shards; ++shard) {
+      sock = bind_tcpip_address (a, nr_shards > 1, &saved_errno);
+      if (sock == -1) {
+        /* Once the first socket is bound to the address, binding the
+         * others with SO_REUSEPORT should not fail.
          */
-        saved_errno = errno;
-        debug ("bind_tcpip_socket: socket: %m (ignored)");
-        continue;
-      }
-      else {
-        perror ("bind_tcpip_socket: socket");
+        if (shard == 0)
+          break;
+        fprintf (stderr, "%s: could not bind listening socket %u: %s\n",
+                 program_name, shard, strerror (saved_errno));
         exit (EXIT_FAILURE);
       }
-    }
-
-    opt = 1;
-    if (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt) == -1)
-      perror ("setsockopt: SO_REUSEADDR");
 
-#ifdef IPV6_V6ONLY
-    if (a->ai_family == PF_INET6) {
-      if (setsockopt (sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof opt) == -1)
-        perror ("setsockopt: IPv6 only");
-    }
-#endif
-
-    if (bind (sock, a->ai_addr, a->ai_addrlen) == -1) {
-      if (errno == EADDRINUSE) {
-        saved_errno = errno;
-        debug ("bind_tcpip_socket: bind: %m (ignored)");
-        closesocket (sock);
-        continue;
+      if (sockets_append (socks, sock) == -1) {
+        perror ("realloc");
+        exit (EXIT_FAILURE);
       }
-      perror ("bind");
-      exit (EXIT_FAILURE);
-    }
-
-    if (listen (sock, SOMAXCONN) == -1) {
-      perror ("listen");
-      exit (EXIT_FAILURE);
-    }
-
-    clear_selinux_label ();
-
-    if (sockets_append (socks, sock) == -1) {
-      perror ("realloc");
-      exit (EXIT_FAILURE);
     }
   }
 
@@ -349,29 +399,44 @@ bind_vsock (sockets *socks)
  * purpose of this is so we can wait for all the connection threads to
  * exit before we return from accept_incoming_connections, so that
  * unload-time actions happen with no connections open.
+ *
+ * The count is incremented when a connection is accepted, before it
+ * is handed to a thread, so it cannot be zero while a connection is
+ * on its way to being served.
  */
 static pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t count_cond = PTHREAD_COND_INITIALIZER;
 static unsigned count = 0;
+static size_t instance_num = 1; /* Protected by count_mutex. */
 
 struct thread_data {
   int sock;
   size_t instance_num;
 };
 
-static void *
-start_thread (void *datav)
-{
-  struct thread_data *data = datav;
+/* With --accept-threads, connection threads are kept in a pool after
+ * their connection ends, and new connections are handed to an idle
+ * thread instead of creating a new one.  The pool starts with
+ * POOL_THREADS_PER_ACCEPTOR threads for each acceptor, and grows when
+ * there are no idle threads.  Threads above the initial number exit
+ * after being idle for POOL_IDLE_TIMEOUT seconds.
+ */
+#define POOL_THREADS_PER_ACCEPTOR 4
+#define POOL_IDLE_TIMEOUT 60 /* seconds */
 
-  debug ("accepted connection");
+DEFINE_VECTOR_TYPE (thread_data_queue, struct thread_data *);
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static thread_data_queue pool_queue = empty_vector;
+static unsigned pool_threads;   /* Threads in the pool. */
+static unsigned pool_idle;      /* Threads waiting in pool_get. */
+static bool pool_stop;
 
-  pthread_mutex_lock (&count_mutex);
-  count++;
-  pthread_mutex_unlock (&count_mutex);
+static void
+serve_connection (struct thread_data *data)
+{
+  debug ("accepted connection");
 
-  /* Set thread-local data. */
-  threadlocal_new_server_thread ();
   threadlocal_set_instance_num (data->instance_num);
 
   handle_single_connection (data->sock, data->sock);
@@ -382,18 +447,136 @@ start_thread (void *datav)
   count--;
   pthread_cond_signal (&count_cond);
   pthread_mutex_unlock (&count_mutex);
+}
+
+/* Wait for the next connection from the pool queue.  Returns NULL if
+ * the thread should exit.
+ */
+static struct thread_data *
+pool_get (void)
+{
+  struct thread_data *data;
+  struct timespec deadline;
+  int r;
+
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += POOL_IDLE_TIMEOUT;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+  pool_idle++;
+  while (pool_queue.len == 0 && !pool_stop) {
+    r = pthread_cond_timedwait (&pool_cond, &pool_lock, &deadline);
+    if (r == ETIMEDOUT && pool_queue.len == 0) {
+      if (pool_threads > accept_threads * POOL_THREADS_PER_ACCEPTOR)
+        break;
+      deadline.tv_sec += POOL_IDLE_TIMEOUT;
+    }
+  }
+  pool_idle--;
+  if (pool_queue.len == 0) {
+    pool_threads--;
+    pthread_cond_broadcast (&pool_cond);
+    return NULL;
+  }
+
+  data = pool_queue.ptr[0];
+  thread_data_queue_remove (&pool_queue, 0);
+  return data;
+}
+
+/* Hand a connection to an idle pool thread.  If there are none,
+ * returns false and the caller must start a new thread, which is
+ * counted as part of the pool.
+ */
+static bool
+pool_dispatch (struct thread_data *data)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+
+  if (pool_idle > pool_queue.len &&
+      thread_data_queue_append (&pool_queue, data) == 0) {
+    pthread_cond_signal (&pool_cond);
+    return true;
+  }
+  pool_threads++;
+  return false;
+}
+
+static void *
+start_thread (void *datav)
+{
+  struct thread_data *data = datav;
+
+  /* Set thread-local data. */
+  threadlocal_new_server_thread ();
+
+  /* Prestarted pool threads have no connection to begin with. */
+  if (data)
+    serve_connection (data);
+
+  if (accept_threads > 0) {
+    while ((data = pool_get ()) != NULL)
+      serve_connection (data);
+  }
 
   return NULL;
 }
 
-static void
-accept_connection (int listen_sock)
+static int
+create_connection_thread (struct thread_data *data)
 {
-  int err;
   pthread_attr_t attrs;
   pthread_t thread;
+  int err;
+
+  pthread_attr_init (&attrs);
+  pthread_attr_setdetachstate (&attrs, PTHREAD_CREATE_DETACHED);
+  err = pthread_create (&thread, &attrs, start_thread, data);
+  pthread_attr_destroy (&attrs);
+  if (unlikely (err != 0)) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+  return 0;
+}
+
+/* Start the initial pool threads, and stop them on exit. */
+static void
+pool_start (void)
+{
+  unsigned i;
+
+  for (i = 0; i < accept_threads * POOL_THREADS_PER_ACCEPTOR; ++i) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+      pool_threads++;
+    }
+    if (create_connection_thread (NULL) == -1) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+      pool_threads--;
+      break;
+    }
+  }
+}
+
+static void
+pool_stop_threads (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+
+  pool_stop = true;
+  pthread_cond_broadcast (&pool_cond);
+  while (pool_threads > 0)
+    pthread_cond_wait (&pool_cond, &pool_lock);
+  assert (pool_queue.len == 0);
+  thread_data_queue_reset (&pool_queue);
+}
+
+static void
+accept_connection (int listen_sock)
+{
   struct thread_data *thread_data;
-  static size_t instance_num = 1;
   const int flag = 1;
 
   thread_data = malloc (sizeof *thread_data);
@@ -402,7 +585,6 @@ accept_connection (int listen_sock)
     return;
   }
 
-  thread_data->instance_num = instance_num++;
  again:
 #ifdef HAVE_ACCEPT4
   thread_data->sock = accept4 (listen_sock, NULL, NULL, SOCK_CLOEXEC);
@@ -420,13 +602,28 @@ accept_connection (int listen_sock)
   unlock_request ();
 #endif
   if (thread_data->sock == -1) {
-    if (errno == EINTR || errno == EAGAIN)
+    if (errno == EINTR)
       goto again;
-    nbdkit_error ("accept: %m");
+    /* With --accept-threads the listening socket may be non-blocking
+     * and shared, so another thread may have taken the connection.
+     */
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      nbdkit_error ("accept: %m");
     free (thread_data);
     return;
   }
 
+#if !defined (HAVE_ACCEPT4) && !defined (WIN32)
+  /* On some platforms accept copies O_NONBLOCK from the listening
+   * socket, which we may have set for --accept-threads.
+   */
+  if (accept_threads > 0) {
+    int f = fcntl (thread_data->sock, F_GETFL);
+    if (f != -1)
+      fcntl (thread_data->sock, F_SETFL, f & ~O_NONBLOCK);
+  }
+#endif
+
   /* Disable Nagle's algorithm on this socket.  However we don't want
    * to fail if this doesn't work.
    */
@@ -440,19 +637,29 @@ accept_connection (int listen_sock)
   }
 #endif
 
+  pthread_mutex_lock (&count_mutex);
+  thread_data->instance_num = instance_num++;
+  count++;
+  pthread_mutex_unlock (&count_mutex);
+
   /* Start a thread to handle this connection.  Note we always do this
    * even for non-threaded plugins.  There are mutexes in plugins.c
    * which ensure that non-threaded plugins are handled correctly.
    */
-  pthread_attr_init (&attrs);
-  pthread_attr_setdetachstate (&attrs, PTHREAD_CREATE_DETACHED);
-  err = pthread_create (&thread, &attrs, start_thread, thread_data);
-  pthread_attr_destroy (&attrs);
-  if (unlikely (err != 0)) {
-    errno = err;
-    nbdkit_error ("pthread_create: %m");
+  if (accept_threads > 0 && pool_dispatch (thread_data))
+    return;
+
+  if (create_connection_thread (thread_data) == -1) {
+    if (accept_threads > 0) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+      pool_threads--;
+    }
     closesocket (thread_data->sock);
     free (thread_data);
+    pthread_mutex_lock (&count_mutex);
+    count--;
+    pthread_cond_signal (&count_cond);
+    pthread_mutex_unlock (&count_mutex);
     return;
   }
 
@@ -569,14 +776,100 @@ check_sockets_and_quit_fd (const sockets *socks)
 
 #endif /* WIN32 */
 
+/* With --accept-threads, each acceptor thread waits for connections
+ * on its own set of listening sockets.
+ */
+struct acceptor {
+  pthread_t thread;
+  unsigned i;
+  sockets socks;
+};
+
+static void *
+acceptor_thread (void *ap)
+{
+  struct acceptor *a = ap;
+
+  threadlocal_new_server_thread ();
+  affinity_bind (a->i % affinity_nr_groups ());
+
+  while (!quit)
+    check_sockets_and_quit_fd (&a->socks);
+  return NULL;
+}
+
+static void
+run_acceptors (const sockets *socks)
+{
+  CLEANUP_FREE struct acceptor *acceptors = NULL;
+  unsigned i;
+  size_t j;
+  int err;
+
+  acceptors = calloc (accept_threads, sizeof *acceptors);
+  if (acceptors == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < accept_threads; ++i) {
+    acceptors[i].i = i;
+    for (j = 0; j < socks->len; ++j) {
+      if (nr_shards > 1 && j % nr_shards != i)
+        continue;
+      if (sockets_append (&acceptors[i].socks, socks->ptr[j]) == -1) {
+        perror ("realloc");
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  /* Shared listening sockets must be non-blocking, otherwise an
+   * acceptor which loses the race for a connection blocks in accept.
+   */
+  if (nr_shards == 1 && accept_threads > 1) {
+    for (j = 0; j < socks->len; ++j) {
+      if (set_nonblock (socks->ptr[j]) == -1)
+        exit (EXIT_FAILURE);
+    }
+  }
+
+  debug ("starting %u acceptor threads (%s listening sockets)",
+         accept_threads, nr_shards > 1 ? "SO_REUSEPORT" : "shared");
+  pool_start ();
+
+  for (i = 0; i < accept_threads; ++i) {
+    err = pthread_create (&acceptors[i].thread, NULL, acceptor_thread,
+                          &acceptors[i]);
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  for (i = 0; i < accept_threads; ++i) {
+    err = pthread_join (acceptors[i].thread, NULL);
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_join");
+    }
+    sockets_reset (&acceptors[i].socks);
+  }
+}
+
 void
 accept_incoming_connections (const sockets *socks)
 {
   size_t i;
   int err;
 
-  while (!quit)
-    check_sockets_and_quit_fd (socks);
+  if (accept_threads == 0) {
+    while (!quit)
+      check_sockets_and_quit_fd (socks);
+  }
+  else
+    run_acceptors (socks);
 
   /* Wait for all threads to exit. */
   pthread_mutex_lock (&count_mutex);
@@ -591,6 +884,12 @@ accept_incoming_connections (const sockets *socks)
   }
   pthread_mutex_unlock (&count_mutex);
 
+  if (accept_threads > 0)
+    pool_stop_threads ();
+
+  /* Wait for connections served by the I/O threads (--io-threads). */
+  mux_stop ();
+
   for (i = 0; i < socks->len; ++i)
     closesocket (socks->ptr[i]);
   free (socks->ptr);
@@ -69,6 +69,7 @@ debug_in_server (const char *fs, ...)
 bool listen_stdin;
 bool configured;
 bool verbose;
+bool use_extents_cache;
 int tls;
 
 volatile int quit;
@@ -90,6 +91,12 @@ threadlocal_get_context (void)
   abort ();
 }
 
+void
+threadlocal_set_conn_needed (bool needed)
+{
+  abort ();
+}
+
 conn_status
 connection_get_status (void)
 {
@@ -34,6 +34,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
@@ -57,10 +58,11 @@ struct threadlocal {
   size_t instance_num;          /* Can be 0. */
   int err;
   char *last_error;             /* Can be NULL. */
-  void *buffer;                 /* Can be NULL. */
-  size_t buffer_size;
   struct connection *conn;      /* Can be NULL. */
   struct context *ctx;          /* Can be NULL. */
+  unsigned affinity_group;      /* Can be 0. */
+  bool conn_needed;             /* See threadlocal_set_conn_needed. */
+  void *bufpool_cache;          /* Can be NULL, see bufpool.c. */
 };
 
 static pthread_key_t threadlocal_key;
@@ -70,9 +72,10 @@ free_threadlocal (void *threadlocalv)
 {
   struct threadlocal *threadlocal = threadlocalv;
 
+  if (threadlocal->bufpool_cache)
+    bufpool_thread_exit (threadlocal->bufpool_cache);
   free (threadlocal->name);
   free (threadlocal->last_error);
-  free (threadlocal->buffer);
   free (threadlocal);
 }
 
@@ -108,6 +111,16 @@ threadlocal_new_server_thread (void)
   }
 }
 
+/* Return true if the current thread has thread-local storage, ie. it
+ * was created by the server or threadlocal_new_server_thread was
+ * called on it.  Threads created by plugins return false.
+ */
+bool
+threadlocal_is_server_thread (void)
+{
+  return pthread_getspecific (threadlocal_key) != NULL;
+}
+
 void
 threadlocal_set_name (const char *name)
 {
@@ -216,40 +229,6 @@ threadlocal_get_last_error (void)
   return threadlocal ? threadlocal->last_error : NULL;
 }
 
-/* Return the single pread/pwrite buffer for this thread.  The buffer
- * size is increased to ‘size’ bytes if required.
- *
- * The buffer starts out as zeroes but after use may contain data from
- * previous requests.  This is fine because: (a) Correctly written
- * plugins should overwrite the whole buffer on each request so no
- * leak should occur.  (b) The aim of this buffer is to avoid leaking
- * random heap data from the core server; previous request data from
- * the plugin is not considered sensitive.
- */
-extern void *
-threadlocal_buffer (size_t size)
-{
-  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
-
-  if (!threadlocal)
-    abort ();
-
-  if (threadlocal->buffer_size < size) {
-    void *ptr;
-
-    ptr = realloc (threadlocal->buffer, size);
-    if (ptr == NULL) {
-      nbdkit_error ("threadlocal_buffer: realloc: %m");
-      return NULL;
-    }
-    memset (ptr, 0, size);
-    threadlocal->buffer = ptr;
-    threadlocal->buffer_size = size;
-  }
-
-  return threadlocal->buffer;
-}
-
 /* Set (or clear) the connection that is using the current thread */
 void
 threadlocal_set_conn (struct connection *conn)
@@ -273,6 +252,67 @@ threadlocal_get_conn (void)
   return conn;
 }
 
+/* Record that the code running in this thread called a function
+ * which needs the client connection when there was none.  The handle
+ * pool uses this to find out whether .open can be called ahead of
+ * time.
+ */
+void
+threadlocal_set_conn_needed (bool needed)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+
+  if (threadlocal)
+    threadlocal->conn_needed = needed;
+}
+
+bool
+threadlocal_get_conn_needed (void)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+
+  return threadlocal ? threadlocal->conn_needed : false;
+}
+
+/* Set and get the --cpu-affinity group of this thread (see affinity.c). */
+void
+threadlocal_set_affinity_group (unsigned g)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+
+  if (threadlocal)
+    threadlocal->affinity_group = g;
+}
+
+unsigned
+threadlocal_get_affinity_group (void)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+
+  if (!threadlocal)
+    return 0;
+
+  return threadlocal->affinity_group;
+}
+
+/* Set and get the buffer pool cache of this thread (see bufpool.c). */
+void
+threadlocal_set_bufpool_cache (void *cache)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+
+  if (threadlocal)
+    threadlocal->bufpool_cache = cache;
+}
+
+void *
+threadlocal_get_bufpool_cache (void)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+
+  return threadlocal ? threadlocal->bufpool_cache : NULL;
+}
+
 /* Get the current context associated with this thread, if available */
 struct context *
 threadlocal_get_context (void)
@@ -63,14 +63,27 @@ connection_timeout (union sigval si)
    * place simultaneously.  The safest seems to be just to call
    * shutdown(2) on the socket.  Calling close(2) is less safe as it
    * might cause fd reuse.
+   *
+   * The status functions find the connection in thread-local storage,
+   * which this thread won't have, so create it on first use (it is
+   * freed when the thread exits).  The status is changed before the
+   * shutdown, since the connection may be freed as soon as the
+   * connection thread sees that the socket has been shut down.
    */
   lock_connection ();
   if (conn->magic == CONN_MAGIC &&
       conn->timer_set &&
-      conn->status == STATUS_ACTIVE &&
       conn->sockout >= 0) {
-    shutdown (conn->sockout, SHUT_RDWR);
-    conn->status = STATUS_DEAD;
+    if (!threadlocal_is_server_thread ())
+      threadlocal_new_server_thread ();
+    threadlocal_set_conn (conn);
+    if (connection_get_status () == STATUS_ACTIVE) {
+      const int sock = conn->sockout;
+
+      connection_set_status (STATUS_DEAD);
+      shutdown (sock, SHUT_RDWR);
+    }
+    threadlocal_set_conn (NULL);
   }
   unlock_connection ();
 }
@@ -0,0 +1,452 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Optional io_uring engine for connection I/O (--io-uring).
+ *
+ * Each connection gets two small rings, one used only by the thread
+ * holding read_lock and one used only by the thread holding
+ * write_lock, so no extra locking is needed.  The socket is
+ * registered with both rings, and a receive buffer is registered with
+ * the read ring.  After each request has been read, a read into this
+ * buffer is started immediately so that the next request (or several,
+ * if the client pipelines them) is usually waiting by the time a
+ * worker thread asks for it, without any further system call.
+ * Large write payloads are received straight into the request buffer
+ * instead, once anything already read ahead has been consumed, so they
+ * are not copied twice.
+ *
+ * Only plain sockets are handled.  TLS connections and -s (stdin)
+ * always use the ordinary functions in connections.c.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "internal.h"
+#include "minmax.h"
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+
+/* Size of the registered receive buffer. */
+#define RBUF_SIZE (64 * 1024)
+
+/* Reads of at least this much are made directly into the caller's
+ * buffer rather than through the receive buffer.
+ */
+#define DIRECT_RECV_MIN (16 * 1024)
+
+struct uring {
+  struct io_uring recv_ring;    /* Only used while holding read_lock. */
+  struct io_uring send_ring;    /* Only used while holding write_lock. */
+  char *rbuf;                   /* Registered receive buffer. */
+  size_t rpos, rlen;            /* Unconsumed data is rbuf[rpos..rlen-1]. */
+  bool recv_pending;            /* A read into rbuf is in flight. */
+};
+
+/* Queue a read into the receive buffer. */
+static int
+post_read (struct uring *u)
+{
+  struct io_uring_sqe *sqe;
+  int r;
+
+  assert (!u->recv_pending);
+  sqe = io_uring_get_sqe (&u->recv_ring);
+  assert (sqe != NULL);
+  io_uring_prep_read_fixed (sqe, 0, u->rbuf, RBUF_SIZE, 0, 0);
+  sqe->flags |= IOSQE_FIXED_FILE;
+  io_uring_sqe_set_data (sqe, u);
+  r = io_uring_submit (&u->recv_ring);
+  if (r < 0) {
+    errno = -r;
+    return -1;
+  }
+  u->recv_pending = true;
+  u->rpos = u->rlen = 0;
+  return 0;
+}
+
+/* Wait for the pending read to complete.  Returns the number of bytes
+ * read, 0 for EOF, or -1 on error.
+ */
+static int
+wait_read (struct uring *u)
+{
+  struct io_uring_cqe *cqe;
+  int r;
+
+  assert (u->recv_pending);
+  do
+    r = io_uring_wait_cqe (&u->recv_ring, &cqe);
+  while (r == -EINTR);
+  if (r < 0) {
+    errno = -r;
+    return -1;
+  }
+  r = cqe->res;
+  io_uring_cqe_seen (&u->recv_ring, cqe);
+  u->recv_pending = false;
+  if (r < 0) {
+    errno = -r;
+    return -1;
+  }
+  u->rpos = 0;
+  u->rlen = r;
+  return r;
+}
+
+/* Receive directly into buf, bypassing the receive buffer.  This must
+ * only be called when no read into the receive buffer is pending.
+ * Returns the number of bytes read, 0 for EOF, or -1 on error.
+ */
+static int
+read_direct (struct uring *u, void *buf, size_t len)
+{
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  int r;
+
+  assert (!u->recv_pending);
+  sqe = io_uring_get_sqe (&u->recv_ring);
+  assert (sqe != NULL);
+  io_uring_prep_recv (sqe, 0, buf, MIN (len, INT_MAX), MSG_WAITALL);
+  sqe->flags |= IOSQE_FIXED_FILE;
+
+  /* As in uring_sendv, an interrupted wait still has to collect the
+   * completion below.
+   */
+  r = io_uring_submit_and_wait (&u->recv_ring, 1);
+  if (r < 0 && r != -EINTR) {
+    errno = -r;
+    return -1;
+  }
+  do
+    r = io_uring_wait_cqe (&u->recv_ring, &cqe);
+  while (r == -EINTR);
+  if (r < 0) {
+    errno = -r;
+    return -1;
+  }
+  r = cqe->res;
+  io_uring_cqe_seen (&u->recv_ring, cqe);
+  if (r < 0) {
+    errno = -r;
+    return -1;
+  }
+  return r;
+}
+
+/* Read buffer from the connection and either succeed completely
+ * (returns > 0), read an EOF (returns 0), or fail (returns -1).  This
+ * has the same semantics as raw_recv.
+ */
+static int
+uring_recv (void *vbuf, size_t len)
+{
+  GET_CONN;
+  struct uring *u = conn->uring;
+  char *buf = vbuf;
+  bool first_read = true;
+  size_t n;
+  int r;
+
+  while (len > 0) {
+    if (u->rpos == u->rlen) {
+      const bool direct = !u->recv_pending && len >= DIRECT_RECV_MIN;
+
+      if (direct)
+        r = read_direct (u, buf, len);
+      else {
+        if (!u->recv_pending && post_read (u) == -1)
+          return -1;
+        r = wait_read (u);
+      }
+      if (r == -1) {
+        if (errno == EINTR || errno == EAGAIN)
+          continue;
+        return -1;
+      }
+      if (r == 0) {
+        if (first_read)
+          return 0;
+        /* Partial record read.  This is an error. */
+        errno = EBADMSG;
+        return -1;
+      }
+      if (direct) {
+        buf += r;
+        len -= r;
+        first_read = false;
+        continue;
+      }
+    }
+
+    n = MIN (len, u->rlen - u->rpos);
+    memcpy (buf, &u->rbuf[u->rpos], n);
+    u->rpos += n;
+    buf += n;
+    len -= n;
+    first_read = false;
+  }
+
+  /* Read ahead while the request we have just read is processed. */
+  if (u->rpos == u->rlen && !u->recv_pending && post_read (u) == -1)
+    return -1;
+
+  return 1;
+}
+
+/* Write a list of buffers to the connection and either succeed
+ * completely (returns 0) or fail (returns -1).  flags may include
+ * SEND_MORE as a hint that this send will be followed by related data.
+ */
+static int
+uring_sendv (const struct iovec *iov, int iovcnt, int flags)
+{
+  GET_CONN;
+  struct uring *u = conn->uring;
+  struct iovec copy[SENDV_MAX_IOV], *p = copy;
+  struct msghdr msg = { 0 };
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  int i, n, r;
+  size_t done;
+
+  assert (iovcnt <= SENDV_MAX_IOV);
+  for (i = n = 0; i < iovcnt; ++i)
+    if (iov[i].iov_len > 0)
+      copy[n++] = iov[i];
+
+  while (n > 0) {
+    msg.msg_iov = p;
+    msg.msg_iovlen = n;
+    sqe = io_uring_get_sqe (&u->send_ring);
+    assert (sqe != NULL);
+    io_uring_prep_sendmsg (sqe, 0, &msg,
+                           flags & SEND_MORE ? MSG_MORE : 0);
+    sqe->flags |= IOSQE_FIXED_FILE;
+
+    /* If the wait was interrupted the send has still been submitted,
+     * so we must wait for it below.
+     */
+    r = io_uring_submit_and_wait (&u->send_ring, 1);
+    if (r < 0 && r != -EINTR) {
+      errno = -r;
+      return -1;
+    }
+    do
+      r = io_uring_wait_cqe (&u->send_ring, &cqe);
+    while (r == -EINTR);
+    if (r < 0) {
+      errno = -r;
+      return -1;
+    }
+    r = cqe->res;
+    io_uring_cqe_seen (&u->send_ring, cqe);
+    if (r < 0) {
+      if (r == -EINTR || r == -EAGAIN)
+        continue;
+      errno = -r;
+      return -1;
+    }
+
+    /* Skip over what was sent after a short write. */
+    done = r;
+    while (n > 0 && done >= p->iov_len) {
+      done -= p->iov_len;
+      p++;
+      n--;
+    }
+    if (done > 0) {
+      p->iov_base = (char *) p->iov_base + done;
+      p->iov_len -= done;
+    }
+  }
+
+  return 0;
+}
+
+static int
+uring_send (const void *buf, size_t len, int flags)
+{
+  struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+
+  return uring_sendv (&iov, 1, flags);
+}
+
+/* Switch the current connection to io_uring.  This must be called
+ * after the handshake (so that nothing is read ahead which STARTTLS
+ * would need) and before any worker threads are started.  On failure
+ * the connection carries on using the ordinary functions.
+ */
+int
+uring_setup (void)
+{
+  GET_CONN;
+  struct uring *u;
+  struct iovec iov;
+  int r;
+
+  u = calloc (1, sizeof *u);
+  if (u == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  u->rbuf = malloc (RBUF_SIZE);
+  if (u->rbuf == NULL) {
+    nbdkit_error ("malloc: %m");
+    free (u);
+    return -1;
+  }
+
+  r = io_uring_queue_init (2, &u->recv_ring, 0);
+  if (r < 0)
+    goto err0;
+  r = io_uring_queue_init (2, &u->send_ring, 0);
+  if (r < 0)
+    goto err1;
+  r = io_uring_register_files (&u->recv_ring, &conn->sockin, 1);
+  if (r < 0)
+    goto err2;
+  r = io_uring_register_files (&u->send_ring, &conn->sockout, 1);
+  if (r < 0)
+    goto err2;
+  iov.iov_base = u->rbuf;
+  iov.iov_len = RBUF_SIZE;
+  r = io_uring_register_buffers (&u->recv_ring, &iov, 1);
+  if (r < 0)
+    goto err2;
+
+  conn->uring = u;
+  conn->recv = uring_recv;
+  conn->send = uring_send;
+  conn->sendv = uring_sendv;
+  conn->sendfile = NULL;
+  debug ("using io_uring for connection I/O");
+  return 0;
+
+ err2:
+  io_uring_queue_exit (&u->send_ring);
+ err1:
+  io_uring_queue_exit (&u->recv_ring);
+ err0:
+  /* This is common when io_uring is disabled by the kernel or a
+   * seccomp policy, so it is not an error.
+   */
+  errno = -r;
+  debug ("io_uring not available, using ordinary socket I/O: %m");
+  free (u->rbuf);
+  free (u);
+  return -1;
+}
+
+/* Free the rings and the receive buffer.  This must be called before
+ * the socket is closed: the registered file holds its own reference
+ * to the socket, so closing it would not wake up a pending read, and
+ * the kernel may still write into the receive buffer until that read
+ * has completed.
+ */
+void
+uring_free (struct connection *conn)
+{
+  struct uring *u = conn->uring;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  int r;
+
+  if (u == NULL)
+    return;
+
+  if (conn->sockin >= 0)
+    shutdown (conn->sockin, SHUT_RDWR);
+
+  if (u->recv_pending) {
+    sqe = io_uring_get_sqe (&u->recv_ring);
+    if (sqe != NULL) {
+      io_uring_prep_cancel (sqe, u, 0);
+      io_uring_sqe_set_data (sqe, NULL);
+      io_uring_submit (&u->recv_ring);
+    }
+    while (u->recv_pending) {
+      r = io_uring_wait_cqe (&u->recv_ring, &cqe);
+      if (r == -EINTR)
+        continue;
+      if (r < 0)
+        break;
+      if (io_uring_cqe_get_data (cqe) == u)
+        u->recv_pending = false;
+      io_uring_cqe_seen (&u->recv_ring, cqe);
+    }
+  }
+
+  io_uring_unregister_buffers (&u->recv_ring);
+  io_uring_unregister_files (&u->recv_ring);
+  io_uring_unregister_files (&u->send_ring);
+  io_uring_queue_exit (&u->recv_ring);
+  io_uring_queue_exit (&u->send_ring);
+
+  /* If the read could not be reaped the buffer may still be written
+   * to, so leak it rather than risk a use after free.
+   */
+  if (!u->recv_pending)
+    free (u->rbuf);
+  free (u);
+  conn->uring = NULL;
+}
+
+#else /* !HAVE_LIBURING */
+
+int
+uring_setup (void)
+{
+  debug ("nbdkit was compiled without io_uring support, "
+         "using ordinary socket I/O");
+  return -1;
+}
+
+void
+uring_free (struct connection *conn)
+{
+  /* nothing */
+}
+
+#endif /* !HAVE_LIBURING */
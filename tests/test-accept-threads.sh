@@ -0,0 +1,81 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test --accept-threads, over TCP/IP (one SO_REUSEPORT listening
+# socket per thread) and over a Unix domain socket (threads share the
+# listening socket).  Open many connections at the same time so that
+# the connection thread pool has to grow.
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+if is_windows; then
+    echo "$0: --accept-threads is not supported on Windows"
+    exit 77
+fi
+
+requires_run
+requires_nbdsh_uri
+requires_plugin memory
+
+files="accept-threads.pid"
+rm -f $files
+cleanup_fn rm -f $files
+
+script='
+conns = []
+for i in range(32):
+    h2 = nbd.NBD()
+    h2.connect_uri(uri)
+    conns.append(h2)
+for i, h2 in enumerate(conns):
+    h2.pwrite(bytes([i]) * 512, i * 512)
+for i, h2 in enumerate(conns):
+    assert h2.pread(512, i * 512) == bytes([i]) * 512
+    h2.shutdown()
+'
+
+# Unix domain socket.
+for n in 1 4; do
+    nbdkit --accept-threads=$n memory 1M \
+           --run "nbdsh -u \"\$uri\" -c '$script'"
+done
+
+# TCP/IP on the loopback interface.
+pick_unused_port
+start_nbdkit -P accept-threads.pid -i 127.0.0.1 -p $port \
+             --accept-threads=4 memory 1M
+nbdsh -u "nbd://127.0.0.1:$port" -c "uri = 'nbd://127.0.0.1:$port'" \
+      -c "$script"
@@ -0,0 +1,211 @@
+/* nbdkit
+ * Copyright Red Hat
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test plugin for the asynchronous .aio_pread and .aio_pwrite
+ * callbacks.  Requests are queued and completed by a background
+ * thread in last-in first-out order, so that replies are sent back to
+ * the client out of order.  Requests touching the final 4K of the
+ * disk fail with EIO.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define NBDKIT_API_VERSION 2
+#include <nbdkit-plugin.h>
+
+#define SIZE (1024*1024)
+#define BAD_OFFSET (SIZE - 4096)
+
+static char disk[SIZE];
+
+struct aio_op {
+  struct aio_op *next;
+  bool is_write;
+  void *rbuf;
+  const void *wbuf;
+  uint32_t count;
+  uint64_t offset;
+  struct nbdkit_request *req;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct aio_op *queue;
+
+static void *
+completion_thread (void *vp)
+{
+  struct aio_op *op;
+  int err;
+
+  for (;;) {
+    pthread_mutex_lock (&lock);
+    while (queue == NULL)
+      pthread_cond_wait (&cond, &lock);
+    op = queue;
+    queue = op->next;
+    pthread_mutex_unlock (&lock);
+
+    /* Give the server a chance to queue up more requests. */
+    nbdkit_nanosleep (0, 1000000);
+
+    err = 0;
+    if (op->offset + op->count > BAD_OFFSET)
+      err = EIO;
+    else if (op->is_write)
+      memcpy (&disk[op->offset], op->wbuf, op->count);
+    else
+      memcpy (op->rbuf, &disk[op->offset], op->count);
+    nbdkit_request_complete (op->req, err);
+    free (op);
+  }
+
+  /*NOTREACHED*/
+  return NULL;
+}
+
+static int
+aio_after_fork (void)
+{
+  pthread_t thread;
+  int err;
+
+  err = pthread_create (&thread, NULL, completion_thread, NULL);
+  if (err) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+  return 0;
+}
+
+static void *
+aio_open (int readonly)
+{
+  return NBDKIT_HANDLE_NOT_NEEDED;
+}
+
+static int64_t
+aio_get_size (void *handle)
+{
+  return SIZE;
+}
+
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+
+static int
+aio_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+           uint32_t flags)
+{
+  nbdkit_error ("synchronous pread should not be called");
+  errno = EINVAL;
+  return -1;
+}
+
+static int
+aio_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
+            uint32_t flags)
+{
+  nbdkit_error ("synchronous pwrite should not be called");
+  errno = EINVAL;
+  return -1;
+}
+
+static int
+queue_op (struct aio_op *op)
+{
+  pthread_mutex_lock (&lock);
+  op->next = queue;
+  queue = op;
+  pthread_cond_signal (&cond);
+  pthread_mutex_unlock (&lock);
+  return 0;
+}
+
+static int
+aio_aio_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+               uint32_t flags, struct nbdkit_request *req)
+{
+  struct aio_op *op;
+
+  op = calloc (1, sizeof *op);
+  if (op == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  op->rbuf = buf;
+  op->count = count;
+  op->offset = offset;
+  op->req = req;
+  return queue_op (op);
+}
+
+static int
+aio_aio_pwrite (void *handle, const void *buf, uint32_t count,
+                uint64_t offset, uint32_t flags, struct nbdkit_request *req)
+{
+  struct aio_op *op;
+
+  op = calloc (1, sizeof *op);
+  if (op == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  op->is_write = true;
+  op->wbuf = buf;
+  op->count = count;
+  op->offset = offset;
+  op->req = req;
+  return queue_op (op);
+}
+
+static struct nbdkit_plugin plugin = {
+  .name              = "aio",
+  .version           = PACKAGE_VERSION,
+  .after_fork        = aio_after_fork,
+  .open              = aio_open,
+  .get_size          = aio_get_size,
+  .pread             = aio_pread,
+  .pwrite            = aio_pwrite,
+  .aio_pread         = aio_aio_pread,
+  .aio_pwrite        = aio_aio_pwrite,
+};
+
+NBDKIT_REGISTER_PLUGIN (plugin)
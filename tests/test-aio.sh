@@ -0,0 +1,91 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the asynchronous .aio_pread and .aio_pwrite plugin callbacks.
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+requires_nbdsh_uri
+
+plugin=.libs/test-aio-plugin.$SOEXT
+requires test -f $plugin
+
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="aio.pid $sock"
+rm -f $files
+cleanup_fn rm -f $files
+
+start_nbdkit -P aio.pid -U $sock $plugin
+
+nbdsh -u "nbd+unix:///?socket=$sock" -c '
+import errno
+
+# Issue many writes in parallel.  The plugin completes them in
+# reverse order.
+bufs = [nbd.Buffer.from_bytearray(bytearray([i] * 4096))
+        for i in range(1, 33)]
+for i in range(32):
+    h.aio_pwrite(bufs[i], i * 4096)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+    while h.aio_peek_command_completed():
+        h.aio_command_completed(h.aio_peek_command_completed())
+
+# Read them back in parallel.
+rbufs = [nbd.Buffer(4096) for i in range(32)]
+for i in range(32):
+    h.aio_pread(rbufs[i], i * 4096)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+    while h.aio_peek_command_completed():
+        h.aio_command_completed(h.aio_peek_command_completed())
+for i in range(32):
+    assert rbufs[i].to_bytearray() == bytearray([i+1] * 4096)
+
+# Synchronous read spanning several writes.
+assert h.pread(8192, 4096*3) == bytearray([4] * 4096) + bytearray([5] * 4096)
+
+# Errors are reported through nbdkit_request_complete.
+try:
+    h.pread(512, h.get_size() - 512)
+    assert False
+except nbd.Error as ex:
+    assert ex.errnum == errno.EIO
+try:
+    h.pwrite(bytearray(512), h.get_size() - 512)
+    assert False
+except nbd.Error as ex:
+    assert ex.errnum == errno.EIO
+'
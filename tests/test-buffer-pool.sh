@@ -0,0 +1,63 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the shared request buffer pool.  Buffers are reused across
+# requests and connections, so check that reads never return data
+# belonging to an earlier request, and that --buffer-pool=0 (no idle
+# buffers kept) also works.
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+requires_run
+requires_nbdsh_uri
+requires_plugin memory
+
+for pool in 0 1M 64M; do
+    nbdkit --buffer-pool=$pool memory 16M --run 'nbdsh -u "$uri" -c - <<\EOF
+for size in (512, 4096, 65536, 1024*1024, 4*1024*1024):
+    h.pwrite(b"x" * size, 0)
+    assert h.pread(size, 0) == b"x" * size
+    # The tail of the disk is sparse and must read as zeroes even
+    # though the buffer was last filled with "x".
+    assert h.pread(size, 8*1024*1024) == bytearray(size)
+
+# A second connection reusing the buffers of the first.
+h2 = nbd.NBD()
+h2.connect_uri(uri)
+assert h2.pread(4096, 8*1024*1024) == bytearray(4096)
+h2.shutdown()
+EOF
+'
+done
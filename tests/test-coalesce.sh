@@ -0,0 +1,75 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test --coalesce.  Adjacent requests which are queued behind a slow
+# request should reach the plugin as a single vectored read or write.
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+requires_run
+requires_filter delay
+requires_plugin memory
+requires_nbdsh_uri
+
+log=test-coalesce.out
+rm -f $log
+cleanup_fn rm -f $log
+
+# The delay filter holds up the worker threads so that later requests
+# pile up in the queue.  Each request is checked for the right data
+# afterwards.
+nbdkit -v -t 2 --coalesce=1M \
+       --filter=delay memory 1M rdelay=100ms wdelay=100ms \
+       --run 'nbdsh -u "$uri" -c - <<\EOF
+for i in range(32):
+    h.aio_pwrite(bytes([i]) * 4096, i * 4096)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+
+bufs = []
+for i in range(32):
+    buf = nbd.Buffer(4096)
+    h.aio_pread(buf, i * 4096)
+    bufs.append(buf)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+for i, buf in enumerate(bufs):
+    assert buf.to_bytearray() == bytes([i]) * 4096
+EOF
+' 2>$log
+
+# Check that some requests were combined.
+grep "delay: pwritev .* iovcnt=" $log
+grep "delay: preadv .* iovcnt=" $log
@@ -0,0 +1,79 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test --cpu-affinity.  We cannot assume that the machine has more
+# than one CPU or NUMA node, so this mostly tests parsing the option
+# and that connections work when pinned.
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+requires test "$(uname)" = "Linux"
+requires_run
+requires_plugin memory
+
+# Invalid CPU lists.
+for bad in "" "x" "1-0" "0," "0-" "-1" "100000"; do
+    if nbdkit --cpu-affinity="$bad" memory 1M --run true; then
+        echo "$0: expected --cpu-affinity=$bad to fail"
+        exit 1
+    fi
+done
+
+requires_nbdsh_uri
+
+# With "0:0" there are two groups on CPU 0, so connections alternate
+# between them and the second connection uses the second group's
+# buffers.
+specs="0 0:0 0,0-0:0"
+if test -d /sys/devices/system/node/node0; then
+    specs="$specs numa"
+fi
+for spec in $specs; do
+    for io in 0 2; do
+        nbdkit --cpu-affinity=$spec --io-threads=$io memory 16M \
+               --run 'nbdsh -u "$uri" -c - <<\EOF
+h.pwrite(b"x" * 65536, 0)
+assert h.pread(65536, 0) == b"x" * 65536
+
+h2 = nbd.NBD()
+h2.connect_uri(uri)
+assert h2.pread(65536, 0) == b"x" * 65536
+assert h2.pread(65536, 8*1024*1024) == bytearray(65536)
+h2.shutdown()
+EOF
+'
+    done
+done
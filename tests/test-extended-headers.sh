@@ -0,0 +1,80 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test NBD extended headers (64 bit requests and replies).
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+requires_run
+requires_nbdsh_uri
+requires_libnbd_version 1.20
+requires_plugin memory
+
+# libnbd >= 1.20 requests extended headers by default.
+nbdkit memory 16G --run 'nbdsh --base -u "$uri" -c - <<\EOF
+assert h.get_extended_headers_negotiated() is True
+assert h.get_structured_replies_negotiated() is True
+size = h.get_size()
+assert size == 16 * 1024**3
+
+h.pwrite(b"x" * 512, 8 * 1024**3)
+assert h.pread(512, 8 * 1024**3) == b"x" * 512
+
+# A single zero request larger than 4G.
+h.zero(size, 0)
+assert h.pread(512, 8 * 1024**3) == bytearray(512)
+
+# Block status of the whole disk in a single request.  The disk has
+# just been zeroed, so every extent should be a hole reading as zero.
+entries = []
+def f(metacontext, offset, e, err):
+    assert metacontext == nbd.CONTEXT_BASE_ALLOCATION
+    assert offset == 0
+    entries.extend(e)
+h.block_status_64(size, 0, f)
+assert sum(length for length, flags in entries) == size
+for length, flags in entries:
+    assert flags == nbd.STATE_HOLE | nbd.STATE_ZERO
+
+h.trim(size, 0)
+EOF
+'
+
+# Extended headers imply structured replies, so --no-sr disables both.
+nbdkit --no-sr memory 1M --run 'nbdsh --base -u "$uri" -c - <<\EOF
+assert h.get_extended_headers_negotiated() is False
+assert h.get_structured_replies_negotiated() is False
+EOF
+'
@@ -0,0 +1,96 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test --extents-cache.  Check that repeated block status requests are
+# answered from the cache, and that a write makes nbdkit ask the
+# plugin again.
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+requires_run
+requires_plugin eval
+requires_nbdsh_uri
+requires nbdsh --base-allocation --version
+
+files="extents-cache.calls extents-cache.written"
+rm -f $files
+cleanup_fn rm -f $files
+touch extents-cache.calls
+
+define script <<'EOF'
+entries = []
+def f(context, offset, extents, status):
+    entries.append(extents)
+
+def calls():
+    with open("extents-cache.calls") as fp:
+        return len(fp.readlines())
+
+h.block_status(1048576, 0, f)
+assert entries.pop() == [1048576, 3]
+assert calls() == 1
+
+# These are answered from the cache.
+h.block_status(1048576, 0, f)
+assert entries.pop() == [1048576, 3]
+h.block_status(8192, 4096, f)
+assert entries.pop() == [1044480, 3]
+assert calls() == 1
+
+# A write invalidates the cache.
+h.pwrite(bytearray(512), 0)
+h.block_status(1048576, 0, f)
+assert entries.pop() == [1048576, 0]
+assert calls() == 2
+h.block_status(1048576, 0, f)
+assert entries.pop() == [1048576, 0]
+assert calls() == 2
+EOF
+export script
+
+# The plugin reports a hole until something is written, and records
+# each call to .extents.
+nbdkit -U - --extents-cache eval \
+       get_size='echo 1M' \
+       pread='dd if=/dev/zero count=$3 iflag=count_bytes' \
+       pwrite='cat >/dev/null; touch '"$PWD/extents-cache.written" \
+       extents='echo >> '"$PWD/extents-cache.calls"'
+                if [ -f '"$PWD/extents-cache.written"' ]; then
+                    echo 0 1M 0
+                else
+                    echo 0 1M 3
+                fi' \
+       --run 'nbdsh --base-allocation --uri "$uri" -c "$script"'
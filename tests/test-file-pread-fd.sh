@@ -0,0 +1,87 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test reads from the file plugin, which are sent to the client with
+# sendfile(2) where possible (see .pread_fd).
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+requires_run
+requires_nbdsh_uri
+requires dd --version
+
+file=file-pread-fd.img
+export file
+rm -f $file
+cleanup_fn rm -f $file
+
+dd if=/dev/urandom of=$file bs=1M count=3
+truncate -s 4M $file
+
+# Structured replies, and then simple replies.
+for opt in "" "--no-sr"; do
+    nbdkit $opt file $file --run 'nbdsh -u "$uri" -c - <<\EOF
+import os
+with open(os.environ["file"], "rb") as fp:
+    data = fp.read()
+for offset, count in [(0, 4096), (12345, 100000),
+                      (3 * 1024 * 1024 - 10, 20000), (0, len(data))]:
+    assert h.pread(count, offset) == data[offset:offset+count]
+EOF
+'
+done
+
+# Ranges covering a hole in the file must still be sent as holes.
+nbdkit file $file --run 'nbdsh -u "$uri" -c - <<\EOF
+import os
+assert h.get_structured_replies_negotiated() is True
+with open(os.environ["file"], "rb") as fp:
+    data = fp.read()
+    sparse = os.lseek(fp.fileno(), 0, os.SEEK_HOLE) < len(data)
+
+chunks = []
+def f(buf, offset, status, err):
+    chunks.append((status, offset, len(buf)))
+
+offset = 3 * 1024 * 1024 - 4096
+buf = h.pread_structured(65536, offset, f)
+assert buf == data[offset:offset+65536]
+if sparse:
+    assert chunks == [
+        (nbd.READ_DATA, offset, 4096),
+        (nbd.READ_HOLE, offset + 4096, 61440),
+    ], chunks
+EOF
+'
@@ -0,0 +1,69 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test unaligned reads through the blocksize filter, which reads each
+# request with a single call to .preadv in the file plugin, and
+# through the offset filter, which passes the list of buffers through.
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+requires_run
+requires_nbdsh_uri
+requires_filter blocksize
+requires_filter offset
+requires dd --version
+
+files="file-preadv.img file-preadv.log"
+rm -f $files
+cleanup_fn rm -f $files
+
+file=file-preadv.img
+export file
+dd if=/dev/urandom of=$file bs=1M count=4
+
+nbdkit -v --filter=blocksize --filter=offset file $file \
+       minblock=4096 offset=8192 \
+       --run 'nbdsh -u "$uri" -c - <<\EOF
+import os
+with open(os.environ["file"], "rb") as fp:
+    data = fp.read()[8192:]
+for offset, count in [(1, 100), (4095, 2), (12345, 100000), (8192, 8000),
+                      (len(data) - 10, 10)]:
+    assert h.pread(count, offset) == data[offset:offset+count]
+EOF
+' 2>file-preadv.log || { cat file-preadv.log; exit 1; }
+
+grep "offset: preadv" file-preadv.log
+grep "file: preadv" file-preadv.log
@@ -0,0 +1,70 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test --handle-pool.  Wait until the pool has opened its handles,
+# then check that connections use them, that the pool is refilled,
+# and that the unused handles are closed on exit.
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+requires_run
+requires_nbdsh_uri
+requires_plugin eval
+
+files="handle-pool.opens handle-pool.closes handle-pool.log"
+rm -f $files
+cleanup_fn rm -f $files
+touch handle-pool.opens handle-pool.closes
+
+nbdkit -v -U - -e foo --handle-pool=2 eval \
+       open='echo "$3" >> '"$PWD/handle-pool.opens"'; echo handle' \
+       close='echo >> '"$PWD/handle-pool.closes" \
+       get_size='echo 1M' \
+       pread='head -c $3 /dev/zero' \
+       --run '
+    while [ "$(wc -l < handle-pool.opens)" -lt 2 ]; do sleep 0.1; done
+    for i in 1 2 3; do
+        nbdsh -u "$uri" -c "assert h.pread(512, 0) == bytearray(512)"
+    done
+' 2>handle-pool.log || { cat handle-pool.log; exit 1; }
+
+cat handle-pool.log | grep "handle pool"
+
+# Every handle was opened for the -e export, including by the pool.
+test "$(sort -u handle-pool.opens)" = "foo"
+grep "using pre-opened handle" handle-pool.log
+
+# Handles opened by the pool but never used are closed as well.
+test "$(wc -l < handle-pool.opens)" -eq "$(wc -l < handle-pool.closes)"
@@ -0,0 +1,71 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the --io-threads option (connections multiplexed over a small
+# pool of I/O threads using epoll).
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+requires_run
+requires_nbdsh_uri
+requires_plugin memory
+
+# More connections than I/O threads, each with requests in flight.
+nbdkit --io-threads=2 memory 64M --run 'nbdsh -c - <<\EOF
+import os
+uri = os.environ["uri"]
+hs = []
+for c in range(8):
+    h = nbd.NBD()
+    h.connect_uri(uri)
+    hs.append(h)
+
+for c, h in enumerate(hs):
+    for i in range(32):
+        h.aio_pwrite(bytes([c]) * 4096, (c * 32 + i) * 4096)
+for h in hs:
+    while h.aio_in_flight() > 0:
+        h.poll(-1)
+
+for c, h in enumerate(hs):
+    for i in range(32):
+        assert h.pread(4096, (c * 32 + i) * 4096) == bytes([c]) * 4096
+
+# Idle connections must not stop other connections being served.
+assert hs[0].pread(512, 0) == bytes([0]) * 512
+for h in hs:
+    h.shutdown()
+EOF
+'
@@ -0,0 +1,66 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the --io-uring option.  If io_uring is not available this
+# still tests that nbdkit falls back to ordinary socket I/O.
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+requires_run
+requires_nbdsh_uri
+requires_plugin memory
+
+nbdkit --io-uring memory 64M --run 'nbdsh -u "$uri" -c - <<\EOF
+# Many small requests in flight at once, so that several are read
+# from the socket together.
+bufs = []
+for i in range(256):
+    h.aio_pwrite(bytes([i % 256]) * 4096, i * 4096)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+for i in range(256):
+    buf = nbd.Buffer(4096)
+    bufs.append((i, buf, h.aio_pread(buf, i * 4096)))
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+for i, buf, cookie in bufs:
+    assert h.aio_command_completed(cookie)
+    assert buf.to_bytearray() == bytes([i % 256]) * 4096
+
+# A large write which does not fit in the receive buffer.
+h.pwrite(b"x" * (4 * 1024 * 1024), 8 * 1024 * 1024)
+assert h.pread(4 * 1024 * 1024, 8 * 1024 * 1024) == b"x" * (4 * 1024 * 1024)
+EOF
+'
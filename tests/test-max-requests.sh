@@ -0,0 +1,80 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test --max-requests and --request-weight.  A connection to the
+# heavier weighted export should not have to wait behind all the
+# requests queued by a bulk client.
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+requires_run
+requires_filter delay
+requires_plugin memory
+requires nbdsh --version
+
+log=test-max-requests.out
+rm -f $log
+cleanup_fn rm -f $log
+
+nbdkit -v -t 16 --max-requests=1 --request-weight=boot=4 \
+       --filter=delay memory 1M rdelay=100ms \
+       --run 'nbdsh -c - <<\EOF
+import os
+import time
+sock = os.environ["unixsocket"]
+bulk = nbd.NBD()
+bulk.set_export_name("bulk")
+bulk.connect_unix(sock)
+boot = nbd.NBD()
+boot.set_export_name("boot")
+boot.connect_unix(sock)
+
+# Queue 16 reads on the bulk connection.  Each takes 100ms, so
+# serving them all first would take 1.6s.
+for i in range(16):
+    bulk.aio_pread(nbd.Buffer(4096), i * 4096)
+
+# The boot connection should be served before most of them.
+start = time.monotonic()
+boot.pread(4096, 0)
+assert time.monotonic() - start < 0.8
+
+while bulk.aio_in_flight() > 0:
+    bulk.poll(-1)
+EOF
+' 2>$log
+
+grep "scheduler: export \"boot\" has weight 4" $log
+grep "scheduler: 17 requests" $log
@@ -0,0 +1,71 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that writes received directly into the memory plugin's
+# allocator (.pwrite_payload) store the right data, including writes
+# which span several pages and writes to unallocated pages.
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+requires_nbdsh_uri
+requires_run
+
+define script <<'EOF'
+import os
+size = h.get_size()
+ref = bytearray(size)
+for offset, count in [(0, 512), (32768 - 10, 20), (12345, 100000),
+                      (1000000, 3 * 1024 * 1024), (size - 1, 1)]:
+    buf = os.urandom(count)
+    ref[offset:offset+count] = buf
+    h.pwrite(buf, offset)
+
+# Many writes in flight at once.
+bufs = [nbd.Buffer.from_bytearray(bytearray([i] * 8192))
+        for i in range(64)]
+for i in range(64):
+    ref[i*8192 + 5000000:i*8192 + 5008192] = bytes([i]) * 8192
+    h.aio_pwrite(bufs[i], i*8192 + 5000000)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+
+assert h.pread(size, 0) == ref
+EOF
+export script
+
+for allocator in sparse malloc; do
+    nbdkit memory 8M allocator=$allocator \
+           --run ' nbdsh -u "$uri" -c "$script" '
+done
@@ -0,0 +1,74 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test --metrics.
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+requires_run
+requires_nbdsh_uri
+requires_plugin memory
+
+out=test-metrics.prom
+rm -f $out
+cleanup_fn rm -f $out $out.tmp
+
+nbdkit --metrics=$out memory 1M --run 'nbdsh -u "$uri" -c - <<\EOF
+for i in range(10):
+    h.pwrite(b"x" * 4096, i * 4096)
+for i in range(20):
+    h.pread(512, 0)
+h.flush()
+# Send an out of range read to the server so that it fails there.
+h.set_strict_mode(h.get_strict_mode() & ~nbd.STRICT_BOUNDS)
+try:
+    h.pread(512, 2*1024*1024)
+except nbd.Error:
+    pass
+EOF
+'
+
+# The metrics file is written when nbdkit exits.
+cat $out
+grep '^nbdkit_connections_total{export=""} 1$' $out
+grep '^nbdkit_connections{export=""} 0$' $out
+grep '^nbdkit_requests_total{export="",op="write"} 10$' $out
+grep '^nbdkit_requests_total{export="",op="read"} 21$' $out
+grep '^nbdkit_requests_total{export="",op="flush"} 1$' $out
+grep '^nbdkit_request_errors_total{export="",op="read"} 1$' $out
+grep '^nbdkit_request_bytes_total{export="",op="write"} 40960$' $out
+grep '^nbdkit_request_bytes_total{export="",op="read"} 10240$' $out
+grep '^nbdkit_request_duration_seconds_count{export="",op="read"} 21$' $out
+grep '^nbdkit_request_duration_seconds{export="",op="read",quantile="0.99"} ' $out
@@ -134,6 +134,18 @@ wrote 512/512 bytes at offset 512"; then
   exit 1
 fi
 
+# With --ordered-replies, the read still runs in parallel but its
+# reply is held back until the earlier write has been answered
+nbdkit -v --ordered-replies --filter=delay sh test-parallel-sh.script \
+  wdelay=2 rdelay=1 --run 'timeout 60s </dev/null qemu-io -f raw \
+    -c "aio_write -P 2 512 512" -c "aio_read -P 1 0 512" -c aio_flush "$uri"' |
+    tee test-parallel-sh.out
+if test "$(grep '512/512' test-parallel-sh.out)" != \
+"wrote 512/512 bytes at offset 512
+read 512/512 bytes at offset 0"; then
+  exit 1
+fi
+
 # With --filter=noparallel, the write should complete first because it was
 # issued first. Also test that the log filter doesn't leak an fd
 nbdkit -v --filter=noparallel --filter=log --filter=delay \
@@ -0,0 +1,83 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that zero runs in read replies are sent as holes.
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+requires_run
+requires_nbdsh_uri
+requires_plugin data
+
+nbdkit data '@4096 1 @12288 1 2 3 @32768 1' size=64K \
+       --run 'nbdsh -u "$uri" -c - <<\EOF
+assert h.get_structured_replies_negotiated() is True
+
+chunks = []
+def f(buf, offset, status, err):
+    chunks.append((status, offset, len(buf)))
+
+buf = h.pread_structured(65536, 0, f)
+assert buf[4096] == 1
+assert buf[12288:12291] == b"\x01\x02\x03"
+assert buf[32768] == 1
+assert chunks == [
+    (nbd.READ_HOLE, 0, 4096),
+    (nbd.READ_DATA, 4096, 4096),
+    (nbd.READ_HOLE, 8192, 4096),
+    (nbd.READ_DATA, 12288, 4096),
+    (nbd.READ_HOLE, 16384, 16384),
+    (nbd.READ_DATA, 32768, 4096),
+    (nbd.READ_HOLE, 36864, 28672),
+], chunks
+
+# Unaligned requests: holes shorter than 4K only at the ends.
+chunks = []
+h.pread_structured(10000, 100, f)
+assert chunks == [
+    (nbd.READ_HOLE, 100, 3996),
+    (nbd.READ_DATA, 4096, 4096),
+    (nbd.READ_HOLE, 8192, 1908),
+], chunks
+
+# With NBD_CMD_FLAG_DF the reply must be a single chunk.
+chunks = []
+h.pread_structured(65536, 0, f, nbd.CMD_FLAG_DF)
+assert chunks == [(nbd.READ_DATA, 0, 65536)], chunks
+chunks = []
+h.pread_structured(8192, 49152, f, nbd.CMD_FLAG_DF)
+assert chunks == [(nbd.READ_HOLE, 49152, 8192)], chunks
+EOF
+'
@@ -0,0 +1,137 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test TLS session resumption with --tls-tickets.  Python's ssl module
+# is used as the client because it can save and reuse the session.
+
+source ./functions.sh
+set -e
+set -x
+set -u
+
+requires_run
+requires python3 --version
+
+# Does the nbdkit binary support TLS?
+if ! nbdkit --dump-config | grep -sq tls=yes; then
+    echo "$0: nbdkit built without TLS support"
+    exit 77
+fi
+
+# Did we create the PKI files?
+# Probably 'certtool' is missing.
+pkidir="$PWD/pki"
+if [ ! -f "$pkidir/ca-cert.pem" ]; then
+    echo "$0: PKI files were not created by the test harness"
+    exit 77
+fi
+
+files="tls-tickets.py tls-tickets.key tls-tickets.out"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Connect twice, upgrading to TLS with NBD_OPT_STARTTLS and then
+# ending the handshake with NBD_OPT_ABORT.  The second connection
+# offers the session saved from the first.  Prints whether each
+# session was resumed.
+cat > tls-tickets.py <<'EOF'
+import os, socket, ssl, struct, sys
+from urllib.parse import urlparse, parse_qs
+
+uri = urlparse(sys.argv[1])
+path = parse_qs(uri.query)["socket"][0]
+ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+ctx.load_verify_locations(os.environ["pkidir"] + "/ca-cert.pem")
+ctx.check_hostname = False
+
+def recvall(s, n):
+    buf = b""
+    while len(buf) < n:
+        b = s.recv(n - len(buf))
+        assert b, "unexpected EOF"
+        buf += b
+    return buf
+
+def option(s, opt):
+    s.sendall(b"IHAVEOPT" + struct.pack(">II", opt, 0))
+    magic, ropt, rtype, rlen = struct.unpack(">QIII", recvall(s, 20))
+    assert magic == 0x3e889045565a9 and ropt == opt, (magic, ropt)
+    recvall(s, rlen)
+    return rtype
+
+def connect(session):
+    s = socket.socket(socket.AF_UNIX)
+    s.connect(path)
+    assert recvall(s, 16) == b"NBDMAGICIHAVEOPT"
+    recvall(s, 2)
+    s.sendall(struct.pack(">I", 3))     # FIXED_NEWSTYLE | NO_ZEROES
+    assert option(s, 5) == 1            # NBD_OPT_STARTTLS -> ACK
+    t = ctx.wrap_socket(s, session=session)
+    # Tickets are sent after the handshake, so read something.
+    option(t, 2)                        # NBD_OPT_ABORT
+    print("resumed" if t.session_reused else "full")
+    session = t.session
+    t.close()
+    return session
+
+session = connect(None)
+connect(session)
+EOF
+
+export pkidir
+nbdkit --tls=require --tls-certificates="$pkidir" --tls-tickets=60 \
+       null --run 'python3 tls-tickets.py "$uri"' > tls-tickets.out
+cat tls-tickets.out
+test "$(cat tls-tickets.out)" = "full
+resumed"
+
+# Without --tls-tickets sessions are not resumed.
+nbdkit --tls=require --tls-certificates="$pkidir" \
+       null --run 'python3 tls-tickets.py "$uri"' > tls-tickets.out
+cat tls-tickets.out
+test "$(cat tls-tickets.out)" = "full
+full"
+
+# The key must be exactly 64 bytes.
+head -c 63 /dev/urandom > tls-tickets.key
+if nbdkit --tls=require --tls-certificates="$pkidir" --tls-tickets=60 \
+          --tls-ticket-key=tls-tickets.key null --run 'exit 0'; then
+    echo "$0: expected short key to be rejected"
+    exit 1
+fi
+head -c 64 /dev/urandom > tls-tickets.key
+nbdkit --tls=require --tls-certificates="$pkidir" --tls-tickets=60 \
+       --tls-ticket-key=tls-tickets.key \
+       null --run 'python3 tls-tickets.py "$uri"' > tls-tickets.out
+cat tls-tickets.out
+test "$(cat tls-tickets.out)" = "full
+resumed"
@@ -0,0 +1,70 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright Red Hat
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that worker threads are only started when needed.
+
+source ./functions.sh
+set -x
+set -u
+set -e
+
+requires_run
+requires_nbdsh_uri
+
+debug="test-worker-threads.debug"
+rm -f $debug
+cleanup_fn rm -f $debug
+
+# A client which only issues one request at a time should not cause
+# nbdkit to start the whole thread pool.
+nbdkit -v -t 16 memory 1M \
+       --run 'nbdsh -u "$uri" -c "
+for i in range(100):
+    h.pread(512, i * 512)
+"' |& tee $debug
+
+n=$(grep -c 'debug: starting worker thread' $debug)
+test "$n" -ge 1
+test "$n" -lt 16
+
+# Many requests in flight should start more threads, but no more than
+# the limit.
+nbdkit -v -t 4 memory 1M \
+       --run 'nbdsh -u "$uri" -c "
+buf = nbd.Buffer(512)
+for i in range(64):
+    h.aio_pread(buf, i * 512)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+"' |& tee $debug
+
+grep 'processing requests with up to 4 threads' $debug